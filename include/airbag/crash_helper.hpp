@@ -0,0 +1,183 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "minidump.hpp"
+#include "process_error.hpp"
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Pre-forked process writing minidumps of this one: failed thread only
+  // sends its context and waits while the helper reads its memory by
+  // process_vm_readv
+
+  class crash_helper {
+  public:
+
+    crash_helper() noexcept = default;
+    crash_helper(crash_helper const&) = delete;
+    crash_helper& operator = (crash_helper const&) = delete;
+    ~crash_helper() { stop(); }
+
+
+    // Forks helper with a copy of dump settings, better before threads are spawned.
+    // Zero timeout is 3/4 of process_error::handler_budget(), so the failed
+    // process is not killed by the budget while helper still reads it
+
+    bool start(minidump const& dump, int timeout_ms = 0) {
+      if(helper_ != -1)
+        return false;
+      int sockets[2];
+      if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0)
+        return false;
+      pid_t const target = getpid();
+      pid_t const helper = fork();
+      if(helper == -1) {
+        close(sockets[0]);
+        close(sockets[1]);
+        return false;
+      }
+      if(helper == 0) {
+        close(sockets[0]);
+        serve(sockets[1], target, dump);
+      }
+      close(sockets[1]);
+      prctl(PR_SET_PTRACER, helper, 0, 0, 0); // Yama would deny process_vm_readv
+      socket_ = sockets[0];
+      helper_ = helper;
+      timeout_ = timeout_ms;
+      return true;
+    }
+
+
+    bool running() const noexcept { return helper_ != -1; }
+    pid_t helper() const noexcept { return helper_; }
+
+
+    // Helper exits when the socket is closed
+
+    void stop() noexcept {
+      if(helper_ == -1)
+        return;
+      close(socket_);
+      waitpid(helper_, nullptr, 0);
+      socket_ = -1;
+      helper_ = -1;
+    }
+
+
+    // From fault handler: returns when the helper has written the dump
+
+    bool generate(system_failure const& failure) noexcept {
+      if(helper_ == -1 || failure.context() == nullptr
+         || busy_.exchange(true, std::memory_order_acquire))
+        return false;
+      auto const crash = minidump_writer::crash::of(failure);
+      bool done = false;
+      if(send(socket_, &crash, sizeof(crash), MSG_NOSIGNAL) == ssize_t(sizeof(crash))) {
+        pollfd ready{socket_, POLLIN, 0};
+        int const timeout = timeout_ != 0 ? timeout_ : default_timeout();
+        int polled;
+        do
+          polled = poll(&ready, 1, timeout);
+        while(polled < 0 && errno == EINTR);
+        uint64_t reply = 0;
+        if(polled == 1 && recv(socket_, &reply, sizeof(reply), 0) == ssize_t(sizeof(reply)))
+          done = reply != 0;
+      }
+      busy_.store(false, std::memory_order_release);
+      return done;
+    }
+
+
+  private:
+
+    int socket_{-1};
+    pid_t helper_{-1};
+    int timeout_{0};
+    std::atomic_bool busy_{false};
+
+
+    static int default_timeout() noexcept {
+      long long const budget = process_error::handler_budget().count();
+      return budget == 0 ? 60000 : int(budget * 750);
+    }
+
+
+    [[noreturn]] static void serve(int socket, pid_t target, minidump const& settings) noexcept {
+      for(int signal: {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT})
+        ::signal(signal, SIG_DFL);
+      ::signal(SIGINT, SIG_IGN);
+      ::signal(SIGPIPE, SIG_IGN);
+      try {
+        minidump dump = settings;
+        dump.workers(settings.workers()); // threads are not inherited by fork
+        // Spool of the target is its own, helper prepares one named by its pid
+        if(settings.prepared() && !dump.prepare(settings.reserved()))
+          dump.directory(settings.directory());
+        minidump_writer::crash crash;
+        for(;;) {
+          ssize_t const n = recv(socket, &crash, sizeof(crash), 0);
+          if(n < 0 && errno == EINTR)
+            continue;
+          if(n <= 0)
+            break;
+          if(n != ssize_t(sizeof(crash)))
+            continue;
+          crash.pid = target;
+          uint64_t const reply = dump.generate(crash) ? 1 : 0;
+          send(socket, &reply, sizeof(reply), MSG_NOSIGNAL);
+        }
+      } catch(...) {
+      }
+      _exit(0);
+    }
+
+  }; // crash_helper
+
+
+} // airbag
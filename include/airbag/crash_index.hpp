@@ -0,0 +1,441 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "module_map.hpp"
+#include "system_failure.hpp"
+
+
+#if defined(_WIN32)
+
+#if !defined(_X86_) && !defined(_AMD64_) && !defined(_ARM_) && !defined(_ARM64_)
+#if defined(_M_IX86)
+#define _X86_
+#elif defined(_M_AMD64)
+#define _AMD64_
+#elif defined(_M_ARM)
+#define _ARM_
+#elif defined(_M_ARM64)
+#define _ARM64_
+#endif
+#endif
+
+#include <minwindef.h>
+#include <fileapi.h>
+#include <handleapi.h>
+#include <memoryapi.h>
+#include <processthreadsapi.h>
+#include <sysinfoapi.h>
+#include <winbase.h>
+#include <winerror.h>
+
+#elif defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Failures already dumped, by fingerprint (code, module and top frames as
+  // module offsets), in a small file mapped in the dump directory and shared
+  // by processes using it. Repeated failure only increments its counter.
+  // Budget of the directory is enforced at startup, never at crash time
+
+  class crash_index {
+  public:
+
+    using path_type = std::filesystem::path;
+
+    static constexpr size_t capacity = 256;
+    static constexpr size_t fingerprint_frames = 8;
+    static constexpr char const* file_name = "airbag.index";
+
+    struct budget {
+      uint64_t bytes{0}; // zero - unlimited
+      size_t files{0};
+    }; // budget
+
+    // Layout of the file
+    struct record {
+      std::atomic<uint64_t> fingerprint; // zero - vacant
+      std::atomic<uint32_t> count;
+      uint32_t code;
+      std::atomic<uint64_t> first_seen; // seconds since epoch
+      std::atomic<uint64_t> last_seen;
+      char module[48];
+      char dump[80]; // name of the dump written for it, empty if there is none
+    }; // record
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared mapping needs lock-free atomics");
+
+
+    crash_index() noexcept = default;
+    crash_index(crash_index const&) = delete;
+    crash_index& operator = (crash_index const&) = delete;
+    ~crash_index() { close(); }
+
+
+    // Creates or maps <dir>/airbag.index, file of another layout is replaced
+
+    bool open(path_type const& dir) {
+      close();
+      std::error_code failed;
+      std::filesystem::create_directories(dir, failed);
+      if(!!failed)
+        return false;
+      std::string const path = (dir / file_name).string();
+      if(!map(path.data()))
+        return false;
+      if(file_->magic != magic || file_->version != version || file_->records_count != capacity) {
+        std::memset(static_cast<void*>(file_), 0, sizeof(layout));
+        file_->records_count = capacity;
+        file_->version = version;
+        file_->magic = magic;
+      }
+      return true;
+    }
+
+
+    bool opened() const noexcept { return file_ != nullptr; }
+
+
+    // Stable across runs: frames are taken as offsets in their modules
+
+    static uint64_t fingerprint(system_failure const& failure) noexcept {
+      uint64_t h = fnv_basis;
+      auto const code = uint64_t(failure.code());
+      h = hash(h, &code, sizeof(code));
+      h = hash(h, failure.module_name(), std::strlen(failure.module_name()));
+      size_t const n = std::min(failure.frames_count(), fingerprint_frames);
+      for(size_t i = 0; i != n; ++i) {
+        auto const address = uintptr_t(failure.frames()[i]);
+        uint64_t offset = address;
+        module_map::find(address, [&](module_map::module const& m) {
+          char const* const name = base_name(m.path);
+          h = hash(h, name, std::strlen(name));
+          offset = address - m.base;
+        });
+        h = hash(h, &offset, sizeof(offset));
+      }
+      return h == 0 ? 1 : h;
+    }
+
+
+    // Counts the failure (crash path), nullptr if index is not opened or full
+
+    record* hit(uint64_t fingerprint, system_failure const& failure) noexcept {
+      if(file_ == nullptr)
+        return nullptr;
+      uint64_t const now = seconds();
+      for(size_t probe = 0; probe != capacity; ++probe) {
+        record& r = file_->records[(fingerprint + probe) % capacity];
+        uint64_t current = r.fingerprint.load(std::memory_order_acquire);
+        if(current == 0
+           && r.fingerprint.compare_exchange_strong(current, fingerprint, std::memory_order_acq_rel)) {
+          r.code = uint32_t(failure.code());
+          char const* const module = failure.module_name();
+          size_t const size = std::min(std::strlen(module), sizeof(r.module) - 1);
+          std::memcpy(r.module, module, size);
+          r.module[size] = '\0';
+          r.dump[0] = '\0';
+          r.first_seen.store(now, std::memory_order_relaxed);
+          current = fingerprint;
+        }
+        if(current != fingerprint)
+          continue;
+        r.last_seen.store(now, std::memory_order_relaxed);
+        r.count.fetch_add(1, std::memory_order_relaxed);
+        return &r;
+      }
+      return nullptr;
+    }
+
+
+    // Failure with existing dump is not dumped again
+
+    static bool dumped(record const& r) noexcept {
+      return r.dump[0] != '\0';
+    }
+
+
+    static void assign_dump(record& r, char const* path) noexcept {
+      char const* const name = base_name(path);
+      size_t const size = std::min(std::strlen(name), sizeof(r.dump) - 1);
+      std::memcpy(r.dump, name, size);
+      r.dump[size] = '\0';
+    }
+
+
+    // f(record const&) for occupied records
+
+    template<typename F> size_t visit(F&& f) const {
+      if(file_ == nullptr)
+        return 0;
+      size_t visited = 0;
+      for(size_t i = 0; i != capacity; ++i)
+        if(file_->records[i].fingerprint.load(std::memory_order_acquire) != 0) {
+          f(static_cast<record const&>(file_->records[i]));
+          ++visited;
+        }
+      return visited;
+    }
+
+
+    // Removes spools of processes not running anymore, then the oldest files
+    // while directory exceeds budget. Only files written for prefix are
+    // counted and removed (<prefix>-<time>.dmp or .txt and their spools),
+    // others in the directory are left alone. Records whose dumps are gone
+    // forget them, so their next failure is dumped again. Returns files removed
+
+    size_t enforce(path_type const& dir, std::string const& prefix, budget const& limit) {
+      namespace fs = std::filesystem;
+      struct entry {
+        fs::path path;
+        fs::file_time_type time;
+        uint64_t size;
+      };
+      std::vector<entry> files;
+      size_t removed = 0;
+      uint64_t total = 0;
+      std::error_code failed;
+      for(auto const& each: fs::directory_iterator{dir, failed}) {
+        std::error_code ignored;
+        if(!each.is_regular_file(ignored) || !written_for(each.path().filename().string(), prefix))
+          continue;
+        auto const extension = each.path().extension();
+        if(extension == ".spool") {
+          if(!alive(spool_owner(each.path().stem().string())) && fs::remove(each.path(), ignored))
+            ++removed;
+          continue; // the live ones are preallocated, not written yet
+        }
+        if(extension != ".dmp" && extension != ".txt")
+          continue;
+        entry e{each.path(), each.last_write_time(ignored), uint64_t(each.file_size(ignored))};
+        total += e.size;
+        files.push_back(std::move(e));
+      }
+      std::sort(files.begin(), files.end(), [](entry const& a, entry const& b) {
+        return a.time < b.time;
+      });
+      size_t count = files.size();
+      for(auto const& each: files) {
+        bool const over_bytes = limit.bytes != 0 && total > limit.bytes;
+        bool const over_files = limit.files != 0 && count > limit.files;
+        if(!over_bytes && !over_files)
+          break;
+        std::error_code ignored;
+        if(!fs::remove(each.path, ignored))
+          continue;
+        total -= each.size;
+        --count;
+        ++removed;
+      }
+      if(file_ != nullptr)
+        for(size_t i = 0; i != capacity; ++i) {
+          record& r = file_->records[i];
+          std::error_code ignored;
+          if(r.fingerprint.load(std::memory_order_acquire) != 0 && dumped(r)
+             && !fs::exists(dir / r.dump, ignored))
+            r.dump[0] = '\0';
+        }
+      return removed;
+    }
+
+
+  private:
+
+    static constexpr uint32_t magic = 0x58444941; // "AIDX"
+    static constexpr uint32_t version = 1;
+    static constexpr uint64_t fnv_basis = 14695981039346656037ull;
+    static constexpr uint64_t fnv_prime = 1099511628211ull;
+
+    struct layout {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t records_count;
+      uint32_t reserved;
+      record records[capacity];
+    }; // layout
+
+    layout* file_{nullptr};
+#if defined(_WIN32)
+    HANDLE mapping_{nullptr};
+#endif
+
+
+    static uint64_t hash(uint64_t h, void const* data, size_t size) noexcept {
+      auto const* bytes = static_cast<unsigned char const*>(data);
+      for(size_t i = 0; i != size; ++i)
+        h = (h ^ bytes[i]) * fnv_prime;
+      return h;
+    }
+
+
+    static char const* base_name(char const* path) noexcept {
+      char const* name = path;
+      for(char const* p = path; *p != '\0'; ++p)
+        if(*p == '/' || *p == '\\')
+          name = p + 1;
+      return name;
+    }
+
+
+    // <prefix>-<time> or <prefix>-<pid>, another program named <prefix>-<word>
+    // does not match
+
+    static bool written_for(std::string const& name, std::string const& prefix) noexcept {
+      size_t const n = prefix.size();
+      return name.size() > n + 1 && name.compare(0, n, prefix) == 0 && name[n] == '-'
+          && name[n + 1] >= '0' && name[n + 1] <= '9';
+    }
+
+
+    // Spool is named <prefix>-<pid><extension>.spool, pid ends at the dot
+
+    static long spool_owner(std::string const& stem) {
+      size_t const dash = stem.rfind('-');
+      if(dash == std::string::npos)
+        return 0;
+      return std::strtol(stem.data() + dash + 1, nullptr, 10);
+    }
+
+
+#if defined(_WIN32)
+
+    static uint64_t seconds() noexcept {
+      FILETIME time;
+      GetSystemTimeAsFileTime(&time);
+      uint64_t const ticks = (uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+      return ticks / 10000000 - 11644473600ull; // since 1601
+    }
+
+
+    static bool alive(long pid) noexcept {
+      if(pid <= 0)
+        return false;
+      HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, DWORD(pid));
+      if(process == nullptr)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+      DWORD exit_code = 0;
+      bool const running = GetExitCodeProcess(process, &exit_code) && exit_code == STILL_ACTIVE;
+      CloseHandle(process);
+      return running;
+    }
+
+
+    bool map(char const* path) noexcept {
+      auto constexpr generic_read = 0x80000000;
+      auto constexpr generic_write = 0x40000000;
+      auto constexpr file_attribute_normal = 0x00000080;
+      HANDLE file = CreateFileA(path, generic_read | generic_write, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                nullptr, OPEN_ALWAYS, file_attribute_normal, nullptr);
+      if(file == INVALID_HANDLE_VALUE)
+        return false;
+      mapping_ = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, DWORD(sizeof(layout)), nullptr);
+      CloseHandle(file);
+      if(mapping_ == nullptr)
+        return false;
+      file_ = static_cast<layout*>(MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0, sizeof(layout)));
+      if(file_ != nullptr)
+        return true;
+      CloseHandle(mapping_);
+      mapping_ = nullptr;
+      return false;
+    }
+
+
+    void close() noexcept {
+      if(file_ == nullptr)
+        return;
+      UnmapViewOfFile(file_);
+      CloseHandle(mapping_);
+      file_ = nullptr;
+      mapping_ = nullptr;
+    }
+
+#else
+
+    static uint64_t seconds() noexcept {
+      timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      return uint64_t(now.tv_sec);
+    }
+
+
+    static bool alive(long pid) noexcept {
+      return pid > 0 && (kill(pid_t(pid), 0) == 0 || errno == EPERM);
+    }
+
+
+    bool map(char const* path) noexcept {
+      int const fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if(fd == -1)
+        return false;
+      bool const sized = ftruncate(fd, off_t(sizeof(layout))) == 0;
+      void* memory = sized ? mmap(nullptr, sizeof(layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                           : MAP_FAILED;
+      ::close(fd);
+      if(memory == MAP_FAILED)
+        return false;
+      file_ = static_cast<layout*>(memory);
+      return true;
+    }
+
+
+    void close() noexcept {
+      if(file_ == nullptr)
+        return;
+      munmap(file_, sizeof(layout));
+      file_ = nullptr;
+    }
+
+#endif
+
+  }; // crash_index
+
+
+} // airbag
@@ -0,0 +1,185 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <system_error>
+#include "system_failure.hpp"
+#include "flight_recorder.hpp"
+#include "module_map.hpp"
+#include "dump_file.hpp"
+
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "signal_safe.hpp"
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Text crash report written from the fault handler without heap and stdio
+
+  class crash_report {
+  public:
+
+    using path_type = std::filesystem::path;
+
+
+    static std::error_code last_error() {
+      return {errno, std::system_category()};
+    }
+
+
+    crash_report() {
+      path_type const executable = executable_path();
+      executable_name_ = executable.stem().string();
+      dump_dir_ = (executable.parent_path() / "crash").string();
+    }
+
+
+    explicit crash_report(path_type const& dir): dump_dir_{dir.string()} {
+      executable_name_ = executable_path().stem().string();
+    }
+
+
+    crash_report(crash_report const&) = default;
+    crash_report& operator = (crash_report const&) = default;
+    crash_report(crash_report&&) = default;
+    crash_report& operator = (crash_report&&) = default;
+    void directory(path_type const& dir) { dump_dir_ = dir.string(); target_.reset(); }
+    path_type directory() const { return path_type{dump_dir_}; }
+
+
+    // Opt-in: directory and preallocated file are made ready here, so
+    // generate() only writes into already open file
+
+    bool prepare(size_t reserved = 64 * 1024) {
+      auto target = std::make_shared<dump_file>();
+      if(!target->prepare(dump_dir_, executable_name_, ".txt", reserved))
+        return false;
+      target_ = std::move(target);
+      return true;
+    }
+
+
+    bool generate(system_failure const& failure) const noexcept {
+      if(target_ && target_->prepared()) {
+        bool const written = write(target_->handle(), failure);
+        return target_->commit() && written;
+      }
+
+      char path[PATH_MAX];
+      size_t size = 0;
+      auto const append = [&](char const* s, size_t n) {
+        if(size + n >= sizeof(path))
+          n = sizeof(path) - size - 1;
+        memcpy(path + size, s, n);
+        size += n;
+      };
+      append(dump_dir_.data(), dump_dir_.size());
+      append("/", 1);
+      append(executable_name_.data(), executable_name_.size());
+      append("-", 1);
+      char time[32];
+      append(time, dump_file::format_time(time));
+      append(".txt", 4);
+      path[size] = '\0';
+
+      if(mkdir(dump_dir_.data(), 0755) != 0 && errno != EEXIST)
+        return false;
+      int const fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if(fd == -1)
+        return false;
+      bool const written = write(fd, failure);
+      close(fd);
+      return written;
+    }
+
+
+    static bool write(int fd, system_failure const& failure) noexcept {
+      signal_safe::writer out{fd};
+      out.text("airbag crash report\n");
+      out.text("pid ").decimal(uint64_t(getpid())).character('\n');
+      out.text("failure ").text(failure.title()).character('\n');
+      out.text("signal ").decimal(uint64_t(failure.code()))
+         .text(" code ").decimal(uint64_t(int64_t(failure.subcode())))
+         .text(" address ").hex(uint64_t(failure.address()))
+         .text(" module ").text(failure.module_name()).character('\n');
+      if(failure.info() != nullptr)
+        out.text("fault address ").hex(uint64_t(failure.info()->si_addr)).character('\n');
+      out.text("\nmodules\n");
+      module_map::visit([&](module_map::module const& m) {
+        static constexpr char hex_digits[] = "0123456789abcdef";
+        out.text("  ").hex(m.base).character(' ').hex(m.size).character(' ');
+        for(size_t i = 0; i != m.build_id_size; ++i)
+          out.character(hex_digits[m.build_id[i] >> 4]).character(hex_digits[m.build_id[i] & 0xF]);
+        if(m.build_id_size == 0)
+          out.character('-');
+        out.character(' ').text(m.path).character('\n');
+      });
+      out.text("\nframes\n");
+      for(size_t i = 0; i != failure.frames_count(); ++i)
+        out.text("  ").hex(uint64_t(failure.frames()[i])).character('\n');
+      out.text("\nflight recorder\n");
+      if(!out.flush())
+        return false;
+      flight_recorder::dump(fd);
+      return true;
+    }
+
+
+  private:
+
+    std::string dump_dir_;
+    std::string executable_name_;
+    std::shared_ptr<dump_file> target_;
+
+
+    static path_type executable_path() {
+      char path_buffer[PATH_MAX];
+      ssize_t const size = readlink("/proc/self/exe", path_buffer, sizeof(path_buffer) - 1);
+      path_buffer[size < 0 ? 0 : size] = '\0';
+      return path_type{path_buffer};
+    }
+
+  }; // crash_report
+
+
+} // airbag
@@ -0,0 +1,283 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+
+
+#if defined(_WIN32)
+
+#if !defined(_X86_) && !defined(_AMD64_) && !defined(_ARM_) && !defined(_ARM64_)
+#if defined(_M_IX86)
+#define _X86_
+#elif defined(_M_AMD64)
+#define _AMD64_
+#elif defined(_M_ARM)
+#define _ARM_
+#elif defined(_M_ARM64)
+#define _ARM64_
+#endif
+#endif
+
+#include <minwindef.h>
+#include <fileapi.h>
+#include <handleapi.h>
+#include <sysinfoapi.h>
+#include <winbase.h>
+
+#elif defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Spool file opened and preallocated in advance. On failure the dump is
+  // written into already open file, then the file is renamed to
+  // <prefix>-<time><extension> and new spool is prepared for the next use
+
+  class dump_file {
+  public:
+
+    using path_type = std::filesystem::path;
+#if defined(_WIN32)
+    using native_handle_type = HANDLE;
+    static inline native_handle_type const invalid_handle = INVALID_HANDLE_VALUE;
+#else
+    using native_handle_type = int;
+    static constexpr native_handle_type invalid_handle = -1;
+#endif
+
+    static constexpr size_t path_capacity = 1024;
+
+
+    dump_file() noexcept = default;
+    dump_file(dump_file const&) = delete;
+    dump_file& operator = (dump_file const&) = delete;
+
+
+    ~dump_file() noexcept {
+      if(handle_ == invalid_handle)
+        return;
+      close(handle_);
+      remove(spool_path_);
+    }
+
+
+    bool prepare(path_type const& dir, std::string const& prefix, char const* extension,
+                 size_t reserved) {
+      std::error_code failed;
+      std::filesystem::create_directories(dir, failed);
+      if(!!failed)
+        return false;
+      std::string const base = (dir / prefix).string();
+      // Extension keeps spools of minidump and crash report of one process apart
+      std::string const spool = base + '-' + std::to_string(process_id()) + extension + ".spool";
+      if(spool.size() >= path_capacity || base.size() + 36 + std::strlen(extension) >= path_capacity)
+        return false;
+      std::memcpy(spool_path_, spool.data(), spool.size() + 1);
+      std::memcpy(dump_path_, base.data(), base.size());
+      prefix_size_ = base.size();
+      dump_path_[prefix_size_] = '-';
+      std::memcpy(extension_, extension, std::strlen(extension) + 1);
+      reserved_ = reserved;
+      return open_spool();
+    }
+
+
+    bool prepared() const noexcept { return handle_ != invalid_handle; }
+    native_handle_type handle() const noexcept { return handle_; }
+
+
+    // Renames written spool to the dump name, prepares the next spool.
+    // Size of written data is the current file offset unless specified
+
+    bool commit(uint64_t written = 0) noexcept {
+      if(handle_ == invalid_handle)
+        return false;
+      size_t size = prefix_size_ + 1;
+      size += format_time(dump_path_ + size);
+      size_t const extension_size = std::strlen(extension_);
+      std::memcpy(dump_path_ + size, extension_, extension_size + 1);
+      // Failures within the same second get -1, -2, ... not to replace each other
+      for(unsigned n = 1; exists(dump_path_) && n != 1000; ++n) {
+        char* p = dump_path_ + size;
+        *p++ = '-';
+        for(unsigned divisor = n >= 100 ? 100 : n >= 10 ? 10 : 1; divisor != 0; divisor /= 10)
+          *p++ = char('0' + n / divisor % 10);
+        std::memcpy(p, extension_, extension_size + 1);
+      }
+#if defined(_WIN32)
+      (void)written; // allocation beyond end of file is released on close
+#else
+      if(written == 0)
+        written = uint64_t(lseek(handle_, 0, SEEK_CUR));
+      ftruncate(handle_, off_t(written)); // drops unused preallocated tail
+#endif
+      close(handle_);
+      handle_ = invalid_handle;
+      bool const renamed = rename(spool_path_, dump_path_);
+      open_spool();
+      return renamed;
+    }
+
+
+    char const* last_path() const noexcept { return dump_path_; }
+
+
+    // "YYYY_MM_DD-hh_mm_ss" in UTC, 19 characters, without locale and heap
+
+    static size_t format_time(char* buffer) noexcept {
+#if defined(_WIN32)
+      SYSTEMTIME time;
+      GetSystemTime(&time);
+      int64_t const year = time.wYear, month = time.wMonth, day = time.wDay;
+      int64_t const rest = time.wHour * 3600 + time.wMinute * 60 + time.wSecond;
+#else
+      int64_t const seconds = int64_t(::time(nullptr));
+      int64_t days = seconds / 86400;
+      int64_t rest = seconds % 86400;
+      if(rest < 0) {
+        rest += 86400; --days;
+      }
+      // Civil from days, http://howardhinnant.github.io/date_algorithms.html
+      days += 719468;
+      int64_t const era = (days >= 0 ? days : days - 146096) / 146097;
+      int64_t const day_of_era = days - era * 146097;
+      int64_t const year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+      int64_t const day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+      int64_t const mp = (5 * day_of_year + 2) / 153;
+      int64_t const day = day_of_year - (153 * mp + 2) / 5 + 1;
+      int64_t const month = mp < 10 ? mp + 3 : mp - 9;
+      int64_t const year = year_of_era + era * 400 + (month <= 2);
+#endif
+      auto two_digits = [](char* to, int64_t value) {
+        to[0] = char('0' + value / 10);
+        to[1] = char('0' + value % 10);
+      };
+      buffer[0] = char('0' + year / 1000 % 10);
+      buffer[1] = char('0' + year / 100 % 10);
+      two_digits(buffer + 2, year % 100);
+      buffer[4] = '_';
+      two_digits(buffer + 5, month);
+      buffer[7] = '_';
+      two_digits(buffer + 8, day);
+      buffer[10] = '-';
+      two_digits(buffer + 11, rest / 3600);
+      buffer[13] = '_';
+      two_digits(buffer + 14, rest / 60 % 60);
+      buffer[16] = '_';
+      two_digits(buffer + 17, rest % 60);
+      return 19;
+    }
+
+
+  private:
+
+    native_handle_type handle_{invalid_handle};
+    size_t reserved_{0};
+    size_t prefix_size_{0};
+    char spool_path_[path_capacity]{};
+    char dump_path_[path_capacity]{};
+    char extension_[16]{};
+
+
+#if defined(_WIN32)
+
+    static unsigned long process_id() noexcept { return GetCurrentProcessId(); }
+
+
+    bool open_spool() noexcept {
+      auto constexpr generic_read = 0x80000000;
+      auto constexpr generic_write = 0x40000000;
+      auto constexpr file_attribute_normal = 0x00000080;
+      handle_ = CreateFileA(spool_path_, generic_read | generic_write, 0,
+        nullptr, CREATE_ALWAYS, file_attribute_normal, nullptr);
+      if(handle_ == invalid_handle)
+        return false;
+      // Reserves disk space, end of file is left at zero
+      FILE_ALLOCATION_INFO allocation;
+      allocation.AllocationSize.QuadPart = LONGLONG(reserved_);
+      SetFileInformationByHandle(handle_, FileAllocationInfo, &allocation, sizeof(allocation));
+      return true;
+    }
+
+
+    static void close(native_handle_type handle) noexcept { CloseHandle(handle); }
+    static void remove(char const* path) noexcept { DeleteFileA(path); }
+    static bool exists(char const* path) noexcept { return GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES; }
+
+
+    static bool rename(char const* from, char const* to) noexcept {
+      return !!MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+    }
+
+#else
+
+    static long process_id() noexcept { return long(getpid()); }
+
+
+    bool open_spool() noexcept {
+      handle_ = ::open(spool_path_, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if(handle_ == invalid_handle)
+        return false;
+      // Reserves disk blocks, file is truncated to written size on commit
+      if(reserved_ != 0)
+        fallocate(handle_, 0, 0, off_t(reserved_));
+      return true;
+    }
+
+
+    static void close(native_handle_type handle) noexcept { ::close(handle); }
+    static void remove(char const* path) noexcept { ::unlink(path); }
+    static bool exists(char const* path) noexcept { return ::access(path, F_OK) == 0; }
+
+
+    static bool rename(char const* from, char const* to) noexcept {
+      return ::rename(from, to) == 0;
+    }
+
+#endif
+
+  }; // dump_file
+
+
+} // airbag
@@ -0,0 +1,152 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+
+
+namespace airbag {
+
+
+  // Address ranges where faults are expected (guard pages of a GC, JIT code
+  // with implicit null checks, userfaultfd regions). Such faults are passed
+  // to previous handlers without building system_failure or calling hooks.
+  // Lookup is a seqlock read of a fixed table: no locks, no waiting
+
+  class fault_filter {
+  public:
+
+    using id_type = unsigned;
+
+    static constexpr size_t capacity = 64;
+    static constexpr id_type invalid_id = 0;
+
+
+    // Returns invalid_id when table is full
+
+    static id_type add(void const* address, size_t size) noexcept {
+      std::lock_guard<std::mutex> lock{writer_};
+      size_t const n = count_.load(std::memory_order_relaxed);
+      if(n == capacity || size == 0)
+        return invalid_id;
+      id_type const id = ++last_id_;
+      ids_[n] = id;
+      begin_update();
+      ranges_[n].begin.store(uintptr_t(address), std::memory_order_relaxed);
+      ranges_[n].end.store(uintptr_t(address) + size, std::memory_order_relaxed);
+      count_.store(n + 1, std::memory_order_relaxed);
+      end_update();
+      return id;
+    }
+
+
+    static bool remove(id_type id) noexcept {
+      std::lock_guard<std::mutex> lock{writer_};
+      size_t const n = count_.load(std::memory_order_relaxed);
+      for(size_t i = 0; i != n; ++i) {
+        if(ids_[i] != id)
+          continue;
+        // Last range takes place of removed one
+        ids_[i] = ids_[n - 1];
+        begin_update();
+        ranges_[i].begin.store(ranges_[n - 1].begin.load(std::memory_order_relaxed),
+                               std::memory_order_relaxed);
+        ranges_[i].end.store(ranges_[n - 1].end.load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+        count_.store(n - 1, std::memory_order_relaxed);
+        end_update();
+        return true;
+      }
+      return false;
+    }
+
+
+    // Gives up (not benign) if table keeps changing, e.g. when the writer itself faulted
+
+    static bool contains(uintptr_t address) noexcept {
+      constexpr int attempts = 16;
+      for(int attempt = 0; attempt != attempts; ++attempt) {
+        unsigned const sequence = sequence_.load(std::memory_order_acquire);
+        if(sequence & 1)
+          continue;
+        size_t const n = count_.load(std::memory_order_relaxed);
+        bool found = false;
+        for(size_t i = 0; i != n && i != capacity; ++i)
+          if(address >= ranges_[i].begin.load(std::memory_order_relaxed)
+             && address < ranges_[i].end.load(std::memory_order_relaxed)) {
+            found = true;
+            break;
+          }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(sequence_.load(std::memory_order_relaxed) == sequence)
+          return found;
+      }
+      return false;
+    }
+
+
+    static bool empty() noexcept {
+      return count_.load(std::memory_order_relaxed) == 0;
+    }
+
+
+  private:
+
+    struct range {
+      std::atomic<uintptr_t> begin{0};
+      std::atomic<uintptr_t> end{0};
+    }; // range
+
+    static std::mutex writer_;
+    static std::atomic<unsigned> sequence_;
+    static std::atomic<size_t> count_;
+    static range ranges_[capacity];
+    static id_type ids_[capacity];
+    static id_type last_id_;
+
+
+    static void begin_update() noexcept {
+      sequence_.store(sequence_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+
+
+    static void end_update() noexcept {
+      sequence_.store(sequence_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+  }; // fault_filter
+
+  inline std::mutex fault_filter::writer_;
+  inline std::atomic<unsigned> fault_filter::sequence_{0};
+  inline std::atomic<size_t> fault_filter::count_{0};
+  inline fault_filter::range fault_filter::ranges_[fault_filter::capacity];
+  inline fault_filter::id_type fault_filter::ids_[fault_filter::capacity];
+  inline fault_filter::id_type fault_filter::last_id_{fault_filter::invalid_id};
+
+
+} // airbag
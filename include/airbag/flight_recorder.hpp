@@ -0,0 +1,256 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <initializer_list>
+
+
+#if defined(_WIN32)
+
+#if !defined(_X86_) && !defined(_AMD64_) && !defined(_ARM_) && !defined(_ARM64_)
+#if defined(_M_IX86)
+#define _X86_
+#elif defined(_M_AMD64)
+#define _AMD64_
+#elif defined(_M_ARM)
+#define _ARM_
+#elif defined(_M_ARM64)
+#define _ARM64_
+#endif
+#endif
+
+#include <intrin.h>
+#include <minwindef.h>
+#include <processthreadsapi.h>
+
+#elif defined(__linux__)
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "signal_safe.hpp"
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Per thread rings of last breadcrumbs, dumped into crash report.
+  // Writer is the owning thread only, so recording is a few plain stores
+
+  class flight_recorder {
+  public:
+
+    static constexpr size_t ring_capacity = 256; // power of two
+    static constexpr size_t rings_capacity = 512;
+    static constexpr uint32_t stream_type = 0x41420001; // minidump user stream
+
+    struct breadcrumb {
+      uint64_t time;
+      uint64_t event;
+      uint64_t args[2];
+    }; // breadcrumb
+
+
+    struct alignas(64) ring {
+      std::atomic<uint64_t> head;
+      std::atomic<uint32_t> state;
+      uint32_t thread_id;
+      alignas(64) breadcrumb items[ring_capacity];
+    }; // ring
+
+
+    static void record(uint64_t event, uint64_t arg0 = 0, uint64_t arg1 = 0) noexcept {
+      ring* r = current_.attached;
+      if(r == nullptr) {
+        r = current_.attach();
+        if(r == nullptr)
+          return;
+      }
+      uint64_t const head = r->head.load(std::memory_order_relaxed);
+      breadcrumb& item = r->items[head & (ring_capacity - 1)];
+      item.time = ticks();
+      item.event = event;
+      item.args[0] = arg0;
+      item.args[1] = arg1;
+      r->head.store(head + 1, std::memory_order_release);
+    }
+
+
+    // f(ring const&) for every ring in use, including ones of exited threads
+
+    template<typename F> static void visit(F&& f) noexcept {
+      for(ring const& each: rings_)
+        if(used(each))
+          f(each);
+    }
+
+
+    // Pool of all rings, forked helper finds them at the same address
+
+    static ring const* rings() noexcept { return rings_; }
+    static bool used(ring const& r) noexcept {
+      return r.state.load(std::memory_order_acquire) != free_ring;
+    }
+
+
+    static uint64_t ticks() noexcept {
+#if defined(_WIN32)
+#if defined(_M_IX86) || defined(_M_AMD64)
+      return __rdtsc();
+#else
+      return uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+#elif defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#elif defined(__aarch64__)
+      uint64_t value;
+      asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+      return value;
+#else
+      return uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+
+#if defined(__linux__)
+
+    // Text dump of all rings oldest first, async-signal-safe
+
+    static void dump(int fd) noexcept {
+      signal_safe::writer out{fd};
+      timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      uint64_t const now_ticks = ticks();
+      uint64_t const now_ns = uint64_t(now.tv_sec) * 1000000000ull + uint64_t(now.tv_nsec);
+      double const ns_per_tick = now_ticks == origin_ticks_ ? 1.
+        : double(now_ns - origin_ns_) / double(now_ticks - origin_ticks_);
+
+      visit([&](ring const& r) {
+        uint64_t const head = r.head.load(std::memory_order_acquire);
+        uint64_t const count = head < ring_capacity ? head : ring_capacity - 1;
+        out.text("thread ").decimal(r.thread_id).text(" breadcrumbs ").decimal(count).character('\n');
+        for(uint64_t i = head - count; i != head; ++i) {
+          breadcrumb const& item = r.items[i & (ring_capacity - 1)];
+          // Milliseconds before the dump
+          uint64_t const age = now_ticks > item.time ? uint64_t(double(now_ticks - item.time) * ns_per_tick) : 0;
+          out.text("  -").decimal(age / 1000000).character('.');
+          char fraction[6]; size_t const n = signal_safe::format_decimal(fraction, age % 1000000);
+          for(size_t z = n; z != 6; ++z)
+            out.character('0');
+          out.text(fraction, n).text(" ms event ").decimal(item.event)
+             .character(' ').hex(item.args[0]).character(' ').hex(item.args[1]).character('\n');
+        }
+      });
+    }
+
+#endif
+
+
+  private:
+
+    static constexpr uint32_t free_ring = 0;
+    static constexpr uint32_t active_ring = 1;
+    static constexpr uint32_t orphan_ring = 2;
+
+
+    struct attachment {
+
+      ring* attached{nullptr};
+
+
+      ring* attach() noexcept {
+        uint32_t const id = thread_id();
+        // Prefer a ring never used, then a ring left by exited thread
+        for(uint32_t wanted: {free_ring, orphan_ring}) {
+          for(size_t i = 0; i != rings_capacity; ++i) {
+            ring& candidate = rings_[(id + i) % rings_capacity];
+            uint32_t expected = wanted;
+            if(!candidate.state.compare_exchange_strong(expected, active_ring))
+              continue;
+            candidate.thread_id = id;
+            candidate.head.store(0, std::memory_order_relaxed);
+            calibrate();
+            attached = &candidate;
+            return attached;
+          }
+        }
+        return nullptr;
+      }
+
+
+      ~attachment() noexcept {
+        if(attached != nullptr)
+          attached->state.store(orphan_ring, std::memory_order_release);
+      }
+
+    }; // attachment
+
+
+    static thread_local attachment current_;
+    static ring rings_[rings_capacity];
+    static uint64_t origin_ticks_;
+    static uint64_t origin_ns_;
+
+
+    static uint32_t thread_id() noexcept {
+#if defined(_WIN32)
+      return uint32_t(GetCurrentThreadId());
+#else
+      return uint32_t(syscall(SYS_gettid));
+#endif
+    }
+
+
+    static void calibrate() noexcept {
+      static std::atomic_bool calibrated;
+      if(calibrated.exchange(true))
+        return;
+      origin_ticks_ = ticks();
+      origin_ns_ = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+  }; // flight_recorder
+
+  inline thread_local flight_recorder::attachment flight_recorder::current_;
+  inline flight_recorder::ring flight_recorder::rings_[flight_recorder::rings_capacity];
+  inline uint64_t flight_recorder::origin_ticks_;
+  inline uint64_t flight_recorder::origin_ns_;
+
+
+} // airbag
@@ -0,0 +1,155 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "thread_error.hpp"
+
+
+namespace airbag {
+
+
+  // Value returned by function called by guarded() or system_failure it faulted with.
+  // failure().info() and failure().context() are valid until next fault of the thread
+
+  template<typename T>
+  class guarded_result {
+  public:
+
+    using value_type = T;
+
+    guarded_result(T value) noexcept(std::is_nothrow_move_constructible_v<T>):
+      value_{std::move(value)}
+    { }
+
+    explicit guarded_result(system_failure const& f) noexcept:
+      failure_{f}
+    { }
+
+    bool has_value() const noexcept { return value_.has_value(); }
+    explicit operator bool() const noexcept { return value_.has_value(); }
+    system_failure const& failure() const noexcept { return failure_; }
+
+    T& operator * () noexcept { return *value_; }
+    T const& operator * () const noexcept { return *value_; }
+    T* operator -> () noexcept { return &*value_; }
+    T const* operator -> () const noexcept { return &*value_; }
+
+
+    T& value() & {
+      check();
+      return *value_;
+    }
+
+
+    T const& value() const& {
+      check();
+      return *value_;
+    }
+
+
+    T&& value() && {
+      check();
+      return std::move(*value_);
+    }
+
+  private:
+
+    std::optional<T> value_;
+    system_failure failure_;
+
+
+    void check() const {
+      if(!value_)
+        throw thread_error{failure_.title(), failure_};
+    }
+
+  }; // guarded_result
+
+
+  template<>
+  class guarded_result<void> {
+  public:
+
+    using value_type = void;
+
+    guarded_result() noexcept = default;
+
+    explicit guarded_result(system_failure const& f) noexcept:
+      faulted_{true}, failure_{f}
+    { }
+
+    bool has_value() const noexcept { return !faulted_; }
+    explicit operator bool() const noexcept { return !faulted_; }
+    system_failure const& failure() const noexcept { return failure_; }
+
+
+    void value() const {
+      if(faulted_)
+        throw thread_error{failure_.title(), failure_};
+    }
+
+  private:
+
+    bool faulted_{false};
+    system_failure failure_;
+
+  }; // guarded_result<void>
+
+
+  // Calls f with a per-thread recovery point: __builtin_setjmp/longjmp on
+  // Linux, SEH on Windows. Faults inside f are returned instead of thrown, so
+  // f should not own anything needing destructors (they are skipped on Linux).
+  // Signal mask is not saved at the recovery point, the fault handler restores
+  // the mask the faulting code had, so signals f blocked stay blocked
+
+  template<typename F>
+  guarded_result<std::invoke_result_t<F&>> guarded(F&& f) {
+    using value_type = std::invoke_result_t<F&>;
+    if constexpr(std::is_void_v<value_type>) {
+      auto* target = &f;
+      auto call = [](void* p) { (**static_cast<decltype(target)*>(p))(); };
+      if(auto const* failure = thread_error::call_guarded(call, &target))
+        return guarded_result<void>{*failure};
+      return guarded_result<void>{};
+    } else {
+      struct state {
+        decltype(&f) target;
+        std::optional<value_type> value;
+      } s{&f, std::nullopt};
+      auto call = [](void* p) {
+        auto* const s = static_cast<state*>(p);
+        s->value.emplace((*s->target)());
+      };
+      if(auto const* failure = thread_error::call_guarded(call, &s))
+        return guarded_result<value_type>{*failure};
+      return guarded_result<value_type>{std::move(*s.value)};
+    }
+  }
+
+
+} // airbag
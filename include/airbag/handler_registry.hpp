@@ -0,0 +1,188 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+
+namespace airbag {
+
+
+  // Fixed capacity list of handlers (function pointer + context) ordered by
+  // priority, higher first. Like module_map, dispatch (fault path) never waits:
+  // it pins one of two tables, writer rebuilds another one and publishes it
+
+  template<typename... Args>
+  class handler_registry {
+  public:
+
+    using function_type = void (*)(void* context, Args... args);
+    using id_type = unsigned;
+
+    static constexpr size_t capacity = 32;
+    static constexpr id_type invalid_id = 0;
+
+
+    handler_registry() noexcept = default;
+    handler_registry(handler_registry const&) = delete;
+    handler_registry& operator = (handler_registry const&) = delete;
+
+
+    // Returns invalid_id when registry is full. Handlers of equal priority
+    // are called in order of addition
+
+    id_type add(function_type function, void* context, int priority = 0) noexcept {
+      if(function == nullptr)
+        return invalid_id;
+      std::lock_guard<std::mutex> lock{writer_};
+      table const& current = tables_[current_.load()];
+      if(current.size == capacity)
+        return invalid_id;
+      table& next = drained();
+      id_type const id = ++last_id_;
+      size_t n = 0;
+      bool inserted = false;
+      for(size_t i = 0; i != current.size; ++i) {
+        if(!inserted && current.entries[i].priority < priority) {
+          next.entries[n++] = entry{function, context, priority, id};
+          inserted = true;
+        }
+        next.entries[n++] = current.entries[i];
+      }
+      if(!inserted)
+        next.entries[n++] = entry{function, context, priority, id};
+      next.size = n;
+      publish();
+      return id;
+    }
+
+
+    // After return handler is not called anymore, so its context can be freed
+
+    bool remove(id_type id) noexcept {
+      std::lock_guard<std::mutex> lock{writer_};
+      table const& current = tables_[current_.load()];
+      table& next = drained();
+      size_t n = 0;
+      for(size_t i = 0; i != current.size; ++i)
+        if(current.entries[i].id != id)
+          next.entries[n++] = current.entries[i];
+      if(n == current.size)
+        return false;
+      next.size = n;
+      publish();
+      drained(); // wait for dispatches still using previous table
+      return true;
+    }
+
+
+    // Bounded by capacity, safe to call from signal handler
+
+    void dispatch(Args... args) const noexcept {
+      reader pinned{*this};
+      table const& t = pinned.get();
+      for(size_t i = 0; i != t.size; ++i)
+        t.entries[i].function(t.entries[i].context, args...);
+    }
+
+
+    size_t size() const noexcept {
+      reader pinned{*this};
+      return pinned.get().size;
+    }
+
+
+    bool empty() const noexcept {
+      return size() == 0;
+    }
+
+
+  private:
+
+    struct entry {
+      function_type function;
+      void* context;
+      int priority;
+      id_type id;
+    }; // entry
+
+    struct table {
+      entry entries[capacity];
+      size_t size{0};
+      mutable std::atomic<int> readers{0};
+    }; // table
+
+
+    class reader {
+    public:
+
+      explicit reader(handler_registry const& registry) noexcept: registry_{registry} {
+        for(;;) {
+          index_ = registry_.current_.load();
+          registry_.tables_[index_].readers.fetch_add(1);
+          if(registry_.current_.load() == index_)
+            return;
+          registry_.tables_[index_].readers.fetch_sub(1);
+        }
+      }
+
+      reader(reader const&) = delete;
+      reader& operator = (reader const&) = delete;
+      ~reader() noexcept { registry_.tables_[index_].readers.fetch_sub(1); }
+
+      table const& get() const noexcept { return registry_.tables_[index_]; }
+
+    private:
+      handler_registry const& registry_;
+      int index_;
+    }; // reader
+
+
+    std::mutex writer_;
+    std::atomic<int> current_{0};
+    table tables_[2];
+    id_type last_id_{invalid_id};
+
+
+    // Table not being current, once nobody reads it
+
+    table& drained() noexcept {
+      table& next = tables_[current_.load() ^ 1];
+      while(next.readers.load() != 0)
+        std::this_thread::yield();
+      return next;
+    }
+
+
+    void publish() noexcept {
+      current_.store(current_.load() ^ 1);
+    }
+
+  }; // handler_registry
+
+
+} // airbag
@@ -23,10 +23,18 @@
 #pragma once
 
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
+#include <memory>
 #include <system_error>
 #include <cstdio>
 #include "system_failure.hpp"
+#include "module_map.hpp"
+#include "flight_recorder.hpp"
+#include "dump_file.hpp"
+#include "crash_index.hpp"
 
 
 #if defined(_WIN32)
@@ -55,6 +63,14 @@
 
 #pragma comment(lib, "Dbghelp.lib")
 
+#elif defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include "minidump_writer.hpp"
+
 #else
 
 #error Unsupported system
@@ -69,16 +85,32 @@ namespace airbag {
     
     using path_type = std::filesystem::path;
 
+    // Presets similar to MINIDUMP_TYPE flags, full by default
+
+    enum type : unsigned {
+      normal = 0,
+      with_data_segments = 1,
+      with_private_read_write_memory = 2,
+      with_handle_data = 4,
+      with_full_memory_info = 8,
+      with_thread_info = 16,
+      full = with_data_segments | with_private_read_write_memory | with_handle_data
+           | with_full_memory_info | with_thread_info,
+      sparse_memory = 32 // Linux: untouched and zero pages become holes
+    }; // type
+
 
     static std::error_code last_error() {
+#if defined(_WIN32)
       return {int(GetLastError()), std::system_category()};
+#else
+      return {errno, std::system_category()};
+#endif
     }
 
         
     minidump() {
-      char path_buffer[MAX_PATH];
-      GetModuleFileNameA(nullptr, path_buffer, MAX_PATH);
-      dump_dir_ = path_buffer;
+      dump_dir_ = executable_path();
       executable_name_ = dump_dir_.stem().string();
       dump_dir_= dump_dir_.parent_path();
       dump_dir_ /= "crash";
@@ -86,9 +118,7 @@ namespace airbag {
     
     
     explicit minidump(path_type const& dir): dump_dir_{dir} {
-      char path_buffer[MAX_PATH];
-      GetModuleFileNameA(nullptr, path_buffer, MAX_PATH);
-      path_type path{path_buffer};
+      path_type path = executable_path();
       executable_name_ = path.stem().string();
     }
     
@@ -97,11 +127,178 @@ namespace airbag {
     minidump& operator = (minidump const&) = default;
     minidump(minidump&&) = default;
     minidump& operator = (minidump&&) = default;
-    void directory(path_type const& dir) { dump_dir_ = dir; }
-    path_type const& directory() const noexcept { return dump_dir_; }    
+    void directory(path_type const& dir) { dump_dir_ = dir; target_.reset(); index_.reset(); }
+    path_type const& directory() const noexcept { return dump_dir_; }
+    void dump_type(unsigned t) noexcept { dump_type_ = t; }
+    unsigned dump_type() const noexcept { return dump_type_; }
+#if defined(__linux__)
+    minidump_writer::statistics const& last_statistics() const noexcept { return statistics_; }
+
+    // Spawns threads helping to write memory regions, 0 to write them alone
+
+    void workers(size_t count) {
+      workers_ = count == 0 ? nullptr : std::make_shared<dump_workers>(count);
+    }
+    size_t workers() const noexcept { return workers_ ? workers_->size() : 0; }
+
+    // Time to wait for thread_table threads to be captured, 0 - failed thread only
+
+    void threads_deadline(std::chrono::milliseconds ms) noexcept { threads_deadline_ = ms; }
+    std::chrono::milliseconds threads_deadline() const noexcept { return threads_deadline_; }
+#endif
     
     
+    // Files budget of the directory enforced by prepare(), zero - unlimited
+
+    void budget(uint64_t bytes, size_t files = 0) noexcept { budget_ = {bytes, files}; }
+    crash_index::budget const& budget() const noexcept { return budget_; }
+
+
+    // Failure dumped before (same fingerprint, its dump still exists) is only
+    // counted in the index opened by prepare(). On by default
+
+    void deduplicate(bool enabled) noexcept { deduplicate_ = enabled; }
+    bool deduplicate() const noexcept { return deduplicate_; }
+    bool last_repeated() const noexcept { return last_repeated_; }
+    crash_index const* index() const noexcept { return index_.get(); }
+
+
+    // Opt-in: directory and preallocated spool file are made ready here,
+    // so generate() neither allocates nor creates anything. Stale spools and
+    // dumps or reports of this executable over budget are removed before
+
+    bool prepare(size_t reserved = 64 * 1024 * 1024) {
+      module_map::refresh();
+      auto index = std::make_shared<crash_index>();
+      bool const indexed = index->open(dump_dir_);
+      index->enforce(dump_dir_, executable_name_, budget_);
+      index_ = indexed && deduplicate_ ? std::move(index) : nullptr;
+      auto target = std::make_shared<dump_file>();
+      if(!target->prepare(dump_dir_, executable_name_, ".dmp", reserved))
+        return false;
+      target_ = std::move(target);
+      reserved_ = reserved;
+      return true;
+    }
+    bool prepared() const noexcept { return target_ && target_->prepared(); }
+    size_t reserved() const noexcept { return reserved_; }
+
+
+#if defined(_WIN32)
+
+    bool generate(system_failure const& failure) {
+      crash_index::record* seen;
+      if(repeated(failure, seen))
+        return true;
+      bool const written = write_dump(failure);
+      if(written && seen != nullptr)
+        crash_index::assign_dump(*seen, last_name_);
+      return written;
+    }
+
+#else
+
     bool generate(system_failure const& failure) {
+      if(failure.context() == nullptr)
+        return false;
+      crash_index::record* seen;
+      if(repeated(failure, seen))
+        return true;
+      bool const written = generate(minidump_writer::crash::of(failure));
+      if(written && seen != nullptr)
+        crash_index::assign_dump(*seen, last_name_);
+      return written;
+    }
+
+
+    // Failure of this or another process, crash_helper writes the latter
+
+    bool generate(minidump_writer::crash const& failure) {
+
+      if(target_ && target_->prepared()) {
+        uint64_t const size = write(target_->handle(), failure);
+        bool const committed = target_->commit(size) && size != 0;
+        remember(target_->last_path());
+        return committed;
+      }
+
+      namespace fs = std::filesystem;
+      if(!fs::exists(dump_dir_)) {
+        std::error_code failed;
+        fs::create_directories(dump_dir_, failed);
+        if(!!failed)
+          return false;
+      }
+
+      char time[32];
+      time[dump_file::format_time(time)] = '\0';
+      char dump_name[PATH_MAX];
+      std::snprintf(dump_name, sizeof(dump_name), "%s-%s.dmp", executable_name_.data(), time);
+      remember(dump_name);
+
+      path_type path = dump_dir_; path /= dump_name;
+
+      int const fd = open(path.string().data(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if(fd == -1)
+        return false;
+      uint64_t const size = write(fd, failure);
+      if(size != 0)
+        ftruncate(fd, off_t(size)); // trailing holes are not written
+      close(fd);
+      return size != 0;
+    }
+
+#endif
+    
+  private:
+    
+    path_type dump_dir_;
+    std::string executable_name_;
+    std::shared_ptr<dump_file> target_;
+    size_t reserved_{0};
+    std::shared_ptr<crash_index> index_;
+    crash_index::budget budget_;
+    bool deduplicate_{true};
+    bool last_repeated_{false};
+    char last_name_[128]{}; // of the last written dump
+    unsigned dump_type_{full};
+#if defined(__linux__)
+    minidump_writer::statistics statistics_;
+    std::shared_ptr<dump_workers> workers_;
+    std::chrono::milliseconds threads_deadline_{100};
+#endif
+
+
+    // Counts failure in the index, true if it was dumped before
+
+    bool repeated(system_failure const& failure, crash_index::record*& seen) noexcept {
+      seen = index_ ? index_->hit(crash_index::fingerprint(failure), failure) : nullptr;
+      last_repeated_ = seen != nullptr && crash_index::dumped(*seen);
+      return last_repeated_;
+    }
+
+
+    void remember(char const* path) noexcept {
+      char const* name = path;
+      for(char const* p = path; *p != '\0'; ++p)
+        if(*p == '/' || *p == '\\')
+          name = p + 1;
+      size_t const size = std::min(std::strlen(name), sizeof(last_name_) - 1);
+      std::memcpy(last_name_, name, size);
+      last_name_[size] = '\0';
+    }
+
+
+#if defined(_WIN32)
+
+    bool write_dump(system_failure const& failure) {
+
+      if(target_ && target_->prepared()) {
+        bool const written = write(target_->handle(), failure);
+        bool const committed = target_->commit() && written;
+        remember(target_->last_path());
+        return committed;
+      }
 
       namespace fs = std::filesystem;
       if(!fs::exists(dump_dir_)) {
@@ -118,6 +315,7 @@ namespace airbag {
       std::snprintf(dump_name, sizeof(dump_name), "%s-%u_%02u_%02u-%02u_%02u_%02u.dmp", executable_name_.data(),
                time.wYear, time.wMonth, time.wDay, time.wHour, time.wMinute, time.wSecond);
       
+      remember(dump_name);
       path_type path = dump_dir_; path /= dump_name;
       
       auto constexpr generic_read = 0x80000000;
@@ -128,12 +326,23 @@ namespace airbag {
         nullptr, CREATE_ALWAYS, file_attribute_normal, nullptr);
       if(file == HANDLE(-1))
         return false;
-      
+
+      bool const written = write(file, failure);
+      CloseHandle(file);
+      return written;
+    }
+
+#endif
+
+
+#if defined(_WIN32)
+
+    bool write(HANDLE file, system_failure const& failure) const noexcept {
       MINIDUMP_EXCEPTION_INFORMATION mdei;
       MINIDUMP_EXCEPTION_INFORMATION* pmdei;
       
       if(failure.info() != nullptr) {
-        mdei.ThreadId = GetCurrentThreadId();
+        mdei.ThreadId = failure.thread_id();
         mdei.ExceptionPointers = failure.info();
         mdei.ClientPointers = FALSE;
         pmdei = &mdei;
@@ -141,23 +350,67 @@ namespace airbag {
         pmdei = nullptr;
       }
       
-      int const mdt = MiniDumpWithPrivateReadWriteMemory
-                                | MiniDumpWithDataSegs
-                                | MiniDumpWithHandleData
-                                | MiniDumpWithFullMemoryInfo
-                                | MiniDumpWithThreadInfo;
+      int mdt = MiniDumpNormal;
+      if(dump_type_ & with_data_segments)
+        mdt |= MiniDumpWithDataSegs;
+      if(dump_type_ & with_private_read_write_memory)
+        mdt |= MiniDumpWithPrivateReadWriteMemory;
+      if(dump_type_ & with_handle_data)
+        mdt |= MiniDumpWithHandleData;
+      if(dump_type_ & with_full_memory_info)
+        mdt |= MiniDumpWithFullMemoryInfo;
+      if(dump_type_ & with_thread_info)
+        mdt |= MiniDumpWithThreadInfo;
       
+      // Each thread's flight recorder ring as is
+      MINIDUMP_USER_STREAM streams[flight_recorder::rings_capacity];
+      MINIDUMP_USER_STREAM_INFORMATION user_streams{0, streams};
+      flight_recorder::visit([&](flight_recorder::ring const& r) {
+        MINIDUMP_USER_STREAM& stream = streams[user_streams.UserStreamCount++];
+        stream.Type = flight_recorder::stream_type;
+        stream.BufferSize = ULONG(sizeof(r));
+        stream.Buffer = PVOID(&r);
+      });
+
       BOOL const written = MiniDumpWriteDump(GetCurrentProcess(), GetCurrentProcessId(),
-        file, MINIDUMP_TYPE(mdt), pmdei, nullptr, nullptr);
-        
-      CloseHandle(file);
+        file, MINIDUMP_TYPE(mdt), pmdei, &user_streams, nullptr);
       return !!written;
     }
-    
-  private:
-    
-    path_type dump_dir_;
-    std::string executable_name_;
+
+#else
+
+    // Returns size of written dump, zero on failure
+
+    uint64_t write(int fd, minidump_writer::crash const& failure) noexcept {
+      minidump_writer::options o;
+      o.data_segments = (dump_type_ & with_data_segments) != 0;
+      o.private_memory = (dump_type_ & with_private_read_write_memory) != 0;
+      o.memory_info = (dump_type_ & with_full_memory_info) != 0;
+      o.thread_info = (dump_type_ & with_thread_info) != 0;
+      o.sparse = (dump_type_ & sparse_memory) != 0;
+      o.workers = workers_.get();
+      o.threads_deadline_ms = unsigned(threads_deadline_.count());
+      minidump_writer writer{fd, o};
+      uint64_t const size = writer.write(failure);
+      statistics_ = writer.last_statistics();
+      return size;
+    }
+
+#endif
+
+
+    static path_type executable_path() {
+#if defined(_WIN32)
+      char path_buffer[MAX_PATH];
+      GetModuleFileNameA(nullptr, path_buffer, MAX_PATH);
+      return path_type{path_buffer};
+#else
+      char path_buffer[PATH_MAX];
+      ssize_t const size = readlink("/proc/self/exe", path_buffer, sizeof(path_buffer) - 1);
+      path_buffer[size < 0 ? 0 : size] = '\0';
+      return path_type{path_buffer};
+#endif
+    }
   }; // minidump
   
   
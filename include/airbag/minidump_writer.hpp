@@ -0,0 +1,1472 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <link.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "signal_safe.hpp"
+#include "module_map.hpp"
+#include "flight_recorder.hpp"
+#include "stack_trace.hpp"
+#include "system_failure.hpp"
+#include "thread_table.hpp"
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Raw structures of Breakpad/Windows minidump format
+
+  namespace minidump_format {
+
+    constexpr uint32_t signature = 0x504d444d; // MDMP
+    constexpr uint32_t version = 0xa793;
+
+    constexpr uint32_t thread_list_stream = 3;
+    constexpr uint32_t module_list_stream = 4;
+    constexpr uint32_t memory_list_stream = 5;
+    constexpr uint32_t exception_stream = 6;
+    constexpr uint32_t system_info_stream = 7;
+    constexpr uint32_t memory64_list_stream = 9;
+    constexpr uint32_t thread_names_stream = 24;
+    constexpr uint32_t linux_proc_status_stream = 0x47670004;
+    constexpr uint32_t linux_cmd_line_stream = 0x47670006;
+    constexpr uint32_t linux_environ_stream = 0x47670007;
+    constexpr uint32_t linux_auxv_stream = 0x47670008;
+    constexpr uint32_t linux_maps_stream = 0x47670009;
+
+    constexpr uint16_t cpu_x86 = 0;
+    constexpr uint16_t cpu_amd64 = 9;
+    constexpr uint16_t cpu_arm64 = 12;
+    constexpr uint32_t os_linux = 0x8201;
+    constexpr uint32_t cv_elf_signature = 0x4270454c; // BpEL
+
+    constexpr uint32_t context_amd64_full = 0x0010000b; // control, integer, floating point
+    constexpr uint32_t context_arm64_full = 0x00400007;
+
+#pragma pack(push, 4)
+
+    struct location {
+      uint32_t data_size;
+      uint32_t rva;
+    };
+
+    struct header {
+      uint32_t signature;
+      uint32_t version;
+      uint32_t stream_count;
+      uint32_t stream_directory_rva;
+      uint32_t checksum;
+      uint32_t time_date_stamp;
+      uint64_t flags;
+    };
+
+    struct directory {
+      uint32_t stream_type;
+      location data;
+    };
+
+    struct memory_descriptor {
+      uint64_t start;
+      location memory;
+    };
+
+    struct memory_descriptor64 {
+      uint64_t start;
+      uint64_t size;
+    };
+
+    struct thread {
+      uint32_t thread_id;
+      uint32_t suspend_count;
+      uint32_t priority_class;
+      uint32_t priority;
+      uint64_t teb;
+      memory_descriptor stack;
+      location context;
+    };
+
+    struct thread_name {
+      uint32_t thread_id;
+      uint64_t rva_of_thread_name;
+    };
+
+    struct module {
+      uint64_t base_of_image;
+      uint32_t size_of_image;
+      uint32_t checksum;
+      uint32_t time_date_stamp;
+      uint32_t module_name_rva;
+      uint32_t version_info[13];
+      location cv_record;
+      location misc_record;
+      uint32_t reserved[4];
+    };
+
+    struct exception {
+      uint32_t thread_id;
+      uint32_t alignment;
+      uint32_t code;
+      uint32_t flags;
+      uint64_t record;
+      uint64_t address;
+      uint32_t parameters_count;
+      uint32_t alignment2;
+      uint64_t information[15];
+      location context;
+    };
+
+    struct system_info {
+      uint16_t processor_architecture;
+      uint16_t processor_level;
+      uint16_t processor_revision;
+      uint8_t processors_count;
+      uint8_t product_type;
+      uint32_t major_version;
+      uint32_t minor_version;
+      uint32_t build_number;
+      uint32_t platform_id;
+      uint32_t csd_version_rva;
+      uint16_t suite_mask;
+      uint16_t reserved;
+      uint32_t cpu[6];
+    };
+
+    struct context_amd64 {
+      uint64_t home[6];
+      uint32_t context_flags;
+      uint32_t mx_csr;
+      uint16_t cs, ds, es, fs, gs, ss;
+      uint32_t eflags;
+      uint64_t dr[6];
+      uint64_t rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi;
+      uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
+      uint64_t rip;
+      uint8_t float_save[512];
+      uint64_t vector_register[26][2];
+      uint64_t vector_control;
+      uint64_t debug_control;
+      uint64_t last_branch_to_rip;
+      uint64_t last_branch_from_rip;
+      uint64_t last_exception_to_rip;
+      uint64_t last_exception_from_rip;
+    };
+
+    struct context_arm64 {
+      uint32_t context_flags;
+      uint32_t cpsr;
+      uint64_t iregs[33]; // x0-x28, fp, lr, sp, pc
+      uint32_t fpsr;
+      uint32_t fpcr;
+      uint64_t fregs[32][2];
+      uint32_t bcr[8];
+      uint64_t bvr[8];
+      uint32_t wcr[2];
+      uint64_t wvr[2];
+    };
+
+#pragma pack(pop)
+
+    static_assert(sizeof(header) == 32);
+    static_assert(sizeof(directory) == 12);
+    static_assert(sizeof(thread) == 48);
+    static_assert(sizeof(thread_name) == 12);
+    static_assert(sizeof(module) == 108);
+    static_assert(sizeof(exception) == 168);
+    static_assert(sizeof(system_info) == 56);
+    static_assert(sizeof(context_amd64) == 1232);
+    static_assert(sizeof(context_arm64) == 912);
+
+  } // minidump_format
+
+
+  // Threads spawned beforehand to share writing of dump at crash time.
+  // They wait on futex with all signals blocked
+
+  class dump_workers {
+  public:
+
+    using task_type = void (*)(void* context, size_t worker);
+
+
+    explicit dump_workers(size_t count) {
+      module_map::refresh();
+      sigset_t all, previous;
+      sigfillset(&all);
+      pthread_sigmask(SIG_SETMASK, &all, &previous);
+      stacks_.resize(count);
+      threads_.reserve(count);
+      for(size_t i = 0; i != count; ++i)
+        threads_.emplace_back([this, i] { serve(i); });
+      pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+      // Stacks are known once every worker has started
+      for(uint32_t started = started_.load(std::memory_order_acquire); started != count;
+          started = started_.load(std::memory_order_acquire))
+        futex_wait(started_, started);
+    }
+
+
+    dump_workers(dump_workers const&) = delete;
+    dump_workers& operator = (dump_workers const&) = delete;
+
+
+    ~dump_workers() {
+      stop_.store(true, std::memory_order_relaxed);
+      generation_.fetch_add(1, std::memory_order_release);
+      futex_wake(generation_);
+      for(auto& each: threads_)
+        each.join();
+    }
+
+
+    size_t size() const noexcept { return threads_.size(); }
+
+
+    // Stack of the worker, writer leaves it out of the dump
+
+    void stack(size_t index, uintptr_t& begin, uintptr_t& end) const noexcept {
+      begin = stacks_[index].begin;
+      end = stacks_[index].end;
+    }
+
+
+    // Runs task on every worker and on calling thread as the last one,
+    // returns when all of them are done
+
+    void run(task_type task, void* context) noexcept {
+      if(busy_.exchange(true, std::memory_order_acquire)) {
+        task(context, size()); // serving another failure, doing it alone
+        return;
+      }
+      task_ = task;
+      context_ = context;
+      pending_.store(uint32_t(size()), std::memory_order_relaxed);
+      generation_.fetch_add(1, std::memory_order_release);
+      futex_wake(generation_);
+      task(context, size());
+      for(uint32_t left = pending_.load(std::memory_order_acquire); left != 0;
+          left = pending_.load(std::memory_order_acquire))
+        futex_wait(pending_, left);
+      busy_.store(false, std::memory_order_release);
+    }
+
+
+  private:
+
+    struct bounds {
+      uintptr_t begin{0};
+      uintptr_t end{0};
+    };
+
+    std::vector<std::thread> threads_;
+    std::vector<bounds> stacks_;
+    std::atomic<uint32_t> started_{0};
+    std::atomic<uint32_t> generation_{0};
+    std::atomic<uint32_t> pending_{0};
+    std::atomic_bool busy_{false};
+    std::atomic_bool stop_{false};
+    task_type task_{nullptr};
+    void* context_{nullptr};
+
+
+    void serve(size_t index) noexcept {
+      pthread_attr_t attributes;
+      if(pthread_getattr_np(pthread_self(), &attributes) == 0) {
+        void* address = nullptr;
+        size_t size = 0;
+        if(pthread_attr_getstack(&attributes, &address, &size) == 0)
+          stacks_[index] = {uintptr_t(address), uintptr_t(address) + size};
+        pthread_attr_destroy(&attributes);
+      }
+      started_.fetch_add(1, std::memory_order_release);
+      futex_wake(started_);
+      uint32_t seen = 0;
+      for(;;) {
+        uint32_t const current = generation_.load(std::memory_order_acquire);
+        if(current == seen) {
+          futex_wait(generation_, seen);
+          continue;
+        }
+        seen = current;
+        if(stop_.load(std::memory_order_relaxed))
+          return;
+        task_(context_, index);
+        if(pending_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          futex_wake(pending_);
+      }
+    }
+
+
+    static void futex_wait(std::atomic<uint32_t>& word, uint32_t expected) noexcept {
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected,
+              nullptr, nullptr, 0);
+    }
+
+
+    static void futex_wake(std::atomic<uint32_t>& word) noexcept {
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, INT32_MAX,
+              nullptr, nullptr, 0);
+    }
+
+  }; // dump_workers
+
+
+  // Writes minidump of the current process from fault handler: no heap,
+  // scratch memory is mmap'ed, process memory goes to the file by pwrite
+  // straight from its address
+
+  class minidump_writer {
+  public:
+
+    struct options {
+      bool data_segments{true};
+      bool private_memory{true};
+      bool memory_info{true};
+      bool thread_info{true};
+      bool sparse{false}; // only touched non-zero pages of memory regions
+      dump_workers* workers{nullptr}; // share memory regions with calling thread
+      unsigned threads_deadline_ms{100}; // to capture thread_table threads, 0 - failed thread only
+    };
+
+    struct statistics {
+      uint64_t scanned{0}; // bytes of selected memory regions
+      uint64_t written{0}; // bytes of them stored in the file
+    };
+
+    // Failed thread of this or another process
+    struct crash {
+      pid_t pid;
+      pid_t tid;
+      siginfo_t info;
+      ucontext_t context;
+      bool has_float_state;
+      uint8_t float_state[512]; // fxsave area, context points to it elsewhere
+
+      static crash of(system_failure const& failure) noexcept {
+        crash c;
+        std::memset(&c, 0, sizeof(c));
+        c.pid = getpid();
+        c.tid = pid_t(syscall(SYS_gettid));
+        if(failure.info() != nullptr)
+          c.info = *failure.info();
+        if(failure.context() != nullptr)
+          c.context = *failure.context();
+#if defined(__x86_64__)
+        if(failure.context() != nullptr && failure.context()->uc_mcontext.fpregs != nullptr) {
+          std::memcpy(c.float_state, failure.context()->uc_mcontext.fpregs, sizeof(c.float_state));
+          c.has_float_state = true;
+        }
+#endif
+        return c;
+      }
+    };
+
+    static constexpr size_t max_stack_size = 256 * 1024;
+
+
+    explicit minidump_writer(int fd, options const& o) noexcept:
+      fd_{fd}, options_{o} {
+      arena_size_ = 256 * 1024 * 1024; // virtual, pages are touched on demand
+      void* arena = mmap(nullptr, arena_size_, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      arena_ = arena == MAP_FAILED ? nullptr : static_cast<char*>(arena);
+    }
+
+    statistics const& last_statistics() const noexcept { return statistics_; }
+
+    minidump_writer(minidump_writer const&) = delete;
+    minidump_writer& operator = (minidump_writer const&) = delete;
+
+    ~minidump_writer() noexcept {
+      if(arena_ != nullptr)
+        munmap(arena_, arena_size_);
+    }
+
+
+    // Returns size of the dump, zero on failure
+
+    uint64_t write(system_failure const& failure) noexcept {
+      if(failure.context() == nullptr)
+        return 0;
+      return write(crash::of(failure));
+    }
+
+
+    // Memory of another process is read by process_vm_readv
+
+    uint64_t write(crash const& c) noexcept {
+      if(arena_ == nullptr)
+        return 0;
+      pid_ = c.pid;
+      remote_ = c.pid != getpid();
+      used_ = 0;
+      failed_ = false;
+      streams_count_ = 0;
+      staged_ = 0;
+      maps_size_ = 0;
+      chunks_count_ = 0;
+      statistics_ = {};
+      directory_capacity_ = 16 + flight_recorder::rings_capacity;
+      directory_ = allocate<minidump_format::directory>(directory_capacity_);
+      staging_ = allocate<char>(staging_capacity);
+      if(directory_ == nullptr || staging_ == nullptr)
+        return 0;
+      position_ = sizeof(minidump_format::header) + directory_capacity_ * sizeof(minidump_format::directory);
+
+      if(!read_maps())
+        return 0;
+
+      // Other threads are parked until dump is written
+      struct capture {
+        bool taken;
+        ~capture() { if(taken) thread_table::release(); }
+      } const threads{!remote_ && options_.threads_deadline_ms != 0 && thread_table::size() != 0};
+      if(threads.taken)
+        thread_table::capture(std::chrono::milliseconds{options_.threads_deadline_ms});
+
+      auto const context_location = write_context(c);
+      write_system_info();
+      write_exception(uint32_t(c.tid), c.info, context_location);
+      write_threads(uint32_t(c.tid), c.context, context_location);
+      if(remote_)
+        write_remote_modules();
+      else
+        write_modules();
+      write_flight_recorder();
+      if(options_.memory_info)
+        stream(minidump_format::linux_maps_stream, append(maps_, maps_size_));
+      if(options_.thread_info) {
+        write_file(minidump_format::linux_proc_status_stream, "status");
+        write_file(minidump_format::linux_cmd_line_stream, "cmdline");
+        write_file(minidump_format::linux_environ_stream, "environ");
+        write_file(minidump_format::linux_auxv_stream, "auxv");
+      }
+      uint64_t const size = write_memory();
+
+      minidump_format::header header{};
+      header.signature = minidump_format::signature;
+      header.version = minidump_format::version;
+      header.stream_count = streams_count_;
+      header.stream_directory_rva = sizeof(header);
+      header.time_date_stamp = uint32_t(time(nullptr));
+      flush();
+      if(!write_at(&header, sizeof(header), 0)
+         || !write_at(directory_, streams_count_ * sizeof(minidump_format::directory), sizeof(header)))
+        return 0;
+      return failed_ ? 0 : size;
+    }
+
+
+  private:
+
+    static constexpr size_t staging_capacity = 64 * 1024;
+
+    struct region {
+      uintptr_t begin;
+      uintptr_t end;
+    };
+
+    int fd_;
+    options options_;
+    pid_t pid_{0};
+    bool remote_{false};
+    char* arena_{nullptr};
+    size_t arena_size_{0};
+    size_t used_{0};
+    bool failed_{false};
+
+    minidump_format::directory* directory_{nullptr};
+    uint32_t directory_capacity_{0};
+    uint32_t streams_count_{0};
+
+    char* staging_{nullptr};
+    size_t staged_{0};
+    uint64_t staged_base_{0};
+    uint64_t position_{0}; // of the next byte, staged ones included
+
+    char* maps_{nullptr};
+    size_t maps_size_{0};
+
+    statistics statistics_;
+    uint64_t reserved_{0}; // preallocated size of the file
+    size_t page_size_{4096};
+    int pagemap_{-1};
+
+    // Piece of memory region with its place in the file
+    struct chunk {
+      uintptr_t begin;
+      uintptr_t end;
+      uint64_t offset;
+      bool anonymous;
+    };
+
+    static constexpr size_t chunk_size = 8 * 1024 * 1024;
+    static constexpr size_t sparse_batch = 512; // pages
+
+    static constexpr size_t remote_block = 2 * 1024 * 1024;
+
+    // State of one writing thread
+    struct alignas(64) lane {
+      uint64_t written;
+      uint64_t faulted; // bytes of unreadable pages left as holes
+      bool failed;
+      uint64_t pagemap_entries[sparse_batch];
+      unsigned char resident_pages[sparse_batch];
+      char* buffer; // remote memory goes through it
+    };
+
+    chunk* chunks_{nullptr};
+    size_t chunks_count_{0};
+    std::atomic<size_t> next_chunk_{0};
+    lane* lanes_{nullptr};
+
+
+    template<typename T> T* allocate(size_t count) noexcept {
+      size_t const aligned = (used_ + alignof(T) - 1) & ~(alignof(T) - 1);
+      if(aligned + count * sizeof(T) > arena_size_)
+        return nullptr;
+      used_ = aligned + count * sizeof(T);
+      return reinterpret_cast<T*>(arena_ + aligned);
+    }
+
+
+    // pwrite straight from memory, unreadable pages are left as holes
+
+    bool write_at(void const* data, size_t size, uint64_t offset) noexcept {
+      uint64_t faulted = 0;
+      if(write_at(fd_, data, size, offset, faulted))
+        return true;
+      failed_ = true;
+      return false;
+    }
+
+
+    static bool write_at(int fd, void const* data, size_t size, uint64_t offset, uint64_t& faulted) noexcept {
+      auto const* cursor = static_cast<char const*>(data);
+      while(size != 0) {
+        ssize_t const written = pwrite(fd, cursor, size, off_t(offset));
+        if(written > 0) {
+          cursor += written; offset += uint64_t(written); size -= size_t(written);
+          continue;
+        }
+        if(written < 0 && errno == EINTR)
+          continue;
+        if(written < 0 && errno == EFAULT) {
+          size_t const skipped = 4096 - (uintptr_t(cursor) & 4095);
+          size_t const n = skipped < size ? skipped : size;
+          cursor += n; offset += n; size -= n;
+          faulted += n;
+          continue;
+        }
+        return false;
+      }
+      return true;
+    }
+
+
+    void flush() noexcept {
+      if(staged_ == 0)
+        return;
+      write_at(staging_, staged_, staged_base_);
+      staged_ = 0;
+    }
+
+
+    // Small pieces are staged, big ones are written directly.
+    // Entries of a list follow its count without alignment
+
+    minidump_format::location append(void const* data, size_t size, uint64_t alignment = 8) noexcept {
+      uint64_t const start = (position_ + alignment - 1) & ~(alignment - 1);
+      minidump_format::location const result{uint32_t(size), uint32_t(start)};
+      if(staged_ != 0 && start + size - staged_base_ > staging_capacity)
+        flush();
+      if(size > staging_capacity / 4) {
+        flush();
+        write_at(data, size, start);
+        position_ = start + size;
+        return result;
+      }
+      if(staged_ == 0)
+        staged_base_ = start;
+      std::memset(staging_ + staged_, 0, size_t(start - staged_base_) - staged_);
+      std::memcpy(staging_ + (start - staged_base_), data, size);
+      position_ = start + size;
+      staged_ = size_t(position_ - staged_base_);
+      return result;
+    }
+
+
+    void stream(uint32_t type, minidump_format::location data) noexcept {
+      if(streams_count_ == directory_capacity_)
+        return;
+      directory_[streams_count_++] = {type, data};
+    }
+
+
+    // /proc/<pid>/<name>
+
+    int open_proc(char const* name) const noexcept {
+      char path[64] = "/proc/";
+      size_t size = 6;
+      size += signal_safe::format_decimal(path + size, uint64_t(pid_));
+      path[size++] = '/';
+      signal_safe::copy(path + size, sizeof(path) - size, name, signal_safe::length(name));
+      return open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+
+    // Copies memory of the process, unreadable pages are zeroed
+
+    size_t read_memory(uintptr_t from, size_t size, char* to) const noexcept {
+      if(!remote_) {
+        std::memcpy(to, reinterpret_cast<void const*>(from), size);
+        return size;
+      }
+      iovec local{to, size}, remote{reinterpret_cast<void*>(from), size};
+      ssize_t const n = process_vm_readv(pid_, &local, 1, &remote, 1, 0);
+      if(n == ssize_t(size))
+        return size;
+      size_t done = n > 0 ? size_t(n) : 0;
+      size_t faulted = 0;
+      while(done < size) { // page by page after the first failure
+        size_t const page = 4096 - ((from + done) & 4095);
+        size_t const part = page < size - done ? page : size - done;
+        local = {to + done, part};
+        remote = {reinterpret_cast<void*>(from + done), part};
+        if(process_vm_readv(pid_, &local, 1, &remote, 1, 0) != ssize_t(part)) {
+          std::memset(to + done, 0, part);
+          faulted += part;
+        }
+        done += part;
+      }
+      return size - faulted;
+    }
+
+
+    // Process memory into the dump: straight from own address space,
+    // through the buffer from another process
+
+    minidump_format::location append_memory(uintptr_t begin, size_t size) noexcept {
+      if(!remote_)
+        return append(reinterpret_cast<void const*>(begin), size);
+      char* buffer = allocate<char>(size);
+      if(buffer == nullptr)
+        return {0, 0};
+      read_memory(begin, size, buffer);
+      return append(buffer, size);
+    }
+
+
+    bool read_maps() noexcept {
+      int const fd = open_proc("maps");
+      if(fd == -1)
+        return false;
+      maps_ = arena_ + used_;
+      size_t const capacity = (arena_size_ - used_) / 2;
+      for(;;) {
+        ssize_t const n = read(fd, maps_ + maps_size_, capacity - maps_size_);
+        if(n < 0 && errno == EINTR)
+          continue;
+        if(n <= 0)
+          break;
+        maps_size_ += size_t(n);
+      }
+      close(fd);
+      used_ += maps_size_;
+      return maps_size_ != 0;
+    }
+
+
+    template<typename F> void for_each_region(F&& f) const noexcept {
+      char const* line = maps_;
+      char const* const end = maps_ + maps_size_;
+      while(line < end) {
+        char const* eol = static_cast<char const*>(std::memchr(line, '\n', size_t(end - line)));
+        if(eol == nullptr)
+          eol = end;
+        signal_safe::map_region r;
+        if(signal_safe::parse_map_line(line, eol, r))
+          f(r);
+        line = eol + 1;
+      }
+    }
+
+
+    minidump_format::location write_context(crash const& failure) noexcept {
+      return write_context(failure.context, failure.has_float_state ? failure.float_state : nullptr);
+    }
+
+
+    minidump_format::location write_context(ucontext_t const& context,
+                                            uint8_t const* float_state) noexcept {
+#if defined(__x86_64__)
+      minidump_format::context_amd64 c{};
+      auto const& g = context.uc_mcontext.gregs;
+      c.context_flags = minidump_format::context_amd64_full;
+      c.cs = uint16_t(g[REG_CSGSFS] & 0xFFFF);
+      c.gs = uint16_t((g[REG_CSGSFS] >> 16) & 0xFFFF);
+      c.fs = uint16_t((g[REG_CSGSFS] >> 32) & 0xFFFF);
+      c.eflags = uint32_t(g[REG_EFL]);
+      c.rax = uint64_t(g[REG_RAX]); c.rcx = uint64_t(g[REG_RCX]);
+      c.rdx = uint64_t(g[REG_RDX]); c.rbx = uint64_t(g[REG_RBX]);
+      c.rsp = uint64_t(g[REG_RSP]); c.rbp = uint64_t(g[REG_RBP]);
+      c.rsi = uint64_t(g[REG_RSI]); c.rdi = uint64_t(g[REG_RDI]);
+      c.r8 = uint64_t(g[REG_R8]); c.r9 = uint64_t(g[REG_R9]);
+      c.r10 = uint64_t(g[REG_R10]); c.r11 = uint64_t(g[REG_R11]);
+      c.r12 = uint64_t(g[REG_R12]); c.r13 = uint64_t(g[REG_R13]);
+      c.r14 = uint64_t(g[REG_R14]); c.r15 = uint64_t(g[REG_R15]);
+      c.rip = uint64_t(g[REG_RIP]);
+      if(float_state != nullptr) {
+        std::memcpy(c.float_save, float_state, sizeof(c.float_save));
+        std::memcpy(&c.mx_csr, float_state + 24, sizeof(c.mx_csr));
+      }
+      return append(&c, sizeof(c));
+#elif defined(__aarch64__)
+      minidump_format::context_arm64 c{};
+      c.context_flags = minidump_format::context_arm64_full;
+      for(int i = 0; i != 31; ++i)
+        c.iregs[i] = context.uc_mcontext.regs[i];
+      c.iregs[31] = context.uc_mcontext.sp;
+      c.iregs[32] = context.uc_mcontext.pc;
+      c.cpsr = uint32_t(context.uc_mcontext.pstate);
+      return append(&c, sizeof(c));
+#else
+      (void)context; (void)float_state;
+      return {0, 0};
+#endif
+    }
+
+
+    static uintptr_t stack_pointer(ucontext_t const& context) noexcept {
+#if defined(__x86_64__)
+      return uintptr_t(context.uc_mcontext.gregs[REG_RSP]);
+#elif defined(__aarch64__)
+      return uintptr_t(context.uc_mcontext.sp);
+#else
+      (void)context;
+      return 0;
+#endif
+    }
+
+
+    // Text to UTF-16 MDString
+
+    minidump_format::location write_string(char const* text, size_t size) noexcept {
+      auto* units = allocate<uint16_t>(2 + size + 1);
+      if(units == nullptr)
+        return {0, 0};
+      size_t n = 2; // 32-bit length goes first
+      for(size_t i = 0; i < size; ) {
+        auto const c = static_cast<unsigned char>(text[i]);
+        uint32_t code = c; size_t extra = 0;
+        if(c >= 0xF0) { code = c & 0x07; extra = 3; }
+        else if(c >= 0xE0) { code = c & 0x0F; extra = 2; }
+        else if(c >= 0xC0) { code = c & 0x1F; extra = 1; }
+        ++i;
+        for(; extra != 0 && i < size; --extra, ++i)
+          code = (code << 6) | (static_cast<unsigned char>(text[i]) & 0x3F);
+        if(code >= 0x10000) {
+          code -= 0x10000;
+          units[n++] = uint16_t(0xD800 + (code >> 10));
+          units[n++] = uint16_t(0xDC00 + (code & 0x3FF));
+        } else {
+          units[n++] = uint16_t(code);
+        }
+      }
+      uint32_t const bytes = uint32_t((n - 2) * 2);
+      std::memcpy(units, &bytes, sizeof(bytes));
+      units[n++] = 0;
+      return append(units, n * 2);
+    }
+
+
+    void write_system_info() noexcept {
+      minidump_format::system_info info{};
+#if defined(__x86_64__)
+      info.processor_architecture = minidump_format::cpu_amd64;
+#elif defined(__aarch64__)
+      info.processor_architecture = minidump_format::cpu_arm64;
+#else
+      info.processor_architecture = minidump_format::cpu_x86;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+      unsigned eax, ebx, ecx, edx;
+      if(__get_cpuid(0, &eax, &ebx, &ecx, &edx)) {
+        info.cpu[0] = ebx; info.cpu[1] = edx; info.cpu[2] = ecx;
+      }
+      if(__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        info.cpu[3] = eax; info.cpu[4] = edx;
+        info.processor_level = uint16_t((eax >> 8) & 0xF);
+        info.processor_revision = uint16_t(((eax >> 4) & 0xF) << 8 | (eax & 0xF));
+      }
+#endif
+      long const processors = sysconf(_SC_NPROCESSORS_ONLN);
+      info.processors_count = uint8_t(processors > 255 ? 255 : processors < 1 ? 1 : processors);
+      info.platform_id = minidump_format::os_linux;
+
+      utsname name;
+      char description[4 * sizeof(name.release)];
+      size_t size = 0;
+      if(uname(&name) == 0) {
+        char const* release = name.release;
+        char const* end = release + signal_safe::length(release);
+        uint32_t* numbers[] = {&info.major_version, &info.minor_version, &info.build_number};
+        for(uint32_t* number: numbers) {
+          for(; release != end && *release >= '0' && *release <= '9'; ++release)
+            *number = *number * 10 + uint32_t(*release - '0');
+          if(release != end && *release == '.')
+            ++release;
+        }
+        for(char const* part: {name.sysname, name.release, name.version, name.machine}) {
+          size_t const n = signal_safe::length(part);
+          std::memcpy(description + size, part, n);
+          size += n;
+          description[size++] = ' ';
+        }
+        --size;
+      }
+      info.csd_version_rva = write_string(description, size).rva;
+      stream(minidump_format::system_info_stream, append(&info, sizeof(info)));
+    }
+
+
+    void write_exception(uint32_t tid, siginfo_t const& signal,
+                         minidump_format::location context) noexcept {
+      minidump_format::exception e{};
+      e.thread_id = tid;
+      e.code = uint32_t(signal.si_signo);
+      e.flags = uint32_t(signal.si_code);
+      e.address = uint64_t(uintptr_t(signal.si_addr));
+      e.context = context;
+      stream(minidump_format::exception_stream, append(&e, sizeof(e)));
+    }
+
+
+    region stack_region(uintptr_t sp) const noexcept {
+      uintptr_t low, high;
+      region result{sp > 128 ? sp - 128 : 0, 0}; // red zone
+      if(!remote_ && stack_trace::thread_bounds(low, high) && sp >= low && sp < high) {
+        result.end = high;
+      } else {
+        for_each_region([&](signal_safe::map_region const& r) {
+          if(sp >= r.begin && sp < r.end)
+            result.end = r.end;
+        });
+      }
+      if(result.end < result.begin)
+        result.end = result.begin;
+      if(result.end - result.begin > max_stack_size)
+        result.end = result.begin + max_stack_size;
+      return result;
+    }
+
+
+    // Failed thread goes first, then threads captured from thread_table
+
+    void write_threads(uint32_t tid, ucontext_t const& context,
+                       minidump_format::location context_location) noexcept {
+      size_t const capacity = 1 + (remote_ ? 0 : thread_table::capacity);
+      auto* threads = allocate<minidump_format::thread>(capacity);
+      auto* names = allocate<minidump_format::thread_name>(capacity);
+      if(threads == nullptr || names == nullptr)
+        return;
+      region const stack = stack_region(stack_pointer(context));
+      minidump_format::thread& failed = threads[0];
+      failed = {};
+      failed.thread_id = tid;
+      failed.stack.start = stack.begin;
+      failed.stack.memory = append_memory(stack.begin, stack.end - stack.begin);
+      failed.context = context_location;
+      uint32_t count = 1, names_count = 0;
+      bool const own = !remote_ && tid == uint32_t(syscall(SYS_gettid));
+      char const* failed_name = own ? thread_table::current_name() : nullptr;
+      if(failed_name != nullptr)
+        names[names_count++] = {tid, write_string(failed_name, signal_safe::length(failed_name)).rva};
+
+      // Failed thread may be another one (stalled thread reported by watchdog)
+      if(!remote_)
+        thread_table::visit_captured([&](thread_table::thread const& t) {
+          if(uint32_t(t.tid) == tid) {
+            if(failed_name == nullptr)
+              names[names_count++] = {tid, write_string(t.name, signal_safe::length(t.name)).rva};
+            return;
+          }
+          if(count == capacity)
+            return;
+          minidump_format::thread& each = threads[count++];
+          each = {};
+          each.thread_id = uint32_t(t.tid);
+          each.context = write_context(t.context, t.has_float_state ? t.float_state : nullptr);
+          each.stack.start = t.stack_start;
+          each.stack.memory = append(t.stack, t.stack_size);
+          names[names_count++] = {uint32_t(t.tid), write_string(t.name, signal_safe::length(t.name)).rva};
+        });
+
+      auto const list = append(&count, sizeof(count));
+      append(threads, count * sizeof(*threads), 1);
+      stream(minidump_format::thread_list_stream,
+             {uint32_t(sizeof(count) + count * sizeof(*threads)), list.rva});
+
+      auto const memory = append(&count, sizeof(count));
+      for(uint32_t i = 0; i != count; ++i)
+        append(&threads[i].stack, sizeof(threads[i].stack), 1);
+      stream(minidump_format::memory_list_stream,
+             {uint32_t(sizeof(count) + count * sizeof(threads->stack)), memory.rva});
+
+      if(names_count != 0) {
+        auto const names_list = append(&names_count, sizeof(names_count));
+        append(names, names_count * sizeof(*names), 1);
+        stream(minidump_format::thread_names_stream,
+               {uint32_t(sizeof(names_count) + names_count * sizeof(*names)), names_list.rva});
+      }
+    }
+
+
+    void write_modules() noexcept {
+      size_t const capacity = module_map::size() + 16;
+      auto* modules = allocate<minidump_format::module>(capacity);
+      if(modules == nullptr)
+        return;
+      uint32_t count = 0;
+      module_map::visit([&](module_map::module const& m) {
+        if(count != capacity)
+          write_module(modules[count++], m);
+      });
+      write_module_list(modules, count);
+    }
+
+
+    void write_module(minidump_format::module& entry, module_map::module const& m) noexcept {
+      std::memset(&entry, 0, sizeof(entry));
+      entry.base_of_image = m.base;
+      entry.size_of_image = uint32_t(m.size);
+      entry.module_name_rva = write_string(m.path, signal_safe::length(m.path)).rva;
+      if(m.build_id_size != 0) {
+        char cv[4 + module_map::build_id_capacity];
+        std::memcpy(cv, &minidump_format::cv_elf_signature, 4);
+        std::memcpy(cv + 4, m.build_id, m.build_id_size);
+        entry.cv_record = append(cv, 4 + m.build_id_size);
+      }
+    }
+
+
+    void write_module_list(minidump_format::module const* modules, uint32_t count) noexcept {
+      auto const list = append(&count, sizeof(count));
+      append(modules, count * sizeof(minidump_format::module), 1);
+      stream(minidump_format::module_list_stream,
+             {uint32_t(sizeof(count) + count * sizeof(minidump_format::module)), list.rva});
+    }
+
+
+    // Loader of another process is out of reach: modules are mappings of
+    // files from offset 0, build-id is read from their program headers
+
+    void write_remote_modules() noexcept {
+      size_t capacity = 0;
+      for_each_region([&](signal_safe::map_region const& r) {
+        if(r.offset == 0 && r.path_size != 0 && r.path[0] == '/')
+          ++capacity;
+      });
+      auto* modules = allocate<minidump_format::module>(capacity);
+      auto* paths = allocate<char>(capacity * PATH_MAX);
+      if(modules == nullptr || paths == nullptr)
+        return;
+      uint32_t count = 0;
+      module_map::module current;
+      char* path = nullptr;
+      auto const flush_module = [&] {
+        if(path == nullptr)
+          return;
+        current.path = path;
+        read_remote_build_id(current);
+        write_module(modules[count++], current);
+        path = nullptr;
+      };
+      for_each_region([&](signal_safe::map_region const& r) {
+        bool const file = r.path_size != 0 && r.path[0] == '/';
+        if(path != nullptr && file && r.path_size == signal_safe::length(path)
+           && std::memcmp(r.path, path, r.path_size) == 0) {
+          current.size = r.end - current.base;
+          return;
+        }
+        flush_module();
+        if(!file || r.offset != 0 || count == capacity)
+          return;
+        path = paths + count * PATH_MAX;
+        signal_safe::copy(path, PATH_MAX, r.path, r.path_size);
+        current = module_map::module{};
+        current.base = r.begin;
+        current.size = r.end - r.begin;
+      });
+      flush_module();
+      write_module_list(modules, count);
+    }
+
+
+    void read_remote_build_id(module_map::module& m) const noexcept {
+      ElfW(Ehdr) header;
+      if(read_memory(m.base, sizeof(header), reinterpret_cast<char*>(&header)) != sizeof(header)
+         || std::memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_phnum > 64)
+        return;
+      ElfW(Phdr) segments[64];
+      size_t const size = header.e_phnum * sizeof(ElfW(Phdr));
+      if(read_memory(m.base + header.e_phoff, size, reinterpret_cast<char*>(segments)) != size)
+        return;
+      uintptr_t first = UINTPTR_MAX;
+      for(size_t i = 0; i != header.e_phnum; ++i)
+        if(segments[i].p_type == PT_LOAD && segments[i].p_vaddr < first)
+          first = segments[i].p_vaddr & ~uintptr_t(4095);
+      uintptr_t const bias = m.base - (first == UINTPTR_MAX ? 0 : first);
+      for(size_t i = 0; i != header.e_phnum; ++i) {
+        if(segments[i].p_type != PT_NOTE || segments[i].p_memsz > 4096)
+          continue;
+        unsigned char notes[4096];
+        size_t const n = segments[i].p_memsz;
+        if(read_memory(bias + segments[i].p_vaddr, n, reinterpret_cast<char*>(notes)) != n)
+          continue;
+        module_map::read_build_id(m, notes, n);
+        if(m.build_id_size != 0)
+          return;
+      }
+    }
+
+
+    // Forked helper has the pool at the same address
+
+    void write_flight_recorder() noexcept {
+      if(!remote_) {
+        flight_recorder::visit([&](flight_recorder::ring const& r) {
+          stream(flight_recorder::stream_type, append(&r, sizeof(r)));
+        });
+        return;
+      }
+      auto* copy = allocate<flight_recorder::ring>(1);
+      if(copy == nullptr)
+        return;
+      for(size_t i = 0; i != flight_recorder::rings_capacity; ++i) {
+        auto const address = uintptr_t(flight_recorder::rings() + i);
+        if(read_memory(address, sizeof(*copy), reinterpret_cast<char*>(copy)) == sizeof(*copy)
+           && flight_recorder::used(*copy))
+          stream(flight_recorder::stream_type, append(copy, sizeof(*copy)));
+      }
+    }
+
+
+    void write_file(uint32_t type, char const* name) noexcept {
+      int const fd = open_proc(name);
+      if(fd == -1)
+        return;
+      char* const data = arena_ + used_;
+      size_t const capacity = arena_size_ - used_;
+      size_t size = 0;
+      for(;;) {
+        ssize_t const n = read(fd, data + size, capacity - size);
+        if(n < 0 && errno == EINTR)
+          continue;
+        if(n <= 0)
+          break;
+        size += size_t(n);
+      }
+      close(fd);
+      stream(type, append(data, size));
+    }
+
+
+    bool selected(signal_safe::map_region const& r) const noexcept {
+      if(!r.readable() || !r.writable())
+        return false;
+      bool const special = r.path_size != 0 && r.path[0] == '[';
+      if(special)
+        return options_.private_memory && r.path_size >= 6
+          && (std::memcmp(r.path, "[heap]", 6) == 0 || std::memcmp(r.path, "[stack", 6) == 0);
+      if(r.path_size == 0 || r.inode == 0)
+        return options_.private_memory && r.is_private();
+      return options_.data_segments;
+    }
+
+
+    // f(begin, end, anonymous) for selected regions without our scratch
+    // memory, kernel may have merged it with a neighbour
+
+    // Own arenas (ours and thread_table stack copies) and stacks of dump
+    // workers are cut out of regions
+
+    template<typename F> void for_each_selected(F&& f) const noexcept {
+      region own[2] = {{0, 0}, {0, 0}};
+      size_t const workers = !remote_ && options_.workers != nullptr ? options_.workers->size() : 0;
+      if(!remote_) {
+        own[0] = {uintptr_t(arena_), uintptr_t(arena_) + arena_size_};
+        thread_table::arena(own[1].begin, own[1].end);
+      }
+      // The lowest excluded range within [cursor, end)
+      auto const next_excluded = [&](uintptr_t cursor, uintptr_t end, region& found) noexcept {
+        bool any = false;
+        auto const consider = [&](region const& x) noexcept {
+          if(x.begin == x.end || x.end <= cursor || end <= x.begin)
+            return;
+          if(!any || x.begin < found.begin)
+            found = x;
+          any = true;
+        };
+        for(region const& x: own)
+          consider(x);
+        for(size_t i = 0; i != workers; ++i) {
+          region x;
+          options_.workers->stack(i, x.begin, x.end);
+          consider(x);
+        }
+        return any;
+      };
+      for_each_region([&](signal_safe::map_region const& r) {
+        if(!selected(r))
+          return;
+        bool const anonymous = r.inode == 0;
+        uintptr_t cursor = r.begin;
+        region x;
+        while(next_excluded(cursor, r.end, x)) {
+          if(cursor < x.begin)
+            f(cursor, x.begin, anonymous);
+          cursor = x.end;
+        }
+        if(cursor < r.end)
+          f(cursor, r.end, anonymous);
+      });
+    }
+
+
+    // Memory64 list goes last, its data may grow beyond 4 GB
+
+    uint64_t write_memory() noexcept {
+      uint64_t count = 0;
+      for_each_selected([&](uintptr_t begin, uintptr_t end, bool) {
+        ++count;
+        chunks_count_ += (end - begin + chunk_size - 1) / chunk_size;
+      });
+      auto* descriptors = allocate<minidump_format::memory_descriptor64>(count);
+      chunks_ = allocate<chunk>(chunks_count_);
+      size_t const lanes_count = options_.workers != nullptr ? options_.workers->size() + 1 : 1;
+      lanes_ = allocate<lane>(lanes_count);
+      if(descriptors == nullptr || chunks_ == nullptr || lanes_ == nullptr)
+        count = chunks_count_ = 0;
+      for(size_t i = 0; i != lanes_count && lanes_ != nullptr; ++i)
+        lanes_[i].buffer = remote_ ? allocate<char>(remote_block) : nullptr;
+
+      uint64_t const list_size = 2 * sizeof(uint64_t) + count * sizeof(minidump_format::memory_descriptor64);
+      position_ = (position_ + 7) & ~uint64_t(7);
+      uint64_t const base_rva = position_ + list_size;
+
+      // Every chunk has its own precomputed place in the file
+      uint64_t n = 0, c = 0, offset = base_rva;
+      for_each_selected([&](uintptr_t begin, uintptr_t end, bool anonymous) {
+        if(n == count)
+          return;
+        descriptors[n++] = {begin, end - begin};
+        for(uintptr_t at = begin; at < end && c != chunks_count_; at += chunk_size, ++c) {
+          uintptr_t const last = end - at > chunk_size ? at + chunk_size : end;
+          chunks_[c] = {at, last, offset + (at - begin), anonymous};
+        }
+        offset += end - begin;
+        statistics_.scanned += end - begin;
+      });
+      chunks_count_ = c;
+
+      auto const list = append(&count, sizeof(count));
+      append(&base_rva, sizeof(base_rva));
+      append(descriptors, count * sizeof(minidump_format::memory_descriptor64), 1);
+      if(count != 0)
+        stream(minidump_format::memory64_list_stream, {uint32_t(list_size), list.rva});
+      flush();
+      if(lanes_ == nullptr)
+        return offset; // arena is exhausted, dump goes without memory
+
+      if(options_.sparse)
+        prepare_sparse();
+      for(size_t i = 0; i != lanes_count; ++i) {
+        lanes_[i].written = lanes_[i].faulted = 0;
+        lanes_[i].failed = false;
+      }
+      next_chunk_.store(0, std::memory_order_relaxed);
+      if(options_.workers != nullptr)
+        options_.workers->run(&drain, this);
+      else
+        drain(this, 0);
+      for(size_t i = 0; i != lanes_count; ++i) {
+        statistics_.written += lanes_[i].written - lanes_[i].faulted;
+        failed_ = failed_ || lanes_[i].failed;
+      }
+
+      if(pagemap_ != -1)
+        close(pagemap_);
+      pagemap_ = -1;
+      return offset;
+    }
+
+
+    static void drain(void* context, size_t index) noexcept {
+      auto& self = *static_cast<minidump_writer*>(context);
+      lane& l = self.lanes_[index];
+      for(;;) {
+        size_t const i = self.next_chunk_.fetch_add(1, std::memory_order_relaxed);
+        if(i >= self.chunks_count_)
+          return;
+        chunk const& c = self.chunks_[i];
+        if(self.remote_) {
+          self.write_remote(c, l);
+          continue;
+        }
+        if(self.options_.sparse) {
+          self.write_sparse(c, l);
+          continue;
+        }
+        if(!write_at(self.fd_, reinterpret_cast<void const*>(c.begin), c.end - c.begin, c.offset, l.faulted))
+          l.failed = true;
+        l.written += c.end - c.begin;
+      }
+    }
+
+
+    void prepare_sparse() noexcept {
+      long const page_size = sysconf(_SC_PAGESIZE);
+      if(page_size > 0)
+        page_size_ = size_t(page_size);
+      struct stat file;
+      reserved_ = fstat(fd_, &file) == 0 ? uint64_t(file.st_size) : 0;
+      pagemap_ = open_proc("pagemap");
+    }
+
+
+    enum class residency { absent, present, swapped, unknown };
+
+
+    // /proc/self/pagemap knows swapped pages, mincore is the fallback
+
+    void load_residency(uintptr_t begin, size_t pages, residency* out, lane& l) const noexcept {
+      if(pagemap_ != -1) {
+        size_t const bytes = pages * sizeof(uint64_t);
+        off_t const at = off_t(begin / page_size_ * sizeof(uint64_t));
+        if(pread(pagemap_, l.pagemap_entries, bytes, at) == ssize_t(bytes)) {
+          for(size_t i = 0; i != pages; ++i) {
+            uint64_t const entry = l.pagemap_entries[i];
+            out[i] = (entry >> 63) & 1 ? residency::present
+                   : (entry >> 62) & 1 ? residency::swapped : residency::absent;
+          }
+          return;
+        }
+      }
+      if(!remote_ && mincore(reinterpret_cast<void*>(begin), pages * page_size_, l.resident_pages) == 0) {
+        for(size_t i = 0; i != pages; ++i)
+          out[i] = (l.resident_pages[i] & 1) ? residency::present : residency::absent;
+        return;
+      }
+      for(size_t i = 0; i != pages; ++i)
+        out[i] = residency::unknown;
+    }
+
+
+    // Present pages are checked for zeros; absent anonymous ones were never
+    // touched. Pages of files are not read here, pwrite survives truncated ones
+
+    void write_sparse(chunk const& c, lane& l) const noexcept {
+      residency pages[sparse_batch];
+      uint64_t hole = c.offset; // file offset the pending hole starts from
+      uintptr_t run = 0;
+      uintptr_t page = c.begin;
+      auto const write_run = [&] {
+        uint64_t const at = c.offset + (run - c.begin);
+        punch_hole(hole, at);
+        if(!write_at(fd_, reinterpret_cast<void const*>(run), page - run, at, l.faulted))
+          l.failed = true;
+        l.written += page - run;
+        hole = at + (page - run);
+        run = 0;
+      };
+      while(page < c.end) {
+        size_t const left = (c.end - page) / page_size_;
+        size_t const n = left < sparse_batch ? left : sparse_batch;
+        load_residency(page, n, pages, l);
+        for(size_t i = 0; i != n; ++i, page += page_size_) {
+          bool stored;
+          switch(pages[i]) {
+            case residency::present:
+              stored = !zero_page(reinterpret_cast<void const*>(page), page_size_); break;
+            case residency::swapped:
+              stored = true; break;
+            case residency::absent:
+              stored = !c.anonymous; break;
+            default:
+              stored = !c.anonymous || !zero_page(reinterpret_cast<void const*>(page), page_size_);
+          }
+          if(stored && run == 0)
+            run = page;
+          else if(!stored && run != 0)
+            write_run();
+        }
+      }
+      if(run != 0)
+        write_run();
+      punch_hole(hole, c.offset + (c.end - c.begin));
+    }
+
+
+    // Memory of another process is copied by blocks, in sparse mode absent
+    // anonymous pages are not read and zero pages are not written
+
+    void write_remote(chunk const& c, lane& l) const noexcept {
+      if(l.buffer == nullptr) {
+        l.failed = true;
+        return;
+      }
+      residency pages[sparse_batch];
+      uint64_t hole = c.offset;
+      for(uintptr_t block = c.begin; block < c.end; ) {
+        size_t const limit = remote_block < sparse_batch * page_size_ ? remote_block : sparse_batch * page_size_;
+        size_t const size = c.end - block < limit ? c.end - block : limit;
+        size_t const n = size / page_size_;
+        uint64_t const at = c.offset + (block - c.begin);
+        if(!options_.sparse) {
+          l.faulted += size - read_memory(block, size, l.buffer);
+          uint64_t ignored = 0;
+          if(!write_at(fd_, l.buffer, size, at, ignored))
+            l.failed = true;
+          l.written += size;
+          block += size;
+          continue;
+        }
+        load_residency(block, n, pages, l);
+        size_t i = 0;
+        while(i != n) {
+          if(pages[i] == residency::absent && c.anonymous) {
+            ++i;
+            continue;
+          }
+          size_t j = i; // run of pages to read
+          while(j != n && !(pages[j] == residency::absent && c.anonymous))
+            ++j;
+          char* const data = l.buffer + i * page_size_;
+          read_memory(block + i * page_size_, (j - i) * page_size_, data);
+          for(size_t k = i; k != j; ) {
+            if(zero_page(data + (k - i) * page_size_, page_size_)) {
+              ++k;
+              continue;
+            }
+            size_t m = k;
+            while(m != j && !zero_page(data + (m - i) * page_size_, page_size_))
+              ++m;
+            uint64_t const run_at = at + k * page_size_;
+            punch_hole(hole, run_at);
+            uint64_t ignored = 0;
+            if(!write_at(fd_, data + (k - i) * page_size_, (m - k) * page_size_, run_at, ignored))
+              l.failed = true;
+            l.written += (m - k) * page_size_;
+            hole = run_at + (m - k) * page_size_;
+            k = m;
+          }
+          i = j;
+        }
+        block += size;
+      }
+      punch_hole(hole, c.offset + (c.end - c.begin));
+    }
+
+
+    // Preallocated spool keeps its blocks unless they are released
+
+    void punch_hole(uint64_t from, uint64_t to) const noexcept {
+      uint64_t const end = to < reserved_ ? to : reserved_;
+      if(end > from)
+        fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off_t(from), off_t(end - from));
+    }
+
+
+    static bool zero_page(void const* page, size_t size) noexcept {
+#if defined(__SSE2__)
+      auto const* p = static_cast<__m128i const*>(page);
+      __m128i const zero = _mm_setzero_si128();
+      for(size_t i = 0; i != size / sizeof(__m128i); i += 4) {
+        __m128i const v = _mm_or_si128(_mm_or_si128(_mm_load_si128(p + i), _mm_load_si128(p + i + 1)),
+                                       _mm_or_si128(_mm_load_si128(p + i + 2), _mm_load_si128(p + i + 3)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF)
+          return false;
+      }
+      return true;
+#elif defined(__aarch64__)
+      auto const* p = static_cast<uint8_t const*>(page);
+      for(size_t i = 0; i != size; i += 64) {
+        uint8x16_t const v = vorrq_u8(vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+                                      vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48)));
+        if(vmaxvq_u8(v) != 0)
+          return false;
+      }
+      return true;
+#else
+      auto const* p = static_cast<uint64_t const*>(page);
+      for(size_t i = 0; i != size / sizeof(uint64_t); i += 8)
+        if((p[i] | p[i + 1] | p[i + 2] | p[i + 3] | p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7]) != 0)
+          return false;
+      return true;
+#endif
+    }
+
+  }; // minidump_writer
+
+
+} // airbag
@@ -0,0 +1,376 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+
+#if defined(_WIN32)
+
+#if !defined(_X86_) && !defined(_AMD64_) && !defined(_ARM_) && !defined(_ARM64_)
+#if defined(_M_IX86)
+#define _X86_
+#elif defined(_M_AMD64)
+#define _AMD64_
+#elif defined(_M_ARM)
+#define _ARM_
+#elif defined(_M_ARM64)
+#define _ARM64_
+#endif
+#endif
+
+#include <minwindef.h>
+#include <processthreadsapi.h>
+#include <libloaderapi.h>
+#include <psapi.h>
+
+#elif defined(__linux__)
+
+#include <elf.h>
+#include <link.h>
+#include <limits.h>
+#include <unistd.h>
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Loaded modules sorted by base address. Readers (fault path) never wait:
+  // they pin one of two snapshots, writer rebuilds another one and publishes it
+
+  class module_map {
+  public:
+
+    static constexpr size_t build_id_capacity = 32;
+
+    struct module {
+      uintptr_t base{0};
+      size_t size{0};
+      uint8_t build_id[build_id_capacity]{};
+      size_t build_id_size{0};
+      char const* path{nullptr};
+    };
+
+
+    // Rebuilds snapshot if set of loaded modules was changed since last call.
+    // Cheap when nothing was changed (loader counters on Linux), watchdog
+    // calls it every period. Call it after dlopen/dlclose otherwise, fault
+    // path finds modules loaded later by /proc/self/maps only
+
+    static bool refresh() noexcept {
+      std::lock_guard<std::mutex> lock{writer_};
+      int const current = current_.load();
+      int const next = current ^ 1;
+      snapshot& target = snapshots_[next];
+      while(target.readers.load() != 0)
+        std::this_thread::yield();
+      try {
+        if(!collect(snapshots_[current], target))
+          return false;
+      } catch(std::bad_alloc const&) {
+        return false;
+      }
+      sort(target);
+      current_.store(next);
+      return true;
+    }
+
+
+    // f(module const&) is called only inside lookup, path is not valid after it
+
+    template<typename F> static bool find(uintptr_t address, F&& f) noexcept {
+      reader pinned;
+      auto const& modules = pinned->modules;
+      size_t low = 0, high = modules.size();
+      while(low != high) {
+        size_t const middle = low + (high - low) / 2;
+        if(modules[middle].base <= address)
+          low = middle + 1;
+        else
+          high = middle;
+      }
+      if(low == 0)
+        return false;
+      module const& found = modules[low - 1];
+      if(address - found.base >= found.size)
+        return false;
+      f(found);
+      return true;
+    }
+
+
+    template<typename F> static size_t visit(F&& f) noexcept {
+      reader pinned;
+      for(module const& each: pinned->modules)
+        f(each);
+      return pinned->modules.size();
+    }
+
+
+    static size_t size() noexcept {
+      reader pinned;
+      return pinned->modules.size();
+    }
+
+#if defined(__linux__)
+
+    // Takes GNU build-id from PT_NOTE segment
+
+    static void read_build_id(module& m, unsigned char const* notes, size_t size) noexcept {
+      size_t offset = 0;
+      while(offset + sizeof(ElfW(Nhdr)) <= size) {
+        ElfW(Nhdr) header;
+        std::memcpy(&header, notes + offset, sizeof(header));
+        offset += sizeof(header);
+        size_t const name_size = (header.n_namesz + 3) & ~size_t(3);
+        size_t const data_size = (header.n_descsz + 3) & ~size_t(3);
+        if(offset + name_size + data_size > size)
+          return;
+        if(header.n_type == NT_GNU_BUILD_ID && header.n_namesz == 4
+           && std::memcmp(notes + offset, "GNU", 4) == 0) {
+          size_t const n = header.n_descsz < build_id_capacity ? header.n_descsz : build_id_capacity;
+          std::memcpy(m.build_id, notes + offset + name_size, n);
+          m.build_id_size = n;
+          return;
+        }
+        offset += name_size + data_size;
+      }
+    }
+
+#endif
+
+
+  private:
+
+    struct snapshot {
+      std::vector<module> modules;
+      std::vector<char> paths;
+      std::atomic<int> readers{0};
+#if defined(_WIN32)
+      std::vector<HMODULE> handles;
+#else
+      unsigned long long adds{0};
+      unsigned long long subs{0};
+#endif
+    }; // snapshot
+
+
+    class reader {
+    public:
+
+      reader() noexcept {
+        for(;;) {
+          index_ = current_.load();
+          snapshots_[index_].readers.fetch_add(1);
+          if(current_.load() == index_)
+            return;
+          snapshots_[index_].readers.fetch_sub(1);
+        }
+      }
+
+      reader(reader const&) = delete;
+      reader& operator = (reader const&) = delete;
+      ~reader() noexcept { snapshots_[index_].readers.fetch_sub(1); }
+
+      snapshot const* operator -> () const noexcept { return &snapshots_[index_]; }
+
+    private:
+      int index_;
+    }; // reader
+
+
+    static std::mutex writer_;
+    static std::atomic<int> current_;
+    static snapshot snapshots_[2];
+
+
+    static void sort(snapshot& target) {
+      // Paths are stored as offsets while arena grows
+      for(module& each: target.modules)
+        each.path = target.paths.data() + size_t(each.path);
+      std::sort(target.modules.begin(), target.modules.end(), [](module const& a, module const& b) {
+        return a.base < b.base;
+      });
+    }
+
+
+    static void add(snapshot& target, module m, char const* path, size_t path_size) {
+      m.path = reinterpret_cast<char const*>(target.paths.size());
+      target.paths.insert(target.paths.end(), path, path + path_size);
+      target.paths.push_back('\0');
+      target.modules.push_back(m);
+    }
+
+
+#if defined(_WIN32)
+
+    static bool collect(snapshot const& current, snapshot& target) {
+      auto const process = GetCurrentProcess();
+      target.handles.resize(current.handles.size() < 512 ? 512 : current.handles.size());
+      for(;;) {
+        DWORD needed = 0;
+        if(!K32EnumProcessModules(process, target.handles.data(),
+                                  DWORD(target.handles.size() * sizeof(HMODULE)), &needed))
+          return false;
+        size_t const count = needed / sizeof(HMODULE);
+        if(count <= target.handles.size()) {
+          target.handles.resize(count);
+          break;
+        }
+        target.handles.resize(count + count / 4);
+      }
+      if(!current.modules.empty() && target.handles == current.handles)
+        return false;
+
+      target.modules.clear();
+      target.paths.clear();
+      for(HMODULE handle: target.handles) {
+        MODULEINFO info;
+        if(!K32GetModuleInformation(process, handle, &info, sizeof(MODULEINFO)))
+          continue;
+        module m;
+        m.base = uintptr_t(info.lpBaseOfDll);
+        m.size = info.SizeOfImage;
+        read_build_id(m);
+        char path[MAX_PATH];
+        DWORD const path_size = GetModuleFileNameA(handle, path, MAX_PATH);
+        add(target, m, path, path_size);
+      }
+      return true;
+    }
+
+
+    // CodeView GUID and age of the PDB, as used by symbol servers
+
+    static void read_build_id(module& m) noexcept {
+      auto const* image = reinterpret_cast<unsigned char const*>(m.base);
+      auto const* dos = reinterpret_cast<IMAGE_DOS_HEADER const*>(image);
+      if(dos->e_magic != IMAGE_DOS_SIGNATURE)
+        return;
+      auto const* nt = reinterpret_cast<IMAGE_NT_HEADERS const*>(image + dos->e_lfanew);
+      if(nt->Signature != IMAGE_NT_SIGNATURE)
+        return;
+      auto const& directory = nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+      auto const* debug = reinterpret_cast<IMAGE_DEBUG_DIRECTORY const*>(image + directory.VirtualAddress);
+      size_t const count = directory.Size / sizeof(IMAGE_DEBUG_DIRECTORY);
+      for(size_t i = 0; i != count; ++i) {
+        if(debug[i].Type != IMAGE_DEBUG_TYPE_CODEVIEW || debug[i].SizeOfData < 24)
+          continue;
+        auto const* codeview = image + debug[i].AddressOfRawData;
+        if(std::memcmp(codeview, "RSDS", 4) != 0)
+          continue;
+        std::memcpy(m.build_id, codeview + 4, 20);
+        m.build_id_size = 20;
+        return;
+      }
+    }
+
+#else
+
+    struct collector {
+      snapshot const* current;
+      snapshot* target;
+      bool changed;
+    };
+
+
+    static bool collect(snapshot const& current, snapshot& target) {
+      collector c{&current, &target, false};
+      dl_iterate_phdr(&module_map::on_module, &c);
+      return c.changed;
+    }
+
+
+    static int on_module(dl_phdr_info* info, size_t info_size, void* data) {
+      auto& c = *static_cast<collector*>(data);
+      if(!c.changed) {
+        // Loader counters tell whether anything was loaded or unloaded
+        if(info_size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+          if(!c.current->modules.empty() && info->dlpi_adds == c.current->adds
+             && info->dlpi_subs == c.current->subs)
+            return 1;
+          c.target->adds = info->dlpi_adds;
+          c.target->subs = info->dlpi_subs;
+        }
+        c.changed = true;
+        c.target->modules.clear();
+        c.target->paths.clear();
+      }
+
+      uintptr_t low = UINTPTR_MAX, high = 0;
+      module m;
+      for(int i = 0; i != info->dlpi_phnum; ++i) {
+        ElfW(Phdr) const& header = info->dlpi_phdr[i];
+        if(header.p_type == PT_LOAD) {
+          uintptr_t const begin = info->dlpi_addr + header.p_vaddr;
+          if(begin < low)
+            low = begin;
+          if(begin + header.p_memsz > high)
+            high = begin + header.p_memsz;
+        } else if(header.p_type == PT_NOTE) {
+          read_build_id(m, reinterpret_cast<unsigned char const*>(info->dlpi_addr + header.p_vaddr),
+                        header.p_memsz);
+        }
+      }
+      if(low >= high)
+        return 0;
+      m.base = low;
+      m.size = high - low;
+
+      char const* path = info->dlpi_name;
+      char executable[PATH_MAX];
+      if(path == nullptr || *path == '\0') {
+        ssize_t const size = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+        executable[size < 0 ? 0 : size] = '\0';
+        path = executable;
+      }
+      add(*c.target, m, path, std::strlen(path));
+      return 0;
+    }
+
+#endif
+
+  }; // module_map
+
+  inline std::mutex module_map::writer_;
+  inline std::atomic<int> module_map::current_;
+  inline module_map::snapshot module_map::snapshots_[2];
+
+
+} // airbag
@@ -23,7 +23,14 @@
 #pragma once
 
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <mutex>
+#include <new>
+#include "fault_filter.hpp"
+#include "handler_registry.hpp"
 #include "system_failure.hpp"
 
 
@@ -45,6 +52,26 @@
 #include <minwindef.h>
 #include <crtdbg.h>
 #include <errhandlingapi.h>
+#include <processthreadsapi.h>
+#include <synchapi.h>
+
+#elif defined(__linux__)
+
+#include <exception>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "signal_stack.hpp"
+
+extern "C" void __cxa_pure_virtual();
+
+#if !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
 #else
 
@@ -79,10 +106,101 @@ namespace airbag {
     using pure_call_handler = std::function<void()>;
     using system_failure_handler = std::function<void(system_failure const&)>;
 
+    using pure_call_function = void (*)(void* context);
+    using system_failure_function = void (*)(void* context, system_failure const& failure);
+    using handler_id = handler_registry<>::id_type;
+
+
+    // Fault of a thread while the first faulting thread runs hooks
+
+    struct secondary_fault {
+      uint64_t thread{0};
+      unsigned long code{0}; // signal or exception code
+      uintptr_t address{0};  // faulting address
+    };
+
+    static constexpr size_t secondary_faults_capacity = 256;
+
 
     process_error() noexcept { }
 
 
+    // Only the first faulting thread runs hooks, for at most budget (zero is
+    // unlimited, Linux enforces it by a thread timer and SIGABRT). Threads faulting
+    // meanwhile record themselves as secondary faults and wait for it
+
+    static void handler_budget(std::chrono::seconds budget) noexcept {
+      budget_seconds_.store(budget.count() > 0 ? unsigned(budget.count()) : 0);
+    }
+    static std::chrono::seconds handler_budget() noexcept {
+      return std::chrono::seconds{budget_seconds_.load()};
+    }
+
+
+    template<typename F> static size_t visit_secondary_faults(F&& f) noexcept {
+      size_t n = secondary_count_.load();
+      if(n > secondary_faults_capacity)
+        n = secondary_faults_capacity;
+      size_t visited = 0;
+      for(size_t i = 0; i != n; ++i) {
+        secondary_slot const& slot = secondary_faults_[i];
+        secondary_fault fault;
+        fault.thread = slot.thread.load(std::memory_order_acquire);
+        if(fault.thread == 0)
+          continue; // not published yet
+        fault.code = slot.code;
+        fault.address = slot.address;
+        f(fault);
+        ++visited;
+      }
+      return visited;
+    }
+
+
+    // Several subsystems can attach their hooks, called by priority (higher first).
+    // Don't add or remove handlers from inside a handler
+
+    static handler_id add_system_failure_handler(system_failure_function f, void* context,
+                                                 int priority = 0) noexcept {
+      handler_id const id = system_failure_handlers_.add(f, context, priority);
+      if(id != handler_registry<>::invalid_id)
+        install();
+      return id;
+    }
+
+
+    static bool remove_system_failure_handler(handler_id id) noexcept {
+      return system_failure_handlers_.remove(id);
+    }
+
+
+    static handler_id add_pure_call_handler(pure_call_function f, void* context,
+                                            int priority = 0) noexcept {
+      handler_id const id = pure_call_handlers_.add(f, context, priority);
+#if defined(_WIN32)
+      if(id != handler_registry<>::invalid_id && !purecall_installed_.exchange(true))
+        _set_purecall_handler(&process_error::pure_call_dispatcher);
+#endif
+      return id;
+    }
+
+
+    static bool remove_pure_call_handler(handler_id id) noexcept {
+      return pure_call_handlers_.remove(id);
+    }
+
+
+    // Replaces handler set by previous call, priority 0
+
+    static void pre_system_failure(system_failure_handler h) noexcept {
+      replace(system_failure_slot_, std::move(h), [](system_failure_handler* f) {
+        return add_system_failure_handler(&invoke<system_failure_handler, system_failure const&>, f);
+      }, &remove_system_failure_handler);
+    }
+
+
+#if defined(_WIN32)
+
     ~process_error() noexcept {
       _CrtSetReportMode(_CRT_ERROR, previous_report_mode_);
       _set_purecall_handler(previous_purecall_handler_);
@@ -91,47 +209,433 @@ namespace airbag {
 
 
     void on_pure_call(pure_call_handler h) noexcept {
-      pure_call_handler_ = std::move(h);
       previous_report_mode_ = _CrtSetReportMode(_CRT_ERROR, _CRTDBG_MODE_FILE);
       _CrtSetReportFile(_CRT_ERROR, 0);
       previous_purecall_handler_ = _set_purecall_handler(&process_error::pure_call_dispatcher);
+      purecall_installed_ = true;
+      replace(pure_call_slot_, std::move(h), [](pure_call_handler* f) {
+        return add_pure_call_handler(&invoke<pure_call_handler>, f);
+      }, &remove_pure_call_handler);
     }
 
+#else
 
-    static void pre_system_failure(system_failure_handler h) noexcept {
-      system_failure_handler_ = std::move(h);
+    ~process_error() noexcept {
+      restore_signals();
+    }
+
+
+    void on_pure_call(pure_call_handler h) noexcept {
+      replace(pure_call_slot_, std::move(h), [](pure_call_handler* f) {
+        return add_pure_call_handler(&invoke<pure_call_handler>, f);
+      }, &remove_pure_call_handler);
+    }
+
+#endif
+
+
+  private:
+
+    // Handler set by on_pure_call / pre_system_failure
+
+    template<typename H> struct slot {
+      std::mutex mutex;
+      H* handler{nullptr};
+      handler_id id{handler_registry<>::invalid_id};
+    }; // slot
+
+    struct secondary_slot {
+      std::atomic<uint64_t> thread{0};
+      unsigned long code{0};
+      uintptr_t address{0};
+    }; // secondary_slot
+
+    static std::atomic<uint64_t> owner_;
+    static std::atomic<uint64_t> reported_;
+    static std::atomic<unsigned> budget_seconds_;
+    static std::atomic<size_t> secondary_count_;
+    static secondary_slot secondary_faults_[secondary_faults_capacity];
+
+    static handler_registry<> pure_call_handlers_;
+    static handler_registry<system_failure const&> system_failure_handlers_;
+    static slot<pure_call_handler> pure_call_slot_;
+    static slot<system_failure_handler> system_failure_slot_;
+
+
+    static void record_secondary(uint64_t thread, unsigned long code, uintptr_t address) noexcept {
+      size_t const i = secondary_count_.fetch_add(1);
+      if(i >= secondary_faults_capacity)
+        return;
+      secondary_faults_[i].code = code;
+      secondary_faults_[i].address = address;
+      secondary_faults_[i].thread.store(thread, std::memory_order_release);
+    }
+
+
+    // Parks secondary faulting thread while hooks run, at most budget
+
+    static void wait_reported() noexcept {
+      unsigned long const limit = budget_seconds_.load() * 1000ul;
+      for(unsigned long waited = 0; limit == 0 || waited < limit; ++waited) {
+        uint64_t const owner = owner_.load();
+        if(owner == 0 || reported_.load() == owner)
+          return;
+#if defined(_WIN32)
+        Sleep(1);
+#else
+        timespec const pause{0, 1000000};
+        nanosleep(&pause, nullptr);
+#endif
+      }
+    }
+
+
+    template<typename H, typename... Args> static void invoke(void* context, Args... args) {
+      (*static_cast<H*>(context))(args...);
+    }
+
+
+    template<typename H, typename A, typename R>
+    static void replace(slot<H>& s, H h, A add, R remove) noexcept {
+      H* const handler = h ? new(std::nothrow) H{std::move(h)} : nullptr;
+      std::lock_guard<std::mutex> lock{s.mutex};
+      handler_id const id = handler != nullptr ? add(handler) : handler_registry<>::invalid_id;
+      if(s.handler != nullptr) {
+        remove(s.id);
+        delete s.handler;
+      }
+      s.handler = id != handler_registry<>::invalid_id ? handler : nullptr;
+      s.id = id;
+      if(handler != nullptr && id == handler_registry<>::invalid_id)
+        delete handler;
+    }
+
+#if defined(_WIN32)
+
+    static inline std::atomic_bool handler_installed_;
+    static inline std::atomic_bool purecall_installed_;
+
+
+    static void install() noexcept {
+      module_map::refresh();
+      if(handler_installed_.exchange(true))
+        return;
       constexpr ULONG call_me_first = 1;
       AddVectoredExceptionHandler(call_me_first, &process_error::system_failure_dispatcher);
     }
 
+#else
 
-  private:
+    static void install() noexcept {
+      module_map::refresh();
+      stack_trace::register_thread();
+      signal_stack::ensure();
+      install_signals();
+      first_chance::handler.store(&process_error::first_chance_dispatcher);
+    }
 
-    static pure_call_handler pure_call_handler_;
-    static system_failure_handler system_failure_handler_;
+#endif
+
+#if defined(_WIN32)
 
     int previous_report_mode_{0};
     _purecall_handler previous_purecall_handler_{nullptr};
 
 
     static void pure_call_dispatcher() noexcept {
-      pure_call_handler_();
+      pure_call_handlers_.dispatch();
       exit(1);
     }
 
 
     static LONG WINAPI system_failure_dispatcher(_EXCEPTION_POINTERS *info) noexcept {
       constexpr DWORD microsoft_cxx_exception = 0xE06D7363;
-      if (info->ExceptionRecord->ExceptionCode == microsoft_cxx_exception)
+      DWORD const code = info->ExceptionRecord->ExceptionCode;
+      if (code == microsoft_cxx_exception)
         return EXCEPTION_CONTINUE_SEARCH; // C++ exception -> search next catch
-      system_failure_handler_(system_failure{info});
+      if ((code >> 30) == 1)
+        return EXCEPTION_CONTINUE_SEARCH; // informational: debug output, thread name
+      if (first_chance::recovery != nullptr)
+        return EXCEPTION_CONTINUE_SEARCH; // inside guarded(), its filter takes it
+      uintptr_t const address = fault_address(*info->ExceptionRecord);
+      if (!fault_filter::empty() && fault_filter::contains(address))
+        return EXCEPTION_CONTINUE_SEARCH; // expected by someone else
+      uint64_t const self = GetCurrentThreadId();
+      uint64_t owner = 0;
+      if (owner_.compare_exchange_strong(owner, self)) {
+        system_failure_handlers_.dispatch(system_failure{info});
+        owner_.store(0); // first chance, someone may handle it yet
+      } else if (owner != self) {
+        record_secondary(self, code, address);
+        wait_reported();
+      } // else fault inside a hook
       return EXCEPTION_CONTINUE_SEARCH;
     }
 
+
+    static uintptr_t fault_address(EXCEPTION_RECORD const& record) noexcept {
+      if((record.ExceptionCode == EXCEPTION_ACCESS_VIOLATION
+          || record.ExceptionCode == EXCEPTION_IN_PAGE_ERROR) && record.NumberParameters >= 2)
+        return uintptr_t(record.ExceptionInformation[1]);
+      return uintptr_t(record.ExceptionAddress);
+    }
+
+#else
+
+    friend void ::__cxa_pure_virtual();
+
+    static constexpr int fault_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    static constexpr int fault_signals_count = int(sizeof(fault_signals) / sizeof(fault_signals[0]));
+
+    static inline std::atomic_bool signals_installed_;
+    static inline struct sigaction previous_actions_[fault_signals_count];
+    static inline thread_local bool in_hooks_{false};
+    static inline thread_local bool chained_{false}; // hooks run, fault passed to previous handler
+    static inline thread_local int budget_timer_{-1};
+
+
+    static void install_signals() noexcept {
+      if(signals_installed_.exchange(true))
+        return;
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_sigaction = &process_error::system_failure_dispatcher;
+      action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER; // to catch faults inside hooks
+      sigemptyset(&action.sa_mask);
+      for(int i = 0; i != fault_signals_count; ++i)
+        sigaction(fault_signals[i], &action, &previous_actions_[i]);
+    }
+
+
+    static void restore_signals() noexcept {
+      if(!signals_installed_.exchange(false))
+        return;
+      for(int i = 0; i != fault_signals_count; ++i)
+        sigaction(fault_signals[i], &previous_actions_[i], nullptr);
+    }
+
+
+    // Pass the fault to the action installed before us: call its handler
+    // or let the fault happen again with default action
+
+    static bool chain(int signal, siginfo_t* info, void* context) noexcept {
+      for(int i = 0; i != fault_signals_count; ++i)
+        if(fault_signals[i] == signal)
+          return signal_safe::chain(previous_actions_[i], signal, info, context);
+      return false;
+    }
+
+
+    static void reset_default(int signal) noexcept {
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = SIG_DFL;
+      sigemptyset(&action.sa_mask);
+      sigaction(signal, &action, nullptr);
+    }
+
+
+    // Fault inside a hook: let default action take it
+
+    static void escalate(int signal, siginfo_t* info) noexcept {
+      static constexpr char message[] = "airbag: fault inside crash handler\n";
+      ssize_t const written = write(STDERR_FILENO, message, sizeof(message) - 1);
+      (void)written;
+      reset_default(signal);
+      if(info->si_code <= 0)
+        raise(signal);
+    }
+
+
+    // Timer of the faulting thread, created by raw syscalls as timer_create
+    // is not async signal safe. It raises SIGABRT in that thread only, so
+    // application SIGALRM and alarm are left alone
+
+    static void arm_budget() noexcept {
+      unsigned const seconds = budget_seconds_.load();
+      if(seconds == 0)
+        return;
+      struct sigevent event;
+      memset(&event, 0, sizeof(event));
+      event.sigev_notify = SIGEV_THREAD_ID;
+      event.sigev_signo = SIGABRT;
+      event.sigev_notify_thread_id = pid_t(syscall(SYS_gettid));
+      int timer = -1;
+      if(syscall(SYS_timer_create, CLOCK_MONOTONIC, &event, &timer) != 0)
+        return;
+      struct itimerspec const expiration{{0, 0}, {time_t(seconds), 0}};
+      if(syscall(SYS_timer_settime, timer, 0, &expiration, nullptr) != 0) {
+        syscall(SYS_timer_delete, timer);
+        return;
+      }
+      budget_timer_ = timer;
+    }
+
+
+    static void cancel_budget() noexcept {
+      if(budget_timer_ == -1)
+        return;
+      syscall(SYS_timer_delete, budget_timer_);
+      budget_timer_ = -1;
+    }
+
+
+    static bool budget_expired(int signal, siginfo_t const* info) noexcept {
+      return signal == SIGABRT && info->si_code == SI_TIMER
+          && budget_timer_ != -1 && info->si_timerid == budget_timer_;
+    }
+
+
+    [[noreturn]] static void abort_hooks() noexcept {
+      static constexpr char message[] = "airbag: crash handler exceeded its time budget\n";
+      ssize_t const written = write(STDERR_FILENO, message, sizeof(message) - 1);
+      (void)written;
+      reset_default(SIGABRT);
+      sigset_t abort_only;
+      sigemptyset(&abort_only);
+      sigaddset(&abort_only, SIGABRT);
+      pthread_sigmask(SIG_UNBLOCK, &abort_only, nullptr);
+      raise(SIGABRT);
+      _exit(128 + SIGABRT);
+    }
+
+
+    // si_addr is data address for SIGSEGV/SIGBUS and instruction for SIGFPE/SIGILL.
+    // Faults inside guarded() are recovered by thread_error whatever order
+    // handlers were installed in, they cost no hooks, dumps or budget
+
+    static bool benign(int signal, siginfo_t const* info) noexcept {
+      if(signal == SIGABRT || info->si_code <= 0)
+        return false;
+      return first_chance::recovery != nullptr
+          || (!fault_filter::empty() && fault_filter::contains(uintptr_t(info->si_addr)));
+    }
+
+
+    static void pure_call_dispatcher() noexcept {
+      if(pure_call_handlers_.empty()) {
+        static constexpr char message[] = "pure virtual method called\n";
+        ssize_t const written = write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void)written;
+        std::terminate();
+      }
+      pure_call_handlers_.dispatch();
+      exit(1);
+    }
+
+
+    // Hooks run in the faulting thread. Fault while they run is a fault
+    // inside a hook whatever thread owns the crash. Budget is armed only
+    // when the process is about to die, not for faults translated to thread_error
+
+    static void run_hooks(system_failure const& failure, bool fatal) noexcept {
+      in_hooks_ = true;
+      if(fatal)
+        arm_budget();
+      if(!system_failure_handlers_.empty())
+        system_failure_handlers_.dispatch(failure);
+      cancel_budget();
+      in_hooks_ = false;
+    }
+
+
+    static bool handled_by_previous(int signal) noexcept {
+      for(int i = 0; i != fault_signals_count; ++i)
+        if(fault_signals[i] == signal)
+          return (previous_actions_[i].sa_flags & SA_SIGINFO)
+              ? previous_actions_[i].sa_sigaction != nullptr
+              : previous_actions_[i].sa_handler != SIG_DFL && previous_actions_[i].sa_handler != SIG_IGN;
+      return false;
+    }
+
+
+    // Fault about to be translated to thread_error: hooks run, process goes on
+
+    static void first_chance_dispatcher(system_failure const& failure) noexcept {
+      if(chained_) { // hooks already run, we are chained from system_failure_dispatcher
+        chained_ = false;
+        return;
+      }
+      if(in_hooks_)
+        return;
+      uint64_t const self = uint64_t(syscall(SYS_gettid));
+      uint64_t owner = 0;
+      if(owner_.compare_exchange_strong(owner, self)) {
+        run_hooks(failure, false);
+        owner_.store(0);
+      } else {
+        record_secondary(self, unsigned(failure.code()), uintptr_t(failure.info()->si_addr));
+        wait_reported();
+      }
+    }
+
+
+    // Previous handler may not return (siglongjmp), so crash is released
+    // before calling it. Default action kills the process, crash stays owned
+
+    static void system_failure_dispatcher(int signal, siginfo_t* info, void* context) noexcept {
+      int const saved_errno = errno;
+      chained_ = false;
+      if(benign(signal, info)) {
+        chain(signal, info, context);
+        errno = saved_errno;
+        return;
+      }
+      if(in_hooks_) {
+        if(budget_expired(signal, info))
+          abort_hooks();
+        escalate(signal, info);
+        errno = saved_errno;
+        return;
+      }
+      uint64_t const self = uint64_t(syscall(SYS_gettid));
+      uint64_t owner = 0;
+      if(owner_.compare_exchange_strong(owner, self)) {
+        run_hooks(system_failure{info, context}, true);
+        if(handled_by_previous(signal)) {
+          owner_.store(0);
+          chained_ = true;
+          chain(signal, info, context);
+          chained_ = false;
+        } else {
+          reported_.store(self);
+          if(chain(signal, info, context)) { // ignored, process goes on
+            reported_.store(0);
+            owner_.store(0);
+          }
+        }
+      } else {
+        record_secondary(self, unsigned(signal), uintptr_t(info->si_addr));
+        wait_reported();
+        chain(signal, info, context);
+      }
+      errno = saved_errno;
+    }
+
+#endif
+
   }; // fatal_error
 
-  inline process_error::pure_call_handler process_error::pure_call_handler_;
-  inline process_error::system_failure_handler process_error::system_failure_handler_;
+  inline std::atomic<uint64_t> process_error::owner_{0};
+  inline std::atomic<uint64_t> process_error::reported_{0};
+  inline std::atomic<unsigned> process_error::budget_seconds_{30};
+  inline std::atomic<size_t> process_error::secondary_count_{0};
+  inline process_error::secondary_slot process_error::secondary_faults_[process_error::secondary_faults_capacity];
+  inline handler_registry<> process_error::pure_call_handlers_;
+  inline handler_registry<system_failure const&> process_error::system_failure_handlers_;
+  inline process_error::slot<process_error::pure_call_handler> process_error::pure_call_slot_;
+  inline process_error::slot<process_error::system_failure_handler> process_error::system_failure_slot_;
 
 
 } // airbag
+
+
+#if defined(__linux__)
+
+// Weak definition takes precedence over the one from C++ runtime library
+
+extern "C" __attribute__((weak)) void __cxa_pure_virtual() {
+  airbag::process_error::pure_call_dispatcher();
+}
+
+#endif
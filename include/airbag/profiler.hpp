@@ -0,0 +1,362 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "module_map.hpp"
+#include "signal_safe.hpp"
+#include "stack_trace.hpp"
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Sampling profiler. Every registered thread has its own CPU time timer
+  // sending SIGPROF to it, handler walks frames into per-thread ring without
+  // locks, background thread drains rings and counts equal stacks
+
+  class profiler {
+  public:
+
+    using clock_type = std::chrono::steady_clock;
+    using duration = clock_type::duration;
+
+    static constexpr size_t threads_capacity = 256;
+    static constexpr size_t depth = 32; // frames per sample
+    static constexpr size_t ring_capacity = 256; // samples per thread, power of two
+
+
+    profiler() noexcept = default;
+    profiler(profiler const&) = delete;
+    profiler& operator = (profiler const&) = delete;
+    ~profiler() { stop(); }
+
+
+    // Configured before start()
+
+    profiler& frequency(unsigned hz) noexcept { frequency_ = hz == 0 ? 1 : hz; return *this; }
+    profiler& drain_period(duration p) noexcept { drain_period_ = p; return *this; }
+
+
+    // Arms timers of registered threads, false if another profiler is running
+
+    bool start() {
+      std::lock_guard<std::mutex> lock{registry_};
+      profiler* expected = nullptr;
+      if(!install() || !running_.compare_exchange_strong(expected, this))
+        return false;
+      for(size_t i = 0; i != threads_capacity; ++i)
+        if(slots_[i].state.load() == active)
+          arm(slots_[i], frequency_);
+      stopping_ = false;
+      drainer_ = std::thread([this] { run(); });
+      return true;
+    }
+
+
+    // Disarms timers and drains what is left
+
+    void stop() {
+      {
+        std::lock_guard<std::mutex> lock{registry_};
+        if(running_.load() != this)
+          return;
+        for(size_t i = 0; i != threads_capacity; ++i)
+          if(slots_[i].state.load() == active)
+            arm(slots_[i], 0);
+        running_.store(nullptr);
+      }
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        stopping_ = true;
+      }
+      wakeup_.notify_one();
+      drainer_.join();
+      drain();
+    }
+
+
+    // Called by each thread to be sampled, idempotent. Timer and ring are
+    // freed at thread exit
+
+    static bool register_thread() noexcept {
+      if(registration_.index != none)
+        return true;
+      std::lock_guard<std::mutex> lock{registry_};
+      for(size_t i = 0; i != threads_capacity; ++i) {
+        slot& s = slots_[i];
+        if(s.state.load() != vacant)
+          continue;
+        if(s.samples == nullptr) {
+          s.samples = new(std::nothrow) ring;
+          if(s.samples == nullptr)
+            return false;
+        }
+        sigevent event;
+        std::memset(&event, 0, sizeof(event));
+        event.sigev_notify = SIGEV_THREAD_ID;
+        event.sigev_signo = SIGPROF;
+        event.sigev_value.sival_ptr = &slots_; // tells our timers from others
+#if defined(sigev_notify_thread_id)
+        event.sigev_notify_thread_id = pid_t(syscall(SYS_gettid));
+#else
+        event._sigev_un._tid = pid_t(syscall(SYS_gettid));
+#endif
+        if(timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &s.timer) != 0)
+          return false;
+        stack_trace::register_thread();
+        registration_.index = i;
+        ring_ = s.samples;
+        s.state.store(active);
+        profiler* const current = running_.load();
+        if(current != nullptr)
+          arm(s, current->frequency_);
+        return true;
+      }
+      return false;
+    }
+
+
+    uint64_t samples() const {
+      std::lock_guard<std::mutex> lock{mutex_};
+      return samples_;
+    }
+
+
+    // Samples lost because ring was full
+
+    uint64_t dropped() const noexcept {
+      uint64_t n = 0;
+      for(size_t i = 0; i != threads_capacity; ++i)
+        if(slots_[i].samples != nullptr)
+          n += slots_[i].samples->dropped.load(std::memory_order_relaxed);
+      return n;
+    }
+
+
+    // Collapsed stacks (flamegraph.pl, speedscope, pprof): frames from the
+    // root separated by ';' and number of samples. Frame is 'module+0xoffset'
+    // for symbolization offline or raw address outside known modules
+
+    bool write_collapsed(std::FILE* file) {
+      drain();
+      module_map::refresh();
+      std::lock_guard<std::mutex> lock{mutex_};
+      for(auto const& [frames, count]: stacks_) {
+        for(size_t i = frames.size(); i != 0; --i) {
+          uintptr_t const address = frames[i - 1];
+          bool const found = module_map::find(address, [&](module_map::module const& m) {
+            char const* const name = signal_safe::base_name(m.path, signal_safe::length(m.path));
+            std::fprintf(file, "%s+0x%llx", name, (unsigned long long)(address - m.base));
+          });
+          if(!found)
+            std::fprintf(file, "0x%llx", (unsigned long long)address);
+          std::fputc(i == 1 ? ' ' : ';', file);
+        }
+        std::fprintf(file, "%llu\n", (unsigned long long)count);
+      }
+      return std::ferror(file) == 0;
+    }
+
+
+    void clear() {
+      drain();
+      std::lock_guard<std::mutex> lock{mutex_};
+      stacks_.clear();
+      samples_ = 0;
+    }
+
+
+  private:
+
+    enum state : int {
+      vacant, active
+    };
+
+    static constexpr size_t none = ~size_t(0);
+
+    struct sample {
+      size_t count;
+      void* frames[depth];
+    }; // sample
+
+    // Single producer (signal handler) and single consumer (drain)
+    struct ring {
+      alignas(64) std::atomic<uint32_t> head{0};
+      alignas(64) std::atomic<uint32_t> tail{0};
+      std::atomic<uint64_t> dropped{0};
+      sample samples[ring_capacity];
+    }; // ring
+
+    struct slot {
+      std::atomic<int> state{vacant};
+      timer_t timer{};
+      ring* samples{nullptr}; // kept for the next thread taking the slot
+    }; // slot
+
+    // Deletes timer at thread exit, samples left in ring are drained later
+    struct registration {
+      size_t index{none};
+
+      ~registration() noexcept {
+        if(index == none)
+          return;
+        ring_ = nullptr;
+        std::lock_guard<std::mutex> lock{registry_};
+        timer_delete(slots_[index].timer);
+        slots_[index].state.store(vacant);
+      }
+    }; // registration
+
+    static slot slots_[threads_capacity];
+    static std::mutex registry_; // registration, start and stop
+    static std::atomic<profiler*> running_;
+    static struct sigaction previous_;
+    static thread_local registration registration_;
+    static thread_local ring* ring_;
+
+    unsigned frequency_{100};
+    duration drain_period_{std::chrono::milliseconds{200}};
+    std::map<std::vector<uintptr_t>, uint64_t> stacks_;
+    uint64_t samples_{0};
+    std::thread drainer_;
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;
+    bool stopping_{false};
+
+
+    static void arm(slot& s, unsigned hz) noexcept {
+      long const interval = hz == 0 ? 0 : 1000000000L / long(hz);
+      itimerspec spec{{interval / 1000000000L, interval % 1000000000L},
+                      {interval / 1000000000L, interval % 1000000000L}};
+      timer_settime(s.timer, 0, &spec, nullptr);
+    }
+
+
+    void run() {
+      std::unique_lock<std::mutex> lock{mutex_};
+      while(!wakeup_.wait_for(lock, drain_period_, [this] { return stopping_; })) {
+        lock.unlock();
+        drain();
+        lock.lock();
+      }
+    }
+
+
+    // The only consumer of rings
+
+    void drain() {
+      std::lock_guard<std::mutex> lock{mutex_};
+      std::vector<uintptr_t> key;
+      for(size_t i = 0; i != threads_capacity; ++i) {
+        ring* const r = slots_[i].samples;
+        if(r == nullptr)
+          continue;
+        uint32_t const head = r->head.load(std::memory_order_acquire);
+        uint32_t tail = r->tail.load(std::memory_order_relaxed);
+        for(; tail != head; ++tail) {
+          sample const& s = r->samples[tail & (ring_capacity - 1)];
+          key.assign(reinterpret_cast<uintptr_t const*>(s.frames),
+                     reinterpret_cast<uintptr_t const*>(s.frames) + s.count);
+          ++stacks_[key];
+          ++samples_;
+        }
+        r->tail.store(tail, std::memory_order_release);
+      }
+    }
+
+
+    static bool install() noexcept {
+      static bool installed = false;
+      if(installed)
+        return true;
+      struct sigaction action;
+      std::memset(&action, 0, sizeof(action));
+      action.sa_sigaction = &profiler::sample_dispatcher;
+      action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      installed = sigaction(SIGPROF, &action, &previous_) == 0;
+      return installed;
+    }
+
+
+    static void sample_dispatcher(int signal, siginfo_t* info, void* context) noexcept {
+      if(info == nullptr || info->si_code != SI_TIMER || info->si_value.sival_ptr != &slots_) {
+        signal_safe::chain(previous_, signal, info, context);
+        return;
+      }
+      ring* const r = ring_;
+      if(r == nullptr || context == nullptr)
+        return;
+      int const saved_errno = errno;
+      uint32_t const head = r->head.load(std::memory_order_relaxed);
+      if(head - r->tail.load(std::memory_order_acquire) == ring_capacity) {
+        r->dropped.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        sample& s = r->samples[head & (ring_capacity - 1)];
+        s.count = stack_trace::capture(*static_cast<ucontext_t*>(context), s.frames, depth);
+        r->head.store(head + 1, std::memory_order_release);
+      }
+      errno = saved_errno;
+    }
+
+  }; // profiler
+
+  inline profiler::slot profiler::slots_[profiler::threads_capacity];
+  inline std::mutex profiler::registry_;
+  inline std::atomic<profiler*> profiler::running_{nullptr};
+  inline struct sigaction profiler::previous_;
+  inline thread_local profiler::registration profiler::registration_;
+  inline thread_local profiler::ring* profiler::ring_{nullptr};
+
+
+} // airbag
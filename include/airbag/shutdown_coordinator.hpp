@@ -0,0 +1,282 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "stop_request.hpp"
+#include "stop_token.hpp"
+
+
+namespace airbag {
+
+
+  // Runs named shutdown phases in dependency order, independent ones in
+  // parallel. Missed deadline escalates: phase's token is stopped and
+  // handler is called, after grace period the process is terminated
+
+  class shutdown_coordinator {
+  public:
+
+    using clock_type = std::chrono::steady_clock;
+    using duration = clock_type::duration;
+    using action_type = std::function<void(stop_token const&)>;
+
+    enum class outcome { pending, completed, late, failed, abandoned };
+
+    struct timing {
+      std::string name;
+      duration started{};   // since run()
+      duration elapsed{};
+      outcome result{outcome::pending};
+    }; // timing
+
+    using escalation_type = std::function<void(timing const&)>;
+
+
+    shutdown_coordinator& phase(std::string name, duration deadline, action_type action,
+                                std::vector<std::string> after = {}) {
+      phases_.push_back({std::move(name), deadline, std::move(action), std::move(after)});
+      return *this;
+    }
+
+
+    // Called when phase misses its deadline (late) and before force exit (abandoned)
+
+    shutdown_coordinator& on_escalation(escalation_type handler) {
+      escalation_ = std::move(handler);
+      return *this;
+    }
+
+
+    shutdown_coordinator& force_exit(duration grace, int exit_code = 1) noexcept {
+      grace_ = grace;
+      exit_code_ = exit_code;
+      return *this;
+    }
+
+
+    // False if some phase was late or failed, or dependencies are unknown or cyclic
+
+    bool run() {
+      size_t const n = phases_.size();
+      std::vector<std::vector<size_t>> dependents(n);
+      std::vector<size_t> waiting(n, 0);
+      for(size_t i = 0; i != n; ++i)
+        for(auto const& name: phases_[i].after) {
+          size_t const j = find(name);
+          if(j == n)
+            return false;
+          dependents[j].push_back(i);
+          ++waiting[i];
+        }
+      if(cyclic(dependents, waiting))
+        return false;
+
+      timings_.assign(n, timing{});
+      for(size_t i = 0; i != n; ++i)
+        timings_[i].name = phases_[i].name;
+      std::vector<running> states(n);
+      auto const shared = std::make_shared<progress>(n);
+      clock_type::time_point const started = clock_type::now();
+      size_t finished = 0;
+
+      auto const launch = [&](size_t i) {
+        running& r = states[i];
+        r.started = clock_type::now();
+        timings_[i].started = r.started - started;
+        r.thread = std::thread([shared, i, token = r.stop.token(), action = phases_[i].action] {
+          bool succeeded = true;
+          try {
+            action(token);
+          } catch(...) {
+            succeeded = false;
+          }
+          std::lock_guard<std::mutex> lock{shared->mutex};
+          shared->done[i] = succeeded ? 1 : 2;
+          shared->changed.notify_one();
+        });
+      };
+      for(size_t i = 0; i != n; ++i)
+        if(waiting[i] == 0)
+          launch(i);
+
+      bool all_in_time = true;
+      std::unique_lock<std::mutex> lock{shared->mutex};
+      while(finished != n) {
+        clock_type::time_point wake = clock_type::time_point::max();
+        for(size_t i = 0; i != n; ++i) {
+          running const& r = states[i];
+          if(!r.thread.joinable() || r.joined)
+            continue;
+          auto const due = r.started + phases_[i].deadline + (r.escalated ? grace_ : duration::zero());
+          if(!r.escalated || grace_ != duration::zero())
+            wake = due < wake ? due : wake;
+        }
+        shared->changed.wait_until(lock, wake);
+        clock_type::time_point const now = clock_type::now();
+
+        for(size_t i = 0; i != n; ++i) {
+          running& r = states[i];
+          if(!r.thread.joinable() || r.joined)
+            continue;
+          if(shared->done[i] != 0) {
+            lock.unlock();
+            r.thread.join();
+            lock.lock();
+            r.joined = true;
+            ++finished;
+            timing& t = timings_[i];
+            t.elapsed = now - r.started;
+            t.result = shared->done[i] == 2 ? outcome::failed
+                     : r.escalated ? outcome::late : outcome::completed;
+            all_in_time = all_in_time && t.result == outcome::completed;
+            for(size_t d: dependents[i])
+              if(--waiting[d] == 0)
+                launch(d);
+            continue;
+          }
+          if(!r.escalated && now >= r.started + phases_[i].deadline) {
+            r.escalated = true;
+            r.stop.request_stop();
+            timing t = timings_[i];
+            t.elapsed = now - r.started;
+            t.result = outcome::late;
+            lock.unlock();
+            escalate(t);
+            lock.lock();
+          } else if(r.escalated && grace_ != duration::zero()
+                    && now >= r.started + phases_[i].deadline + grace_) {
+            timing& t = timings_[i];
+            t.elapsed = now - r.started;
+            t.result = outcome::abandoned;
+            lock.unlock();
+            escalate(t);
+            stop_request::processed();
+            std::_Exit(exit_code_);
+          }
+        }
+      }
+      return all_in_time;
+    }
+
+
+    // Blocks until stop request, then runs phases and lets the Windows
+    // console handler return
+
+    bool run_on_stop_request() {
+      stop_request::wait();
+      bool const succeeded = run();
+      stop_request::processed();
+      return succeeded;
+    }
+
+
+    std::vector<timing> const& timings() const noexcept { return timings_; }
+
+
+  private:
+
+    struct phase_type {
+      std::string name;
+      duration deadline;
+      action_type action;
+      std::vector<std::string> after;
+    }; // phase_type
+
+    struct running {
+      std::thread thread;
+      clock_type::time_point started;
+      stop_source stop;
+      bool escalated{false};
+      bool joined{false};
+    }; // running
+
+    // Shared with phase threads
+    struct progress {
+      explicit progress(size_t n): done(n, 0) { }
+      std::mutex mutex;
+      std::condition_variable changed;
+      std::vector<int> done; // 1 - completed, 2 - thrown
+    }; // progress
+
+    std::vector<phase_type> phases_;
+    std::vector<timing> timings_;
+    escalation_type escalation_;
+    duration grace_{std::chrono::seconds{5}};
+    int exit_code_{1};
+
+
+    size_t find(std::string const& name) const noexcept {
+      for(size_t i = 0; i != phases_.size(); ++i)
+        if(phases_[i].name == name)
+          return i;
+      return phases_.size();
+    }
+
+
+    static bool cyclic(std::vector<std::vector<size_t>> const& dependents,
+                       std::vector<size_t> waiting) {
+      std::vector<size_t> ready;
+      for(size_t i = 0; i != waiting.size(); ++i)
+        if(waiting[i] == 0)
+          ready.push_back(i);
+      size_t visited = 0;
+      while(!ready.empty()) {
+        size_t const i = ready.back();
+        ready.pop_back();
+        ++visited;
+        for(size_t d: dependents[i])
+          if(--waiting[d] == 0)
+            ready.push_back(d);
+      }
+      return visited != waiting.size();
+    }
+
+
+    void escalate(timing const& t) const {
+      if(escalation_) {
+        escalation_(t);
+        return;
+      }
+      auto const ms = std::chrono::duration_cast<std::chrono::milliseconds>(t.elapsed).count();
+      std::fprintf(stderr, t.result == outcome::late
+                   ? "Shutdown phase '%s' missed its deadline, running for %lld ms\n"
+                   : "Shutdown phase '%s' is abandoned after %lld ms, exiting\n",
+                   t.name.data(), static_cast<long long>(ms));
+    }
+
+  }; // shutdown_coordinator
+
+
+} // airbag
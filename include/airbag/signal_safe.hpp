@@ -0,0 +1,376 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+// Helpers usable from a signal handler: no heap, no stdio, no locks,
+// only async-signal-safe system calls
+
+
+namespace airbag::signal_safe {
+
+
+  // Passes signal to the action installed before ours. Default action is
+  // restored, so the fault happens again or the signal is raised again.
+  // Returns true if previous handler took the signal
+
+  inline bool chain(struct sigaction const& previous, int signal, siginfo_t* info, void* context) noexcept {
+    if((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction != nullptr) {
+      previous.sa_sigaction(signal, info, context);
+      return true;
+    }
+    if(previous.sa_handler == SIG_IGN && info->si_code <= 0)
+      return true;
+    if(previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+      previous.sa_handler(signal);
+      return true;
+    }
+    sigaction(signal, &previous, nullptr);
+    if(info->si_code <= 0) // sent by kill/raise, not by a faulting instruction
+      raise(signal);
+    return false;
+  }
+
+
+  // Installs action only over default or ignored one: signal another
+  // handler owns is not taken from it. Returns true if installed
+
+  inline bool claim(int signal, struct sigaction const& action) noexcept {
+    struct sigaction current;
+    if(sigaction(signal, nullptr, &current) != 0)
+      return false;
+    if(current.sa_handler != SIG_DFL && current.sa_handler != SIG_IGN)
+      return false;
+    return sigaction(signal, &action, nullptr) == 0;
+  }
+
+
+  inline size_t length(char const* s) noexcept {
+    size_t n = 0;
+    while(s[n] != '\0')
+      ++n;
+    return n;
+  }
+
+
+  inline void copy(char* to, size_t capacity, char const* from, size_t size) noexcept {
+    if(capacity == 0)
+      return;
+    if(size >= capacity)
+      size = capacity - 1;
+    memcpy(to, from, size);
+    to[size] = '\0';
+  }
+
+
+  inline char const* base_name(char const* path, size_t size) noexcept {
+    char const* name = path;
+    for(size_t i = 0; i != size; ++i)
+      if(path[i] == '/')
+        name = path + i + 1;
+    return name;
+  }
+
+
+  inline bool write_all(int fd, void const* data, size_t size) noexcept {
+    auto const* cursor = static_cast<char const*>(data);
+    while(size != 0) {
+      ssize_t const written = ::write(fd, cursor, size);
+      if(written < 0) {
+        if(errno == EINTR)
+          continue;
+        return false;
+      }
+      cursor += written;
+      size -= size_t(written);
+    }
+    return true;
+  }
+
+
+  inline size_t format_decimal(char* buffer, uint64_t value) noexcept {
+    char digits[20]; size_t n = 0;
+    do {
+      digits[n++] = char('0' + value % 10);
+      value /= 10;
+    } while(value != 0);
+    for(size_t i = 0; i != n; ++i)
+      buffer[i] = digits[n - i - 1];
+    return n;
+  }
+
+
+  inline size_t format_hex(char* buffer, uint64_t value) noexcept {
+    static constexpr char hex_digits[] = "0123456789abcdef";
+    char digits[16]; size_t n = 0;
+    do {
+      digits[n++] = hex_digits[value & 0xF];
+      value >>= 4;
+    } while(value != 0);
+    for(size_t i = 0; i != n; ++i)
+      buffer[i] = digits[n - i - 1];
+    return n;
+  }
+
+
+  inline bool parse_hex(char const*& cursor, char const* end, uint64_t& value) noexcept {
+    value = 0;
+    char const* const start = cursor;
+    for(; cursor != end; ++cursor) {
+      char const c = *cursor;
+      if(c >= '0' && c <= '9')
+        value = (value << 4) | uint64_t(c - '0');
+      else if(c >= 'a' && c <= 'f')
+        value = (value << 4) | uint64_t(c - 'a' + 10);
+      else if(c >= 'A' && c <= 'F')
+        value = (value << 4) | uint64_t(c - 'A' + 10);
+      else
+        break;
+    }
+    return cursor != start;
+  }
+
+
+  // Fixed size buffer flushed to a file descriptor
+
+  class writer {
+  public:
+
+    explicit writer(int fd) noexcept: fd_{fd} { }
+    writer(writer const&) = delete;
+    writer& operator = (writer const&) = delete;
+    ~writer() noexcept { flush(); }
+
+
+    writer& text(char const* s) noexcept {
+      return text(s, length(s));
+    }
+
+
+    writer& text(char const* s, size_t n) noexcept {
+      while(n != 0) {
+        if(size_ == sizeof(buffer_))
+          flush();
+        size_t const chunk = n < sizeof(buffer_) - size_ ? n : sizeof(buffer_) - size_;
+        memcpy(buffer_ + size_, s, chunk);
+        size_ += chunk; s += chunk; n -= chunk;
+      }
+      return *this;
+    }
+
+
+    writer& character(char c) noexcept {
+      return text(&c, 1);
+    }
+
+
+    writer& decimal(uint64_t value) noexcept {
+      char digits[20];
+      return text(digits, format_decimal(digits, value));
+    }
+
+
+    writer& hex(uint64_t value) noexcept {
+      char digits[18] = {'0', 'x'};
+      return text(digits, 2 + format_hex(digits + 2, value));
+    }
+
+
+    bool flush() noexcept {
+      bool const done = write_all(fd_, buffer_, size_);
+      size_ = 0;
+      return done;
+    }
+
+  private:
+
+    int fd_;
+    size_t size_{0};
+    char buffer_[512];
+  }; // writer
+
+
+  struct map_region {
+    uintptr_t begin{0};
+    uintptr_t end{0};
+    uint64_t offset{0};
+    uint64_t inode{0};
+    char permissions[5]{};
+    char const* path{nullptr};
+    size_t path_size{0};
+
+    bool readable() const noexcept { return permissions[0] == 'r'; }
+    bool writable() const noexcept { return permissions[1] == 'w'; }
+    bool executable() const noexcept { return permissions[2] == 'x'; }
+    bool is_private() const noexcept { return permissions[3] == 'p'; }
+  }; // map_region
+
+
+  // "begin-end perms offset device inode path", path is not terminated
+
+  inline bool parse_map_line(char const* cursor, char const* end, map_region& region) noexcept {
+    uint64_t begin, finish, offset;
+    if(!parse_hex(cursor, end, begin) || cursor == end || *cursor++ != '-')
+      return false;
+    if(!parse_hex(cursor, end, finish) || cursor == end || *cursor++ != ' ')
+      return false;
+    if(end - cursor < 5)
+      return false;
+    memcpy(region.permissions, cursor, 4);
+    region.permissions[4] = '\0';
+    cursor += 5;
+    if(!parse_hex(cursor, end, offset))
+      return false;
+    // device
+    while(cursor != end && *cursor == ' ') ++cursor;
+    while(cursor != end && *cursor != ' ') ++cursor;
+    while(cursor != end && *cursor == ' ') ++cursor;
+    uint64_t inode = 0;
+    for(; cursor != end && *cursor >= '0' && *cursor <= '9'; ++cursor)
+      inode = inode * 10 + uint64_t(*cursor - '0');
+    while(cursor != end && *cursor == ' ') ++cursor;
+    region.begin = uintptr_t(begin);
+    region.end = uintptr_t(finish);
+    region.offset = offset;
+    region.inode = inode;
+    region.path = cursor;
+    region.path_size = size_t(end - cursor);
+    return true;
+  }
+
+
+  // Line by line parser of /proc/<pid>/maps, the path is valid until next()
+
+  class maps_reader {
+  public:
+
+    explicit maps_reader(char const* path = "/proc/self/maps") noexcept:
+      fd_{::open(path, O_RDONLY | O_CLOEXEC)}
+    { }
+
+    maps_reader(maps_reader const&) = delete;
+    maps_reader& operator = (maps_reader const&) = delete;
+
+    ~maps_reader() noexcept {
+      if(fd_ != -1)
+        ::close(fd_);
+    }
+
+
+    bool is_open() const noexcept { return fd_ != -1; }
+
+
+    bool next(map_region& region) noexcept {
+      while(read_line()) {
+        if(parse(region))
+          return true;
+      }
+      return false;
+    }
+
+  private:
+
+    int fd_;
+    size_t begin_{0};
+    size_t end_{0};
+    size_t line_size_{0};
+    char buffer_[4096];
+    char line_[4096 + 256];
+
+
+    bool fill() noexcept {
+      for(;;) {
+        ssize_t const n = ::read(fd_, buffer_, sizeof(buffer_));
+        if(n < 0 && errno == EINTR)
+          continue;
+        if(n <= 0)
+          return false;
+        begin_ = 0; end_ = size_t(n);
+        return true;
+      }
+    }
+
+
+    bool read_line() noexcept {
+      if(fd_ == -1)
+        return false;
+      line_size_ = 0;
+      for(;;) {
+        if(begin_ == end_ && !fill())
+          return line_size_ != 0;
+        char const c = buffer_[begin_++];
+        if(c == '\n')
+          return true;
+        if(line_size_ != sizeof(line_) - 1)
+          line_[line_size_++] = c;
+      }
+    }
+
+
+    bool parse(map_region& region) noexcept {
+      line_[line_size_] = '\0';
+      return parse_map_line(line_, line_ + line_size_, region);
+    }
+
+  }; // maps_reader
+
+
+  // Name of the mapped file containing address, scanning /proc/self/maps
+
+  inline bool module_name(uintptr_t address, char* name, size_t capacity) noexcept {
+    maps_reader maps;
+    map_region region;
+    while(maps.next(region)) {
+      if(address < region.begin || address >= region.end)
+        continue;
+      if(region.path_size == 0)
+        return false;
+      char const* const base = base_name(region.path, region.path_size);
+      copy(name, capacity, base, region.path_size - size_t(base - region.path));
+      return true;
+    }
+    return false;
+  }
+
+
+} // airbag::signal_safe
@@ -0,0 +1,178 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+
+#if defined(__linux__)
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Per thread alternate stack, so stack overflow can be reported too.
+  // Stacks are cut from chunks mapped without reserve, every one has a guard
+  // page below it. Pages are committed when signal handler touches them and
+  // returned at thread exit, when the stack goes back to the pool
+
+  class signal_stack {
+  public:
+
+    static constexpr size_t size = 64 * 1024;
+    static constexpr size_t chunk_stacks = 64; // stacks mapped at once
+
+
+    static bool ensure() noexcept {
+      return current_.install();
+    }
+
+
+    // Stacks mapped so far and stacks used by threads now
+
+    static size_t mapped() noexcept { return mapped_.load(std::memory_order_relaxed); }
+    static size_t in_use() noexcept { return in_use_.load(std::memory_order_relaxed); }
+
+
+  private:
+
+    struct holder {
+
+      char* stack_{nullptr};
+
+
+      bool install() noexcept {
+        if(stack_ != nullptr)
+          return true;
+        stack_t installed;
+        if(sigaltstack(nullptr, &installed) == 0 && !(installed.ss_flags & SS_DISABLE)
+           && installed.ss_size >= size)
+          return true; // someone already did it
+        char* const taken = take();
+        if(taken == nullptr)
+          return false;
+        stack_t stack;
+        stack.ss_sp = taken;
+        stack.ss_size = size;
+        stack.ss_flags = 0;
+        if(sigaltstack(&stack, nullptr) != 0) {
+          give_back(taken);
+          return false;
+        }
+        stack_ = taken;
+        return true;
+      }
+
+
+      ~holder() noexcept {
+        if(stack_ == nullptr)
+          return;
+        stack_t disabled;
+        disabled.ss_sp = nullptr;
+        disabled.ss_size = 0;
+        disabled.ss_flags = SS_DISABLE;
+        if(sigaltstack(&disabled, nullptr) == 0)
+          give_back(stack_);
+      }
+
+    }; // holder
+
+
+    static std::mutex pool_;
+    static std::vector<char*>* free_; // never destroyed, threads may exit after main
+    static std::atomic<size_t> mapped_;
+    static std::atomic<size_t> in_use_;
+    static thread_local holder current_;
+
+
+    static char* take() noexcept {
+      std::lock_guard<std::mutex> lock{pool_};
+      if((free_ == nullptr || free_->empty()) && !map_chunk())
+        return nullptr;
+      char* const stack = free_->back();
+      free_->pop_back();
+      in_use_.fetch_add(1, std::memory_order_relaxed);
+      return stack;
+    }
+
+
+    // Committed pages are dropped, they are zero pages again on next touch
+
+    static void give_back(char* stack) noexcept {
+      madvise(stack, size, MADV_DONTNEED);
+      std::lock_guard<std::mutex> lock{pool_};
+      free_->push_back(stack); // capacity is reserved by map_chunk
+      in_use_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+
+    static bool map_chunk() noexcept {
+      size_t const page = size_t(sysconf(_SC_PAGESIZE));
+      size_t const stride = size + page;
+      try {
+        if(free_ == nullptr)
+          free_ = new std::vector<char*>;
+        free_->reserve(mapped_.load(std::memory_order_relaxed) + chunk_stacks);
+      } catch(std::bad_alloc const&) {
+        return false;
+      }
+      void* memory = mmap(nullptr, chunk_stacks * stride, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if(memory == MAP_FAILED)
+        return false;
+      char* const chunk = static_cast<char*>(memory);
+      for(size_t i = chunk_stacks; i != 0; --i) {
+        char* const guard = chunk + (i - 1) * stride;
+        mprotect(guard, page, PROT_NONE);
+        free_->push_back(guard + page);
+      }
+      mapped_.fetch_add(chunk_stacks, std::memory_order_relaxed);
+      return true;
+    }
+
+  }; // signal_stack
+
+  inline std::mutex signal_stack::pool_;
+  inline std::vector<char*>* signal_stack::free_{nullptr};
+  inline std::atomic<size_t> signal_stack::mapped_{0};
+  inline std::atomic<size_t> signal_stack::in_use_{0};
+  inline thread_local signal_stack::holder signal_stack::current_;
+
+
+} // airbag
@@ -0,0 +1,314 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+
+
+#if defined(_WIN32)
+
+#if !defined(_X86_) && !defined(_AMD64_) && !defined(_ARM_) && !defined(_ARM64_)
+#if defined(_M_IX86)
+#define _X86_
+#elif defined(_M_AMD64)
+#define _AMD64_
+#elif defined(_M_ARM)
+#define _ARM_
+#elif defined(_M_ARM64)
+#define _ARM64_
+#endif
+#endif
+
+#include <minwindef.h>
+#include <processthreadsapi.h>
+#include <errhandlingapi.h>
+
+#elif defined(__linux__)
+
+#include <pthread.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <unwind.h>
+#include <sys/uio.h>
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Raw return addresses captured at fault time without heap allocations,
+  // symbolization is done offline
+
+  class stack_trace {
+  public:
+
+    static constexpr size_t capacity = 64;
+
+
+#if defined(_WIN32)
+
+    static size_t capture(CONTEXT const& context, void** frames, size_t frames_capacity) noexcept {
+      if(frames_capacity == 0)
+        return 0;
+#if defined(_M_AMD64) || defined(_M_ARM64)
+      CONTEXT current = context;
+      size_t n = 0;
+      for(;;) {
+#if defined(_M_AMD64)
+        DWORD64 const pc = current.Rip;
+#else
+        DWORD64 const pc = current.Pc;
+#endif
+        if(pc == 0)
+          break;
+        frames[n++] = reinterpret_cast<void*>(pc);
+        if(n == frames_capacity)
+          break;
+        DWORD64 image_base;
+        auto* function = RtlLookupFunctionEntry(pc, &image_base, nullptr);
+        if(function == nullptr) {
+          // Leaf function, return address is on top of the stack
+#if defined(_M_AMD64)
+          current.Rip = *reinterpret_cast<DWORD64 const*>(current.Rsp);
+          current.Rsp += 8;
+#else
+          current.Pc = current.Lr;
+#endif
+          continue;
+        }
+        void* handler_data; DWORD64 establisher_frame;
+        RtlVirtualUnwind(UNW_FLAG_NHANDLER, image_base, pc, function, &current,
+                         &handler_data, &establisher_frame, nullptr);
+      }
+      return n;
+#else
+      ULONG_PTR low, high;
+      GetCurrentThreadStackLimits(&low, &high);
+      frames[0] = reinterpret_cast<void*>(context.Eip);
+      return 1 + walk_frames(context.Ebp, low, high, frames + 1, frames_capacity - 1);
+#endif
+    }
+
+#else
+
+    // Caches stack limits of calling thread, so the walker never reads outside them
+
+    static void register_thread() noexcept {
+      if(bounds_.high != 0)
+        return;
+      pthread_attr_t attributes;
+      if(pthread_getattr_np(pthread_self(), &attributes) != 0)
+        return;
+      void* address; size_t size;
+      if(pthread_attr_getstack(&attributes, &address, &size) == 0) {
+        bounds_.low = uintptr_t(address);
+        bounds_.high = uintptr_t(address) + size;
+      }
+      pthread_attr_destroy(&attributes);
+    }
+
+
+    // Stack limits cached by register_thread, false for unregistered thread
+
+    static bool thread_bounds(uintptr_t& low, uintptr_t& high) noexcept {
+      if(bounds_.high == 0)
+        return false;
+      low = bounds_.low;
+      high = bounds_.high;
+      return true;
+    }
+
+
+    // Enables .eh_frame based unwinder for frames built without frame pointers
+
+    static void use_unwinder(bool enabled) noexcept {
+      use_unwinder_.store(enabled, std::memory_order_relaxed);
+    }
+
+
+    static size_t capture(ucontext_t const& context, void** frames, size_t frames_capacity) noexcept {
+      if(frames_capacity == 0)
+        return 0;
+      uintptr_t pc, sp, fp;
+#if defined(__x86_64__)
+      pc = uintptr_t(context.uc_mcontext.gregs[REG_RIP]);
+      sp = uintptr_t(context.uc_mcontext.gregs[REG_RSP]);
+      fp = uintptr_t(context.uc_mcontext.gregs[REG_RBP]);
+#elif defined(__i386__)
+      pc = uintptr_t(context.uc_mcontext.gregs[REG_EIP]);
+      sp = uintptr_t(context.uc_mcontext.gregs[REG_ESP]);
+      fp = uintptr_t(context.uc_mcontext.gregs[REG_EBP]);
+#elif defined(__aarch64__)
+      pc = uintptr_t(context.uc_mcontext.pc);
+      sp = uintptr_t(context.uc_mcontext.sp);
+      fp = uintptr_t(context.uc_mcontext.regs[29]);
+#else
+      return 0;
+#endif
+      frames[0] = reinterpret_cast<void*>(pc);
+      size_t n = 1;
+      if(use_unwinder_.load(std::memory_order_relaxed))
+        n = unwind(pc, frames, frames_capacity);
+      if(n > 1)
+        return n;
+      return 1 + walk(fp, sp, frames + 1, frames_capacity - 1);
+    }
+
+
+    // Frames of the caller, useful outside of fault handlers
+
+    __attribute__((noinline))
+    static size_t capture(void** frames, size_t frames_capacity) noexcept {
+      auto const fp = uintptr_t(__builtin_frame_address(0));
+      return walk(fp, fp, frames, frames_capacity);
+    }
+
+#endif
+
+
+  private:
+
+    // Follows saved frame pointer chain, every read is checked against [low, high)
+
+    static size_t walk_frames(uintptr_t fp, uintptr_t low, uintptr_t high,
+                              void** frames, size_t frames_capacity) noexcept {
+      size_t n = 0;
+      while(n != frames_capacity) {
+        if(fp < low || fp > high - 2 * sizeof(uintptr_t) || fp % sizeof(uintptr_t) != 0)
+          break;
+        auto const* frame = reinterpret_cast<uintptr_t const*>(fp);
+        uintptr_t const next = frame[0];
+        uintptr_t const return_address = frame[1];
+        if(return_address == 0)
+          break;
+        frames[n++] = reinterpret_cast<void*>(return_address);
+        if(next <= fp) // stack grows down, callers are above
+          break;
+        fp = next;
+      }
+      return n;
+    }
+
+
+#if defined(__linux__)
+
+    struct bounds {
+      uintptr_t low{0};
+      uintptr_t high{0};
+    }; // bounds
+
+
+    static thread_local bounds bounds_;
+    static std::atomic_bool use_unwinder_;
+
+
+    static size_t walk(uintptr_t fp, uintptr_t sp, void** frames, size_t frames_capacity) noexcept {
+      if(bounds_.high != 0 && sp >= bounds_.low && sp < bounds_.high)
+        return walk_frames(fp, sp, bounds_.high, frames, frames_capacity);
+      // Unknown thread: stack above sp is probed page by page with
+      // process_vm_readv, unreadable page is reported as EFAULT, not as a fault
+      constexpr uintptr_t page_size = 4096;
+      constexpr uintptr_t max_stack_size = 8 * 1024 * 1024;
+      uintptr_t checked = sp & ~(page_size - 1);
+      size_t n = 0;
+      while(n != frames_capacity) {
+        if(fp < sp || fp - sp > max_stack_size)
+          break;
+        for(; checked < fp + 2 * sizeof(uintptr_t); checked += page_size)
+          if(!readable(checked))
+            return n;
+        if(walk_frames(fp, sp, checked, frames + n, 1) == 0)
+          break;
+        uintptr_t const next = reinterpret_cast<uintptr_t const*>(fp)[0];
+        ++n;
+        if(next <= fp)
+          break;
+        fp = next;
+      }
+      return n;
+    }
+
+
+    static bool readable(uintptr_t page) noexcept {
+      char probe;
+      iovec local{&probe, 1};
+      iovec remote{reinterpret_cast<void*>(page), 1};
+      return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == 1;
+    }
+
+
+    struct unwinding {
+      uintptr_t pc;
+      void** frames;
+      size_t capacity;
+      size_t size;
+      bool found;
+    }; // unwinding
+
+
+    // Skips frames of the handler itself until faulting instruction is reached
+
+    static size_t unwind(uintptr_t pc, void** frames, size_t frames_capacity) noexcept {
+      unwinding u{pc, frames, frames_capacity, 0, false};
+      _Unwind_Backtrace(&stack_trace::on_frame, &u);
+      return u.found ? u.size : 1;
+    }
+
+
+    static _Unwind_Reason_Code on_frame(_Unwind_Context* context, void* data) {
+      auto& u = *static_cast<unwinding*>(data);
+      int before_instruction = 0;
+      uintptr_t const ip = _Unwind_GetIPInfo(context, &before_instruction);
+      if(!u.found) {
+        if(ip != u.pc)
+          return _URC_NO_REASON;
+        u.found = true;
+      }
+      u.frames[u.size++] = reinterpret_cast<void*>(ip);
+      return u.size == u.capacity ? _URC_END_OF_STACK : _URC_NO_REASON;
+    }
+
+#endif
+
+  }; // stack_trace
+
+
+#if defined(__linux__)
+
+  inline thread_local stack_trace::bounds stack_trace::bounds_;
+  inline std::atomic_bool stack_trace::use_unwinder_;
+
+#endif
+
+
+} // airbag
@@ -24,6 +24,8 @@
 
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 
 #if defined(_WIN32)
 
@@ -43,6 +45,16 @@
 #include <consoleapi.h>
 #include <synchapi.h>
 
+#elif defined(__linux__)
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
 #else
 
 #error Unsupported system
@@ -56,6 +68,12 @@ namespace airbag {
   class stop_request {
   public:
 
+#if defined(_WIN32)
+    using native_handle_type = HANDLE;
+#else
+    using native_handle_type = int;
+#endif
+
 
     static void take_care() noexcept {
 #if _WIN32
@@ -64,48 +82,152 @@ namespace airbag {
 
 #else
 
-      signal(SIGINT, &stop_request::handler);
+      native_handle();
+      struct sigaction action{};
+      action.sa_handler = &stop_request::handler;
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGINT, &action, nullptr);
+      sigaction(SIGTERM, &action, nullptr);
 
 #endif // _WIN32
     }
 
 
     static bool signaled() noexcept {
-      return signaled_;
+      return signaled_.load(std::memory_order_relaxed) != 0;
     }
 
 
     static void signal() noexcept {
-      signaled_ = true;
+      signaled_.store(1, std::memory_order_release);
+      notify(signaled_, stop_event_);
     }
 
 
     static void processed() noexcept {
-      processed_ = true;
+      processed_.store(1, std::memory_order_release);
+      notify(processed_, processed_event_);
+    }
+
+
+    // Blocks until stop is requested
+
+    static void wait() noexcept {
+      while(!wait_flag(signaled_, stop_event_, -1))
+        ;
+    }
+
+
+    template<typename Rep, typename Period>
+    static bool wait_for(std::chrono::duration<Rep, Period> const& timeout) noexcept {
+      auto const deadline = std::chrono::steady_clock::now() + timeout;
+      for(;;) {
+        auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now()).count();
+        if(wait_flag(signaled_, stop_event_, left < 0 ? 0 : int64_t(left)))
+          return true;
+        if(left <= 0)
+          return false;
+      }
+    }
+
+
+    // Event to wait for in epoll/WaitForMultipleObjects, becomes readable
+    // (signaled) on stop request and stays so
+
+    static native_handle_type native_handle() noexcept {
+#if defined(_WIN32)
+      return stop_event_;
+#else
+      int fd = stop_event_.load(std::memory_order_acquire);
+      if(fd != -1)
+        return fd;
+      int const created = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if(created == -1)
+        return -1;
+      if(!stop_event_.compare_exchange_strong(fd, created, std::memory_order_acq_rel)) {
+        close(created);
+        return fd;
+      }
+      if(signaled())
+        notify_event(created);
+      return created;
+#endif
     }
 
 
   private:
 
-    static std::atomic_bool signaled_;
-    static std::atomic_bool processed_;
+    static std::atomic<uint32_t> signaled_;
+    static std::atomic<uint32_t> processed_;
 
 #if _WIN32
 
+    static HANDLE stop_event_;
+    static HANDLE processed_event_;
+
+
+    static void notify(std::atomic<uint32_t>&, HANDLE event) noexcept {
+      SetEvent(event);
+    }
+
+
+    static bool wait_flag(std::atomic<uint32_t>& flag, HANDLE event, int64_t timeout_ms) noexcept {
+      if(flag.load(std::memory_order_acquire) != 0)
+        return true;
+      DWORD const timeout = timeout_ms < 0 ? INFINITE
+        : timeout_ms >= INFINITE ? INFINITE - 1 : DWORD(timeout_ms);
+      WaitForSingleObject(event, timeout);
+      return flag.load(std::memory_order_acquire) != 0;
+    }
+
 
     static BOOL WINAPI handler(DWORD) {
-      signaled_ = true;
-      while(!processed_)
-        Sleep(100);
+      signal();
+      wait_flag(processed_, processed_event_, -1);
       return TRUE;
     }
 
 
 #else
 
+    static std::atomic<int> stop_event_; // eventfd, made on demand
+    static std::atomic<int> processed_event_; // nobody waits for it in a handler
+
+
+    static void notify_event(int fd) noexcept {
+      uint64_t const one = 1;
+      while(write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+    }
+
+
+    // Async-signal-safe: futex wake and eventfd write only
+
+    static void notify(std::atomic<uint32_t>& flag, std::atomic<int>& event) noexcept {
+      int const saved = errno;
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&flag), FUTEX_WAKE_PRIVATE, INT32_MAX,
+              nullptr, nullptr, 0);
+      int const fd = event.load(std::memory_order_acquire);
+      if(fd != -1)
+        notify_event(fd);
+      errno = saved;
+    }
+
+
+    static bool wait_flag(std::atomic<uint32_t>& flag, std::atomic<int>&, int64_t timeout_ms) noexcept {
+      if(flag.load(std::memory_order_acquire) != 0)
+        return true;
+      timespec timeout{time_t(timeout_ms / 1000), long(timeout_ms % 1000) * 1000000};
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&flag), FUTEX_WAIT_PRIVATE, 0,
+              timeout_ms < 0 ? nullptr : &timeout, nullptr, 0);
+      return flag.load(std::memory_order_acquire) != 0;
+    }
+
 
     static void handler(int) noexcept {
-      signaled_ = true;
+      signal();
     }
 
 
@@ -113,8 +235,15 @@ namespace airbag {
 
   }; // stop_request
 
-  inline std::atomic_bool stop_request::signaled_;
-  inline std::atomic_bool stop_request::processed_;
+  inline std::atomic<uint32_t> stop_request::signaled_;
+  inline std::atomic<uint32_t> stop_request::processed_;
+#if defined(_WIN32)
+  inline HANDLE stop_request::stop_event_ = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+  inline HANDLE stop_request::processed_event_ = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+#else
+  inline std::atomic<int> stop_request::stop_event_{-1};
+  inline std::atomic<int> stop_request::processed_event_{-1};
+#endif
 
 
 } // airbag
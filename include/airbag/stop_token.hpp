@@ -0,0 +1,366 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+
+namespace airbag {
+
+
+  class stop_token;
+  class stop_source;
+  template<typename F> class stop_callback;
+
+
+  namespace detail {
+
+
+    class stop_state;
+
+
+    // Node of registered callback, lives inside stop_callback
+
+    struct stop_callback_base {
+      using invoke_type = void (*)(stop_callback_base*) noexcept;
+
+      explicit stop_callback_base(invoke_type invoke) noexcept: invoke_{invoke} { }
+
+      invoke_type invoke_;
+      std::atomic<stop_callback_base*>* slot_{nullptr};
+      std::atomic<uint32_t>* used_{nullptr};
+      std::atomic_bool done_{false};
+      std::atomic<std::thread::id> invoker_{}; // read by destroying thread
+      bool* destroyed_{nullptr}; // only for the invoker itself
+    }; // stop_callback_base
+
+
+    // Stop flag on its own cache line, callbacks in lock-free table of slots
+    // grown by linked segments, child states are registered as callbacks
+
+    class stop_state {
+    public:
+
+      static constexpr size_t segment_size = 64;
+
+      explicit stop_state(stop_state* parent) noexcept;
+      stop_state(stop_state const&) = delete;
+      stop_state& operator = (stop_state const&) = delete;
+
+      bool stop_requested() const noexcept {
+        return stopped_.load(std::memory_order_relaxed) != 0;
+      }
+
+      void acquire() noexcept {
+        references_.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release() noexcept {
+        if(references_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          delete this;
+      }
+
+
+      bool request_stop() noexcept {
+        if(stopped_.exchange(1, std::memory_order_seq_cst) != 0)
+          return false;
+        for(segment* s = &first_; s != nullptr; s = s->next.load(std::memory_order_acquire)) {
+          if(s->used.load(std::memory_order_seq_cst) == 0)
+            continue;
+          for(auto& slot: s->slots) {
+            stop_callback_base* const callback = slot.exchange(nullptr, std::memory_order_seq_cst);
+            if(callback == nullptr)
+              continue;
+            s->used.fetch_sub(1, std::memory_order_relaxed);
+            bool destroyed = false;
+            callback->destroyed_ = &destroyed;
+            callback->invoker_.store(std::this_thread::get_id(), std::memory_order_relaxed);
+            callback->invoke_(callback);
+            if(!destroyed) {
+              callback->destroyed_ = nullptr;
+              callback->done_.store(true, std::memory_order_release);
+            }
+          }
+        }
+        return true;
+      }
+
+
+      // Returns false when stop was already requested and callback is not registered
+
+      bool attach(stop_callback_base& callback) {
+        if(stop_requested())
+          return false;
+        for(segment* s = &first_; ; ) {
+          if(s->used.load(std::memory_order_relaxed) < segment_size) {
+            for(auto& slot: s->slots) {
+              stop_callback_base* expected = nullptr;
+              if(slot.load(std::memory_order_relaxed) != nullptr
+                 || !slot.compare_exchange_strong(expected, &callback, std::memory_order_seq_cst))
+                continue;
+              s->used.fetch_add(1, std::memory_order_seq_cst);
+              callback.slot_ = &slot;
+              callback.used_ = &s->used;
+              // request_stop may have scanned this slot already
+              if(stopped_.load(std::memory_order_seq_cst) != 0 && take_back(callback))
+                return false;
+              return true;
+            }
+          }
+          segment* next = s->next.load(std::memory_order_acquire);
+          if(next == nullptr) {
+            auto* fresh = new segment;
+            if(s->next.compare_exchange_strong(next, fresh, std::memory_order_acq_rel))
+              next = fresh;
+            else
+              delete fresh;
+          }
+          s = next;
+        }
+      }
+
+
+      // Waits for callback being run by another thread
+
+      void detach(stop_callback_base& callback) noexcept {
+        if(callback.slot_ == nullptr || take_back(callback))
+          return;
+        // Other threads see no or another invoker and wait
+        if(callback.invoker_.load(std::memory_order_relaxed) == std::this_thread::get_id()
+           && callback.destroyed_ != nullptr) {
+          *callback.destroyed_ = true; // from inside of its own invocation
+          return;
+        }
+        while(!callback.done_.load(std::memory_order_acquire))
+          std::this_thread::yield();
+      }
+
+
+    private:
+
+      struct segment {
+        std::atomic<stop_callback_base*> slots[segment_size]{};
+        std::atomic<uint32_t> used{0};
+        std::atomic<segment*> next{nullptr};
+      }; // segment
+
+
+      struct child_link: stop_callback_base {
+        explicit child_link(stop_state* child) noexcept:
+          stop_callback_base{&child_link::invoke}, child{child} { }
+
+        stop_state* child;
+
+        static void invoke(stop_callback_base* self) noexcept {
+          static_cast<child_link*>(self)->child->request_stop();
+        }
+      }; // child_link
+
+
+      alignas(64) std::atomic<uint32_t> stopped_{0};
+      alignas(64) std::atomic<uint32_t> references_{1};
+      stop_state* parent_;
+      child_link link_;
+      segment first_;
+
+
+      ~stop_state() {
+        if(parent_ != nullptr) {
+          parent_->detach(link_);
+          parent_->release();
+        }
+        segment* s = first_.next.load(std::memory_order_acquire);
+        while(s != nullptr) {
+          segment* const next = s->next.load(std::memory_order_relaxed);
+          delete s;
+          s = next;
+        }
+      }
+
+
+      bool take_back(stop_callback_base& callback) noexcept {
+        stop_callback_base* expected = &callback;
+        if(!callback.slot_->compare_exchange_strong(expected, nullptr, std::memory_order_seq_cst))
+          return false;
+        callback.used_->fetch_sub(1, std::memory_order_relaxed);
+        callback.slot_ = nullptr;
+        return true;
+      }
+
+    }; // stop_state
+
+
+    inline stop_state::stop_state(stop_state* parent) noexcept: parent_{parent}, link_{this} {
+      if(parent_ == nullptr)
+        return;
+      parent_->acquire();
+      try {
+        if(!parent_->attach(link_))
+          stopped_.store(1, std::memory_order_relaxed);
+      } catch(std::bad_alloc const&) {
+        // Without link the state can only be stopped directly
+      }
+    }
+
+
+  } // detail
+
+
+  class stop_token {
+  public:
+
+    stop_token() noexcept = default;
+
+    stop_token(stop_token const& other) noexcept: state_{other.state_} {
+      if(state_ != nullptr)
+        state_->acquire();
+    }
+
+    stop_token(stop_token&& other) noexcept: state_{other.state_} {
+      other.state_ = nullptr;
+    }
+
+    stop_token& operator = (stop_token other) noexcept {
+      std::swap(state_, other.state_);
+      return *this;
+    }
+
+    ~stop_token() {
+      if(state_ != nullptr)
+        state_->release();
+    }
+
+
+    // Single relaxed load of the flag on its own cache line
+
+    bool stop_requested() const noexcept {
+      return state_ != nullptr && state_->stop_requested();
+    }
+
+    bool stop_possible() const noexcept { return state_ != nullptr; }
+
+
+  private:
+
+    friend class stop_source;
+    template<typename F> friend class stop_callback;
+
+    detail::stop_state* state_{nullptr};
+
+    explicit stop_token(detail::stop_state* state) noexcept: state_{state} {
+      state_->acquire();
+    }
+
+  }; // stop_token
+
+
+  // Root of the tree or child of another token: stops when the parent does
+
+  class stop_source {
+  public:
+
+    stop_source(): state_{new detail::stop_state{nullptr}} { }
+
+    explicit stop_source(stop_token const& parent):
+      state_{new detail::stop_state{parent.state_}} { }
+
+    stop_source(stop_source const& other) noexcept: state_{other.state_} {
+      state_->acquire();
+    }
+
+    stop_source& operator = (stop_source const& other) noexcept {
+      other.state_->acquire();
+      state_->release();
+      state_ = other.state_;
+      return *this;
+    }
+
+    ~stop_source() {
+      state_->release();
+    }
+
+
+    stop_token token() const noexcept { return stop_token{state_}; }
+    bool stop_requested() const noexcept { return state_->stop_requested(); }
+
+
+    // Runs callbacks of this source and its descendants in the calling thread,
+    // false if stop was requested already
+
+    bool request_stop() noexcept { return state_->request_stop(); }
+
+
+  private:
+
+    detail::stop_state* state_;
+
+  }; // stop_source
+
+
+  // Callback is invoked once on stop request, immediately if it's requested
+  // already. Destructor waits for callback running in another thread
+
+  template<typename F> class stop_callback: private detail::stop_callback_base {
+  public:
+
+    template<typename C>
+    stop_callback(stop_token const& token, C&& callback):
+      stop_callback_base{&stop_callback::invoke}, token_{token},
+      callback_{std::forward<C>(callback)} {
+      if(token_.state_ != nullptr && !token_.state_->attach(*this))
+        callback_();
+    }
+
+    stop_callback(stop_callback const&) = delete;
+    stop_callback& operator = (stop_callback const&) = delete;
+
+    ~stop_callback() {
+      if(token_.state_ != nullptr)
+        token_.state_->detach(*this);
+    }
+
+
+  private:
+
+    stop_token token_;
+    F callback_;
+
+    static void invoke(stop_callback_base* self) noexcept {
+      static_cast<stop_callback*>(self)->callback_();
+    }
+
+  }; // stop_callback
+
+
+  template<typename F> stop_callback(stop_token const&, F) -> stop_callback<F>;
+
+
+} // airbag
@@ -22,6 +22,9 @@
 
 #pragma once
 
+#include <atomic>
+#include <type_traits>
+
 #if defined(_WIN32)
 
 #if !defined(_X86_) && !defined(_AMD64_) && !defined(_ARM_) && !defined(_ARM64_)
@@ -43,6 +46,18 @@
 #include <processthreadsapi.h>
 #include <libloaderapi.h>
 #include <psapi.h>
+#include "module_map.hpp"
+#include "stack_trace.hpp"
+
+#elif defined(__linux__)
+
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include "signal_safe.hpp"
+#include "module_map.hpp"
+#include "stack_trace.hpp"
 
 #else
 
@@ -57,8 +72,14 @@ namespace airbag {
 
   struct system_failure {
 
+#if defined(_WIN32)
     using code_type =  DWORD;
     using info_type = _EXCEPTION_POINTERS;
+#else
+    using code_type = int;
+    using info_type = siginfo_t;
+    using context_type = ucontext_t;
+#endif
 
     static constexpr auto module_name_capacity = 63;
 
@@ -72,45 +93,91 @@ namespace airbag {
 
     code_type code() const noexcept { return code_; }
     info_type* info() const noexcept { return info_; }
+    void* address() const noexcept { return address_; }
     char const* module_name() const noexcept { return module_name_; }
+    void* const* frames() const noexcept { return frames_; }
+    size_t frames_count() const noexcept { return frames_count_; }
 
 
     explicit system_failure(code_type code) noexcept:
-      code_{code}
-    { }
+      code_{code} {
+      module_name_[0] = '\0';
+    }
+
+
+#if defined(_WIN32)
 
+    // Thread is the faulting one, or the one context was taken from
 
-    explicit system_failure(_EXCEPTION_POINTERS *info) noexcept:
-      code_{info->ExceptionRecord->ExceptionCode}, info_{info} {
+    explicit system_failure(_EXCEPTION_POINTERS *info, DWORD thread_id = GetCurrentThreadId()) noexcept:
+      code_{info->ExceptionRecord->ExceptionCode}, info_{info},
+      address_{info->ExceptionRecord->ExceptionAddress}, thread_id_{thread_id} {
 
       module_name_[0] = '\0';
+      frames_count_ = stack_trace::capture(*info->ContextRecord, frames_, stack_trace::capacity);
+
+      uintptr_t const exception_address = uintptr_t(info->ExceptionRecord->ExceptionAddress);
+      bool const found = module_map::find(exception_address, [this](module_map::module const& m) {
+        assign_module_name(m.path);
+      });
+      if(found)
+        return;
+
+      // Not in the map yet (loaded after last refresh)
+      HMODULE module;
+      auto constexpr from_address = GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
+                                  | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT;
+      if(!GetModuleHandleExA(from_address, LPCSTR(exception_address), &module))
+        return;
+      char module_name[MAX_PATH];
+      GetModuleFileNameA(module, module_name, MAX_PATH);
+      assign_module_name(module_name);
+    }
 
-      auto const process = GetCurrentProcess();
-      size_t const exception_address = size_t(info->ExceptionRecord->ExceptionAddress);
-
-      HMODULE modules[512]; DWORD modules_count;
-      if(!K32EnumProcessModules(process, modules, sizeof(modules), &modules_count))
-         return;
-      modules_count /= sizeof(HMODULE);
-      for(DWORD i = 0; i != modules_count; ++i) {
-        MODULEINFO module_info;
-        if(!K32GetModuleInformation(process, modules[i], &module_info, sizeof(MODULEINFO)))
-          continue;
-        size_t const module_address = size_t(module_info.lpBaseOfDll);
-        if(module_address > exception_address || exception_address > module_address + module_info.SizeOfImage)
-          continue;
-        char module_name[MAX_PATH];
-        GetModuleFileNameA(modules[i], module_name, MAX_PATH);
-        char const* last_back_slash = std::strrchr(module_name, '\\');
-        if(last_back_slash == nullptr)
-          strncpy_s(module_name_, module_name_capacity + 1, module_name, module_name_capacity);
-        else
-          strncpy_s(module_name_, module_name_capacity + 1, last_back_slash + 1, module_name_capacity);
-        break;
-      }
+#else
+
+    system_failure(siginfo_t* info, void* context) noexcept:
+      code_{info->si_signo}, subcode_{info->si_code}, info_{info},
+      context_{static_cast<ucontext_t*>(context)} {
+
+      module_name_[0] = '\0';
+      if(context_ == nullptr)
+        return;
+      address_ = program_counter(*context_);
+      frames_count_ = stack_trace::capture(*context_, frames_, stack_trace::capacity);
+      bool const found = module_map::find(uintptr_t(address_), [this](module_map::module const& m) {
+        char const* const name = signal_safe::base_name(m.path, signal_safe::length(m.path));
+        signal_safe::copy(module_name_, module_name_capacity + 1, name, signal_safe::length(name));
+      });
+      if(!found) // not in the map yet (loaded after last refresh)
+        signal_safe::module_name(uintptr_t(address_), module_name_, module_name_capacity + 1);
     }
 
 
+    int subcode() const noexcept { return subcode_; }
+    context_type* context() const noexcept { return context_; }
+
+
+    static void* program_counter(ucontext_t const& context) noexcept {
+#if defined(__x86_64__)
+      return reinterpret_cast<void*>(context.uc_mcontext.gregs[REG_RIP]);
+#elif defined(__i386__)
+      return reinterpret_cast<void*>(context.uc_mcontext.gregs[REG_EIP]);
+#elif defined(__aarch64__)
+      return reinterpret_cast<void*>(context.uc_mcontext.pc);
+#else
+      return nullptr;
+#endif
+    }
+
+#endif
+
+
+#if defined(_WIN32)
+
+    DWORD thread_id() const noexcept { return thread_id_; }
+
+
     char const* title() const noexcept {
       switch(code_) {
         case 0:
@@ -161,18 +228,121 @@ namespace airbag {
           return "Guard page violation";
         case STATUS_INVALID_HANDLE:
           return "Invalid handle";
+        case STATUS_POSSIBLE_DEADLOCK:
+          return "Possible deadlock";
         default:
           return "Unknwon";
       }
     }
 
+#else
+
+    char const* title() const noexcept {
+      switch(code_) {
+        case 0:
+          return "None";
+        case SIGSEGV:
+          return "Access violation";
+        case SIGBUS:
+          switch(subcode_) {
+            case BUS_ADRALN:
+              return "Datatype misalignment";
+            case BUS_ADRERR:
+            case BUS_OBJERR:
+              return "In page error";
+            default:
+              return "Bus error";
+          }
+        case SIGFPE:
+          switch(subcode_) {
+            case FPE_INTDIV:
+              return "Integer divide by zero";
+            case FPE_INTOVF:
+              return "Integer overflow";
+            case FPE_FLTDIV:
+              return "Float divide by zero";
+            case FPE_FLTOVF:
+              return "Float overflow";
+            case FPE_FLTUND:
+              return "Float underflow";
+            case FPE_FLTRES:
+              return "Float inexact result";
+            case FPE_FLTINV:
+              return "Float invalid operation";
+            case FPE_FLTSUB:
+              return "Array bounds exceeded";
+            default:
+              return "Floating point exception";
+          }
+        case SIGILL:
+          switch(subcode_) {
+            case ILL_PRVOPC:
+            case ILL_PRVREG:
+              return "Privileged instruction";
+            default:
+              return "Illegal instruction";
+          }
+        case SIGTRAP:
+          return "Breakpoint";
+        case SIGABRT:
+          return "Abort";
+        default:
+          return "Unknown";
+      }
+    }
+
+#endif
+
   private:
 
+#if defined(_WIN32)
+
+    void assign_module_name(char const* path) noexcept {
+      char const* last_back_slash = std::strrchr(path, '\\');
+      if(last_back_slash == nullptr)
+        strncpy_s(module_name_, module_name_capacity + 1, path, module_name_capacity);
+      else
+        strncpy_s(module_name_, module_name_capacity + 1, last_back_slash + 1, module_name_capacity);
+    }
+
+#endif
+
     code_type code_{0};
+#if !defined(_WIN32)
+    int subcode_{0};
+#endif
     info_type* info_{nullptr};
+#if !defined(_WIN32)
+    context_type* context_{nullptr};
+#endif
+    void* address_{nullptr};
+#if defined(_WIN32)
+    DWORD thread_id_{0};
+#endif
     char module_name_[module_name_capacity + 1];
+    size_t frames_count_{0};
+    void* frames_[stack_trace::capacity];
 
   }; // system_failure
 
 
+  // Copied into exceptions and across signal handlers without allocations
+  static_assert(std::is_trivially_copyable_v<system_failure>);
+
+  // Links process_error and thread_error without including each other.
+  // Handler is set by process_error on Linux to run its hooks for a fault
+  // about to be translated, as first chance vectored handler on Windows sees
+  // every fault before it is translated. Recovery is the innermost guarded()
+  // point of the thread, set by thread_error: such faults are recovered
+  // without hooks
+
+  struct first_chance {
+#if !defined(_WIN32)
+    using handler_type = void (*)(system_failure const&) noexcept;
+    static inline std::atomic<handler_type> handler{nullptr};
+#endif
+    static inline thread_local void** recovery{nullptr};
+  }; // first_chance
+
+
 } // airbag
@@ -24,9 +24,10 @@
 
 
 #include <string>
-#include <stdexcept>
+#include <exception>
 #include <functional>
 #include <typeinfo>
+#include <cstdlib>
 
 #include "system_failure.hpp"
 
@@ -49,6 +50,16 @@
 #include <crtdbg.h>
 #include <consoleapi.h>
 
+#elif defined(__linux__)
+
+#include <atomic>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <ucontext.h>
+#include "signal_stack.hpp"
+#include "thread_table.hpp"
+
 #else
 
 #error Unsupported system
@@ -60,29 +71,58 @@
 namespace airbag {
 
 
-  class thread_error : public std::runtime_error  {
+  // Message is kept inline, so neither constructing nor copying allocates
+
+  class thread_error : public std::exception  {
   public:
 
-    using base = std::runtime_error;
+    using base = std::exception;
     using terminate_handler = std::function<void(char const*)>;
 
-    thread_error() noexcept: base{""} {
+    static constexpr size_t message_capacity = 255;
+
+    thread_error() noexcept {
+      message_[0] = '\0';
+#if defined(_WIN32)
       _CrtSetReportMode(_CRT_ASSERT, _CRTDBG_MODE_FILE);
       _CrtSetReportFile(_CRT_ASSERT, 0);
       _set_invalid_parameter_handler(&thread_error::invalid_parameter_dispatcher);
       _set_se_translator(&thread_error::system_failure_dispatcher);
-      set_terminate(&thread_error::terminate_dispatcher);
+#else
+      stack_trace::register_thread();
+      signal_stack::ensure();
+      thread_table::register_thread();
+      translation_.enabled = true;
+      install_signals();
+      reserve();
+#endif
+      module_map::refresh();
+      std::set_terminate(&thread_error::terminate_dispatcher);
     }
 
 
     thread_error(std::string const& message, system_failure const& f) noexcept:
-      base{message}, failure_{f}
-    { }
+      failure_{f} {
+      assign(message.data(), message.size());
+    }
 
 
     thread_error(char const* message, system_failure const& f) noexcept:
-      base{message}, failure_{f}
-    { }
+      failure_{f} {
+      assign(message, message != nullptr ? std::char_traits<char>::length(message) : 0);
+    }
+
+#if defined(__linux__)
+    ~thread_error() override {
+      if(pool_ != nullptr && pool_ == current_pool_) // pooled object released, away from fault
+        reserve();
+    }
+#endif
+
+
+    char const* what() const noexcept override {
+      return message_;
+    }
 
 
     system_failure const& failure() const noexcept {
@@ -93,50 +133,321 @@ namespace airbag {
       terminate_handler_ = std::move(h);
     }
 
+
+    // Calls function with a recovery point, returns failure of the thread
+    // if it faulted or nullptr otherwise (see guarded.hpp)
+
+#if defined(_WIN32)
+
+    static system_failure const* call_guarded(void (*function)(void*), void* argument) {
+      void* marker = nullptr; // vectored handler of process_error skips the fault
+      void** const previous = first_chance::recovery;
+      first_chance::recovery = &marker;
+      __try {
+        __try {
+          function(argument);
+        } __finally {
+          first_chance::recovery = previous;
+        }
+        return nullptr;
+      } __except(guarded_filter(GetExceptionInformation())) {
+        return &guarded_failure_;
+      }
+    }
+
+#else
+
+    static system_failure const* call_guarded(void (*function)(void*), void* argument) {
+      if(!armed_) {
+        signal_stack::ensure();
+        install_signals();
+        armed_ = true;
+      }
+      // __builtin_setjmp saves only frame, stack and resume address, unlike sigsetjmp
+      void* recovery[5];
+      void** const previous = first_chance::recovery;
+      first_chance::recovery = recovery;
+      if(__builtin_setjmp(recovery) != 0) {
+        first_chance::recovery = previous;
+        return &translation_.failure;
+      }
+      try {
+        function(argument);
+      } catch(...) {
+        first_chance::recovery = previous;
+        throw;
+      }
+      first_chance::recovery = previous;
+      return nullptr;
+    }
+
+#endif
+
   private:
 
     static inline thread_local terminate_handler terminate_handler_;
 
+    char message_[message_capacity + 1];
     system_failure failure_;
+#if defined(__linux__)
+    struct reserve_pool;
+    reserve_pool* pool_{nullptr};
+#endif
 
 
-    static void append(std::string& s, wchar_t const* cc) {
-      if(cc == nullptr)
-        return;
-      while(*cc)
-        s.push_back(char(*cc++));
+    void assign(char const* message, size_t size) noexcept {
+      if(size > message_capacity)
+        size = message_capacity;
+      for(size_t i = 0; i != size; ++i)
+        message_[i] = message[i];
+      message_[size] = '\0';
     }
 
 
+    // Appends to fixed buffer, truncating
+
+    struct message_builder {
+      char* cursor;
+      char* end;
+
+      message_builder(char* buffer, size_t capacity) noexcept:
+        cursor{buffer}, end{buffer + capacity} {
+        *cursor = '\0';
+      }
+
+      template<typename C> message_builder& operator << (C const* cc) noexcept {
+        if(cc == nullptr)
+          return *this;
+        while(*cc && cursor != end)
+          *cursor++ = char(*cc++);
+        *cursor = '\0';
+        return *this;
+      }
+    };
+
+
+#if defined(_WIN32)
+
     static void invalid_parameter_dispatcher(wchar_t const* expression, wchar_t const* function,
                                           wchar_t const*, unsigned, uintptr_t) {
-      std::string message; message.reserve(512);
-      message = "Invalid parameter for '";
-      append(message, function);
-      message += '\''; message += ','; message += ' ';
-      append(message, expression);
+      char message[message_capacity + 1];
+      message_builder{message, message_capacity}
+        << "Invalid parameter for '" << function << "', " << expression;
       throw thread_error{message, system_failure{STATUS_INVALID_PARAMETER}};
     }
 
 
+    static inline thread_local system_failure guarded_failure_;
+
+
+    static int guarded_filter(EXCEPTION_POINTERS* info) noexcept {
+      constexpr DWORD microsoft_cxx_exception = 0xE06D7363;
+      if(info->ExceptionRecord->ExceptionCode == microsoft_cxx_exception)
+        return EXCEPTION_CONTINUE_SEARCH;
+      guarded_failure_ = system_failure{info};
+      return EXCEPTION_EXECUTE_HANDLER;
+    }
+
+
     static void system_failure_dispatcher(unsigned, EXCEPTION_POINTERS* info)
     {
       system_failure const failure{info};
       throw thread_error{failure.title(), failure};
     }
 
+#else
+
+    // Faults of threads constructing thread_error are translated to thread_error
+    // thrown at faulting instruction. Code that may fault should be built
+    // with -fnon-call-exceptions (see AIRBAG_NON_CALL_EXCEPTIONS), otherwise
+    // there is no landing pad for it and std::terminate is called
+
+    static constexpr int fault_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL};
+    static constexpr int fault_signals_count = int(sizeof(fault_signals) / sizeof(fault_signals[0]));
+    static constexpr uintptr_t headroom = 16 * 1024; // stack left for throwing
+
+    struct translation {
+      bool enabled{false};
+      bool pending{false}; // fault while throwing is not translated again
+      siginfo_t info;
+      ucontext_t context;
+      system_failure failure;
+    };
+
+    static thread_local translation translation_;
+    static inline thread_local bool armed_{false};
+    static inline std::atomic_bool signals_installed_;
+    static inline struct sigaction previous_actions_[fault_signals_count];
+
+
+    static void install_signals() noexcept {
+      if(signals_installed_.exchange(true))
+        return;
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_sigaction = &thread_error::system_failure_dispatcher;
+      action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+      sigemptyset(&action.sa_mask);
+      for(int i = 0; i != fault_signals_count; ++i)
+        sigaction(fault_signals[i], &action, &previous_actions_[i]);
+    }
+
+
+    static void system_failure_dispatcher(int signal, siginfo_t* info, void* context) noexcept {
+      int const saved_errno = errno;
+      translation& t = translation_;
+      if(first_chance::recovery != nullptr && info->si_code > 0 && context != nullptr) {
+        save(t, info, static_cast<ucontext_t*>(context));
+        // longjmp skips sigreturn, so unblock the signal ourselves
+        pthread_sigmask(SIG_SETMASK, &static_cast<ucontext_t*>(context)->uc_sigmask, nullptr);
+        __builtin_longjmp(first_chance::recovery, 1);
+      }
+      if(t.enabled && !t.pending && info->si_code > 0 && context != nullptr
+         && redirect(*static_cast<ucontext_t*>(context), true)) {
+        t.pending = true; // fault inside process_error hooks is not translated
+        if(auto const hooks = first_chance::handler.load())
+          hooks(system_failure{info, context});
+        save(t, info, static_cast<ucontext_t*>(context));
+        redirect(*static_cast<ucontext_t*>(context), false);
+        errno = saved_errno;
+        return;
+      }
+      chain(signal, info, context);
+      errno = saved_errno;
+    }
+
+
+    static void save(translation& t, siginfo_t* info, ucontext_t* context) noexcept {
+      t.info = *info;
+      t.context = *context;
+#if defined(__x86_64__)
+      if(t.context.uc_mcontext.fpregs != nullptr) {
+        memcpy(&t.context.__fpregs_mem, t.context.uc_mcontext.fpregs, sizeof(t.context.__fpregs_mem));
+        t.context.uc_mcontext.fpregs = &t.context.__fpregs_mem;
+      }
+#endif
+      t.failure = system_failure{&t.info, &t.context};
+    }
+
+
+    static void chain(int signal, siginfo_t* info, void* context) noexcept {
+      for(int i = 0; i != fault_signals_count; ++i)
+        if(fault_signals[i] == signal)
+          signal_safe::chain(previous_actions_[i], signal, info, context);
+    }
+
+
+    // Makes the fault look like a call of throw_thunk from faulting instruction
+
+    static bool redirect(ucontext_t& context, bool check_only) noexcept {
+      uintptr_t low, high;
+      if(!stack_trace::thread_bounds(low, high))
+        return false;
+#if defined(__x86_64__)
+      greg_t* const regs = context.uc_mcontext.gregs;
+      uintptr_t const sp = uintptr_t(regs[REG_RSP]);
+      if(sp < low + headroom || sp > high)
+        return false; // stack overflow or foreign stack
+      if(check_only)
+        return true;
+      uintptr_t const return_address = uintptr_t(regs[REG_RIP]) + 1; // unwinder looks up ra - 1
+      *reinterpret_cast<uintptr_t*>(sp - sizeof(uintptr_t)) = return_address;
+      regs[REG_RSP] = greg_t(sp - sizeof(uintptr_t));
+      regs[REG_RIP] = greg_t(&thread_error::throw_thunk);
+      return true;
+#else
+      // aarch64 would need LR of faulting leaf function kept for unwinder
+      // (thunk with own CFI), faking a call by LR loses it: not translated
+      (void)context; (void)check_only; (void)low; (void)high;
+      return false;
+#endif
+    }
+
+
+#if defined(__x86_64__)
+    __attribute__((force_align_arg_pointer))
+#endif
+    [[noreturn]] static void throw_thunk() {
+      translation& t = translation_;
+      t.pending = false;
+      throw_reserved(t.failure.title(), t.failure);
+    }
+
+
+    // Exception objects allocated in advance: translating a fault rethrows
+    // one of them, so C++ runtime allocates only a small dependent exception
+    // header, served by its emergency pool when heap is exhausted. Each object
+    // is thrown once, so exception_ptr kept from a fault never changes. Pool
+    // is refilled when a pooled object is released, not at the fault
+
+    static constexpr size_t reserve_capacity = 4;
+
+    struct reserve_pool {
+      struct slot {
+        std::exception_ptr pointer;
+        thread_error* object{nullptr};
+      };
+
+      slot slots[reserve_capacity];
+      bool closing{false};
+
+      ~reserve_pool() { closing = true; } // thread exits, objects released are not replaced
+    }; // reserve_pool
+
+    static thread_local reserve_pool reserve_;
+    static inline thread_local reserve_pool* current_pool_{nullptr};
+
+
+    static void reserve() noexcept {
+      reserve_pool& pool = reserve_;
+      if(pool.closing)
+        return;
+      current_pool_ = &pool;
+      for(auto& slot: pool.slots) {
+        if(slot.object != nullptr)
+          continue;
+        try {
+          slot.pointer = std::make_exception_ptr(thread_error{"", system_failure{}});
+          std::rethrow_exception(slot.pointer);
+        } catch(thread_error& e) {
+          e.pool_ = &pool;
+          slot.object = &e;
+        } catch(...) {
+          slot.pointer = nullptr;
+          return;
+        }
+      }
+    }
+
+
+    // Heap is not touched: fault may come from inside malloc. Exception is
+    // allocated as usual only when the pool is used up by nested faults
+
+    [[noreturn]] static void throw_reserved(char const* message, system_failure const& f) {
+      reserve_pool& pool = reserve_;
+      for(auto& slot: pool.slots) {
+        if(slot.object == nullptr)
+          continue;
+        *slot.object = thread_error{message, f};
+        slot.object->pool_ = &pool;
+        slot.object = nullptr;
+        std::exception_ptr const pointer = std::move(slot.pointer);
+        std::rethrow_exception(pointer);
+      }
+      throw thread_error{message, f};
+    }
+
+#endif
+
 
     static void terminate_dispatcher() {
       try {
           throw;
       } catch(std::exception const& e) {
-        std::string message;
-        message = "Uncaught ";
-        message += typeid(e).name();
-        message += ' '; message += '(';
-        message.append(e.what());
-        message += ')';
-        terminate_handler_(message.data());
+        char message[message_capacity + 1];
+        message_builder{message, message_capacity}
+          << "Uncaught " << typeid(e).name() << " (" << e.what() << ")";
+        terminate_handler_(message);
       } catch(...) {
         terminate_handler_("Uncaught exception");
       }
@@ -145,5 +456,10 @@ namespace airbag {
 
   }; // thread_error
 
+#if defined(__linux__)
+  inline thread_local thread_error::translation thread_error::translation_;
+  inline thread_local thread_error::reserve_pool thread_error::reserve_;
+#endif
+
 
 } // airbag
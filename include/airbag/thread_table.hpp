@@ -0,0 +1,331 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include "signal_safe.hpp"
+#include "stack_trace.hpp"
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Threads registered by thread_error. At crash time each of them is asked by
+  // tgkill to deposit its registers and top of its stack into a preallocated
+  // slot and to wait there until release(), so minidump has all threads
+
+  class thread_table {
+  public:
+
+    static constexpr size_t capacity = 256;
+    static constexpr size_t name_capacity = 16;
+    static constexpr size_t stack_capacity = 64 * 1024; // copied from stack pointer up
+
+    struct thread {
+      pid_t tid;
+      char name[name_capacity];
+      uintptr_t stack_low;
+      uintptr_t stack_high;
+      ucontext_t context;
+      bool has_float_state;
+      uint8_t float_state[512]; // fxsave area
+      uintptr_t stack_start;
+      size_t stack_size;
+      uint8_t const* stack; // copy of [stack_start, stack_start + stack_size)
+    };
+
+
+    // SIGRTMAX-3 by default. Set before the first thread registers, handler
+    // is not installed over one the application has for the signal
+
+    static int signal_number() noexcept {
+      int const signal = signal_.load();
+      return signal != 0 ? signal : SIGRTMAX - 3;
+    }
+    static bool signal_number(int signal) noexcept {
+      if(prepared_.load())
+        return false;
+      signal_.store(signal);
+      return true;
+    }
+
+
+    // Idempotent, fails if table is full
+
+    static bool register_thread() noexcept {
+      if(registration_.index != none)
+        return true;
+      if(!prepare())
+        return false;
+      for(size_t i = 0; i != capacity; ++i) {
+        int expected = vacant;
+        if(!slots_[i].state.compare_exchange_strong(expected, claimed))
+          continue;
+        thread& t = slots_[i].data;
+        t.tid = pid_t(syscall(SYS_gettid));
+        t.name[0] = '\0';
+        prctl(PR_GET_NAME, t.name);
+        stack_trace::register_thread();
+        t.stack_low = t.stack_high = 0;
+        stack_trace::thread_bounds(t.stack_low, t.stack_high);
+        t.stack = stack_arena_ + i * stack_capacity;
+        registration_.index = i;
+        slots_[i].state.store(active);
+        return true;
+      }
+      return false;
+    }
+
+
+    // Signals registered threads except calling one and waits until they
+    // deposit their state, at most deadline. Returns number of captured threads
+
+    static size_t capture(std::chrono::milliseconds deadline) noexcept {
+      pid_t const self = pid_t(syscall(SYS_gettid));
+      pid_t const process = getpid();
+      size_t pending = 0;
+      for(size_t i = 0; i != capacity; ++i) {
+        slot& s = slots_[i];
+        int expected = active;
+        if(s.data.tid == self || !s.state.compare_exchange_strong(expected, requested))
+          continue;
+        if(syscall(SYS_tgkill, process, s.data.tid, signal_number()) != 0) {
+          s.state.store(active); // thread is gone
+          continue;
+        }
+        ++pending;
+      }
+      timespec const pause{0, 100000};
+      long long const rounds = deadline.count() * 10;
+      for(long long round = 0; pending != 0 && round < rounds; ++round) {
+        nanosleep(&pause, nullptr);
+        pending = count(requested);
+      }
+      return count(captured);
+    }
+
+
+    // Lets captured threads go, cancels requests still pending
+
+    static void release() noexcept {
+      for(size_t i = 0; i != capacity; ++i) {
+        int expected = captured;
+        if(!slots_[i].state.compare_exchange_strong(expected, active)) {
+          expected = requested;
+          slots_[i].state.compare_exchange_strong(expected, active);
+        }
+      }
+    }
+
+
+    // f(thread const&) for captured threads, between capture and release
+
+    template<typename F> static size_t visit_captured(F&& f) noexcept {
+      size_t visited = 0;
+      for(size_t i = 0; i != capacity; ++i)
+        if(slots_[i].state.load() == captured) {
+          f(static_cast<thread const&>(slots_[i].data));
+          ++visited;
+        }
+      return visited;
+    }
+
+
+    // Name of registered calling thread or nullptr
+
+    static char const* current_name() noexcept {
+      if(registration_.index == none)
+        return nullptr;
+      return slots_[registration_.index].data.name;
+    }
+
+
+    static size_t size() noexcept {
+      return capacity - count(vacant);
+    }
+
+
+    // Stack copies, not worth dumping as process memory
+
+    static bool arena(uintptr_t& begin, uintptr_t& end) noexcept {
+      if(!prepared_.load())
+        return false;
+      begin = uintptr_t(stack_arena_);
+      end = begin + capacity * stack_capacity;
+      return true;
+    }
+
+
+  private:
+
+    enum state : int {
+      vacant, claimed, active, requested, captured
+    };
+
+    static constexpr size_t none = ~size_t(0);
+
+    struct slot {
+      std::atomic<int> state{vacant};
+      thread data;
+    }; // slot
+
+    // Frees the slot at thread exit
+    struct registration {
+      size_t index{none};
+
+      ~registration() noexcept {
+        if(index != none)
+          slots_[index].state.store(vacant);
+      }
+    }; // registration
+
+    static slot slots_[capacity];
+    static std::atomic<int> signal_;
+    static std::atomic<bool> prepared_;
+    static uint8_t* stack_arena_;
+    static thread_local registration registration_;
+
+
+    static size_t count(int s) noexcept {
+      size_t n = 0;
+      for(size_t i = 0; i != capacity; ++i)
+        if(slots_[i].state.load() == s)
+          ++n;
+      return n;
+    }
+
+
+    // Arena for stack copies (virtual, touched at crash only) and signal handler.
+    // Signal taken by the application fails it, next registration tries again
+
+    static bool prepare() noexcept {
+      static std::atomic<int> stage{0}; // 0 - not yet, 1 - in progress, 2 - done
+      int expected = 0;
+      if(stage.compare_exchange_strong(expected, 1)) {
+        void* arena = mmap(nullptr, capacity * stack_capacity, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(arena != MAP_FAILED) {
+          struct sigaction action;
+          std::memset(&action, 0, sizeof(action));
+          action.sa_sigaction = &thread_table::capture_dispatcher;
+          action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+          sigemptyset(&action.sa_mask);
+          if(signal_safe::claim(signal_number(), action)) {
+            stack_arena_ = static_cast<uint8_t*>(arena);
+            prepared_.store(true);
+          } else {
+            munmap(arena, capacity * stack_capacity);
+          }
+        }
+        stage.store(prepared_.load() ? 2 : 0);
+      }
+      while(stage.load() == 1)
+        sched_yield();
+      return prepared_.load();
+    }
+
+
+    static void capture_dispatcher(int, siginfo_t*, void* context) noexcept {
+      int const saved_errno = errno;
+      size_t const index = registration_.index;
+      if(index == none || context == nullptr) {
+        errno = saved_errno;
+        return;
+      }
+      slot& s = slots_[index];
+      if(s.state.load() != requested) {
+        errno = saved_errno;
+        return;
+      }
+      deposit(s.data, *static_cast<ucontext_t*>(context));
+      int expected = requested;
+      if(s.state.compare_exchange_strong(expected, captured)) {
+        // Don't change memory being dumped, bounded in case nobody releases
+        timespec const pause{0, 1000000};
+        for(int waited = 0; s.state.load() == captured && waited != 10000; ++waited)
+          nanosleep(&pause, nullptr);
+      }
+      errno = saved_errno;
+    }
+
+
+    static void deposit(thread& t, ucontext_t const& context) noexcept {
+      t.context = context;
+      t.has_float_state = false;
+      uintptr_t sp = 0;
+#if defined(__x86_64__)
+      sp = uintptr_t(context.uc_mcontext.gregs[REG_RSP]);
+      if(context.uc_mcontext.fpregs != nullptr) {
+        std::memcpy(t.float_state, context.uc_mcontext.fpregs, sizeof(t.float_state));
+        t.has_float_state = true;
+      }
+      t.context.uc_mcontext.fpregs = nullptr;
+#elif defined(__aarch64__)
+      sp = uintptr_t(context.uc_mcontext.sp);
+#endif
+      prctl(PR_GET_NAME, t.name);
+      sp = sp > 128 ? sp - 128 : 0; // red zone
+      t.stack_start = sp;
+      t.stack_size = 0;
+      if(sp < t.stack_low || sp >= t.stack_high)
+        return; // on alternate stack or unknown
+      size_t size = size_t(t.stack_high - sp);
+      if(size > stack_capacity)
+        size = stack_capacity;
+      std::memcpy(const_cast<uint8_t*>(t.stack), reinterpret_cast<void const*>(sp), size);
+      t.stack_size = size;
+    }
+
+  }; // thread_table
+
+  inline thread_table::slot thread_table::slots_[thread_table::capacity];
+  inline std::atomic<int> thread_table::signal_{0};
+  inline std::atomic<bool> thread_table::prepared_{false};
+  inline uint8_t* thread_table::stack_arena_{nullptr};
+  inline thread_local thread_table::registration thread_table::registration_;
+
+
+} // airbag
@@ -0,0 +1,354 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <typeinfo>
+#include <vector>
+#include "stack_trace.hpp"
+
+
+#if defined(_WIN32)
+
+#include <errhandlingapi.h>
+
+#elif defined(__linux__)
+
+#include <cstdlib>
+#include <dlfcn.h>
+#include <unistd.h>
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Counts thrown exceptions by type and throw site, caught ones included.
+  // Counters are sharded by thread, slots are claimed and incremented without
+  // locks. Including this header interposes __cxa_throw on Linux (weak
+  // definition, C++ runtime linked statically wins), Windows sees throws by
+  // vectored handler. Nothing is counted until enable()
+
+  class throw_sites {
+  public:
+
+    using clock_type = std::chrono::steady_clock;
+
+    static constexpr size_t shards_count = 8;
+    static constexpr size_t shard_capacity = 256; // power of two
+    static constexpr size_t depth = 16; // frames of sampled stack
+
+    struct site {
+      void* address; // return address of the throw call
+      std::type_info const* type;
+      uint64_t count;
+      double per_second; // since enable() or clear()
+      size_t frames_count;
+      void* frames[depth]; // the last sampled stack
+    }; // site
+
+
+    // Every sample_every-th throw of a thread records its stack too, 0 - never
+
+    static void enable(unsigned sample_every = 0) noexcept {
+      sample_every_.store(sample_every, std::memory_order_relaxed);
+      since_.store(clock_type::now().time_since_epoch().count(), std::memory_order_relaxed);
+#if defined(_WIN32)
+      if(handler_ == nullptr)
+        handler_ = AddVectoredExceptionHandler(1, &throw_sites::throw_dispatcher);
+#endif
+      enabled_.store(true, std::memory_order_release);
+    }
+
+
+    static void disable() noexcept {
+      enabled_.store(false, std::memory_order_relaxed);
+    }
+
+
+    static bool enabled() noexcept {
+      return enabled_.load(std::memory_order_relaxed);
+    }
+
+
+    // Zeroes counters, sites keep their slots
+
+    static void clear() noexcept {
+      for(size_t s = 0; s != shards_count; ++s)
+        for(size_t i = 0; i != shard_capacity; ++i)
+          shards_[s].entries[i].count.store(0, std::memory_order_relaxed);
+      dropped_.store(0, std::memory_order_relaxed);
+      since_.store(clock_type::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+
+
+    // Throws not counted because shard was full
+
+    static uint64_t dropped() noexcept {
+      return dropped_.load(std::memory_order_relaxed);
+    }
+
+
+    // Sites with the highest rates, shards merged
+
+    static std::vector<site> top(size_t n) {
+      std::vector<site> sites;
+      for(size_t s = 0; s != shards_count; ++s)
+        for(size_t i = 0; i != shard_capacity; ++i) {
+          entry const& e = shards_[s].entries[i];
+          auto const type = e.type.load(std::memory_order_acquire);
+          uint64_t const count = e.count.load(std::memory_order_relaxed);
+          if(type == nullptr || count == 0)
+            continue;
+          void* const address = reinterpret_cast<void*>(e.address.load(std::memory_order_relaxed));
+          auto found = std::find_if(sites.begin(), sites.end(), [&](site const& each) {
+            return each.address == address && each.type == type;
+          });
+          if(found == sites.end()) {
+            sites.push_back(site{address, type, 0, 0., 0, {}});
+            found = sites.end() - 1;
+          }
+          found->count += count;
+          if(found->frames_count == 0)
+            found->frames_count = read_sample(e, found->frames);
+        }
+      auto const since = clock_type::time_point{clock_type::duration{since_.load(std::memory_order_relaxed)}};
+      double const seconds = std::chrono::duration<double>(clock_type::now() - since).count();
+      for(auto& each: sites)
+        each.per_second = seconds > 0 ? double(each.count) / seconds : 0.;
+      std::sort(sites.begin(), sites.end(), [](site const& a, site const& b) {
+        return a.count > b.count;
+      });
+      if(sites.size() > n)
+        sites.resize(n);
+      return sites;
+    }
+
+
+    // Called by interposer for every throw
+
+    static void record(void* address, std::type_info const* type) noexcept {
+      if(!enabled_.load(std::memory_order_relaxed) || type == nullptr)
+        return;
+      shard& s = shards_[shard_index()];
+      uintptr_t const key = uintptr_t(address);
+      size_t const hash = size_t((key ^ uintptr_t(type)) * 0x9E3779B97F4A7C15ull >> 32);
+      for(size_t probe = 0; probe != max_probes; ++probe) {
+        entry& e = s.entries[(hash + probe) & (shard_capacity - 1)];
+        uintptr_t current = e.address.load(std::memory_order_acquire);
+        if(current == 0 && e.address.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+          e.type.store(type, std::memory_order_release);
+          current = key;
+        }
+        if(current != key)
+          continue;
+        std::type_info const* claimed = e.type.load(std::memory_order_acquire);
+        while(claimed == nullptr) // claimed by another thread just now
+          claimed = e.type.load(std::memory_order_acquire);
+        if(claimed != type)
+          continue;
+        e.count.fetch_add(1, std::memory_order_relaxed);
+        unsigned const every = sample_every_.load(std::memory_order_relaxed);
+        if(every != 0 && ++countdown_ >= every) {
+          countdown_ = 0;
+          write_sample(e);
+        }
+        return;
+      }
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+
+  private:
+
+    static constexpr size_t max_probes = 16;
+
+    struct entry {
+      std::atomic<uintptr_t> address{0};
+      std::atomic<std::type_info const*> type{nullptr};
+      std::atomic<uint64_t> count{0};
+      std::atomic<unsigned> sequence{0}; // seqlock of the sample, odd while written
+      std::atomic<size_t> frames_count{0};
+      std::atomic<void*> frames[depth]{};
+    }; // entry
+
+    struct alignas(64) shard {
+      entry entries[shard_capacity];
+    }; // shard
+
+    static shard shards_[shards_count];
+    static std::atomic<bool> enabled_;
+    static std::atomic<unsigned> sample_every_;
+    static std::atomic<clock_type::rep> since_;
+    static std::atomic<uint64_t> dropped_;
+    static std::atomic<unsigned> next_shard_;
+    static thread_local unsigned shard_; // 1 + index, 0 - not assigned yet
+    static thread_local unsigned countdown_;
+#if defined(_WIN32)
+    static void* handler_;
+#endif
+
+
+    static size_t shard_index() noexcept {
+      if(shard_ == 0)
+        shard_ = 1 + next_shard_.fetch_add(1, std::memory_order_relaxed) % shards_count;
+      return shard_ - 1;
+    }
+
+
+    // Skipped if another thread is writing sample of the same site
+
+    static void write_sample(entry& e) noexcept {
+      unsigned sequence = e.sequence.load(std::memory_order_relaxed);
+      if((sequence & 1) || !e.sequence.compare_exchange_strong(sequence, sequence + 1,
+                                                               std::memory_order_acquire))
+        return;
+      void* frames[depth];
+      size_t const n = capture(frames);
+      for(size_t i = 0; i != n; ++i)
+        e.frames[i].store(frames[i], std::memory_order_relaxed);
+      e.frames_count.store(n, std::memory_order_relaxed);
+      e.sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+
+    static size_t read_sample(entry const& e, void** frames) noexcept {
+      constexpr int attempts = 16;
+      for(int attempt = 0; attempt != attempts; ++attempt) {
+        unsigned const sequence = e.sequence.load(std::memory_order_acquire);
+        if(sequence & 1)
+          continue;
+        size_t const n = e.frames_count.load(std::memory_order_relaxed);
+        for(size_t i = 0; i != n && i != depth; ++i)
+          frames[i] = e.frames[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(e.sequence.load(std::memory_order_relaxed) == sequence)
+          return n;
+      }
+      return 0;
+    }
+
+
+#if defined(_WIN32)
+
+    static size_t capture(void** frames) noexcept {
+      CONTEXT context;
+      RtlCaptureContext(&context);
+      return stack_trace::capture(context, frames, depth);
+    }
+
+
+    // C++ exceptions are raised with code 'msc' | 0xE0000000 and throw info
+    // (x64: relative to image base), its first catchable type is the thrown one
+
+    static LONG WINAPI throw_dispatcher(EXCEPTION_POINTERS* info) noexcept {
+      constexpr DWORD cpp_exception = 0xE06D7363;
+      EXCEPTION_RECORD const& r = *info->ExceptionRecord;
+      if(r.ExceptionCode != cpp_exception || r.NumberParameters < 3
+         || !enabled_.load(std::memory_order_relaxed))
+        return EXCEPTION_CONTINUE_SEARCH;
+      uintptr_t const base = r.NumberParameters >= 4 ? uintptr_t(r.ExceptionInformation[3]) : 0;
+      auto const* throw_info = reinterpret_cast<int const*>(r.ExceptionInformation[2]);
+      if(throw_info == nullptr)
+        return EXCEPTION_CONTINUE_SEARCH;
+      auto const* types = reinterpret_cast<int const*>(base + uintptr_t(unsigned(throw_info[3])));
+      auto const* first = reinterpret_cast<int const*>(base + uintptr_t(unsigned(types[1])));
+      auto const* type = reinterpret_cast<std::type_info const*>(base + uintptr_t(unsigned(first[1])));
+      // RaiseException, _CxxThrowException, then the throw site
+      void* frames[3];
+      if(stack_trace::capture(*info->ContextRecord, frames, 3) != 3)
+        return EXCEPTION_CONTINUE_SEARCH;
+      record(frames[2], type);
+      return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+#else
+
+    static size_t capture(void** frames) noexcept {
+      return stack_trace::capture(frames, depth);
+    }
+
+#endif
+
+  }; // throw_sites
+
+  inline throw_sites::shard throw_sites::shards_[throw_sites::shards_count];
+  inline std::atomic<bool> throw_sites::enabled_{false};
+  inline std::atomic<unsigned> throw_sites::sample_every_{0};
+  inline std::atomic<throw_sites::clock_type::rep> throw_sites::since_{0};
+  inline std::atomic<uint64_t> throw_sites::dropped_{0};
+  inline std::atomic<unsigned> throw_sites::next_shard_{0};
+  inline thread_local unsigned throw_sites::shard_{0};
+  inline thread_local unsigned throw_sites::countdown_{0};
+#if defined(_WIN32)
+  inline void* throw_sites::handler_{nullptr};
+#endif
+
+
+} // airbag
+
+
+#if defined(__linux__)
+
+// Weak definition takes precedence over the one from C++ runtime library,
+// the real one is found next to it once. Without it no exception can be
+// thrown, so the process is aborted with a message at the first throw.
+// Declared like in <cxxabi.h>
+
+namespace __cxxabiv1 {
+
+  extern "C" __attribute__((weak, noreturn))
+  void __cxa_throw(void* object, std::type_info* type, void (*destructor)(void*)) {
+    using throw_function = void (*)(void*, std::type_info*, void (*)(void*));
+    static std::atomic<throw_function> next{nullptr};
+    airbag::throw_sites::record(__builtin_return_address(0), type);
+    throw_function real = next.load(std::memory_order_relaxed);
+    if(real == nullptr) {
+      real = reinterpret_cast<throw_function>(dlsym(RTLD_NEXT, "__cxa_throw"));
+      if(real == nullptr || real == &__cxa_throw) {
+        static constexpr char message[] =
+          "airbag: __cxa_throw of C++ runtime is not found, throw_sites.hpp needs it linked dynamically\n";
+        ssize_t const written = write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void)written;
+        std::abort();
+      }
+      next.store(real, std::memory_order_relaxed);
+    }
+    real(object, type, destructor);
+    __builtin_unreachable();
+  }
+
+} // __cxxabiv1
+
+#endif
@@ -0,0 +1,504 @@
+/* This file is part of airbag library
+ * Copyright 2020 Andrei Ilin <ortfero@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "minidump.hpp"
+#include "module_map.hpp"
+#include "stack_trace.hpp"
+
+
+#if defined(_WIN32)
+
+#include <handleapi.h>
+
+#elif defined(__linux__)
+
+#include <errno.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include "signal_safe.hpp"
+
+#else
+
+#error Unsupported system
+
+#endif
+
+
+namespace airbag {
+
+
+  // Worker threads beat their heartbeats, watchdog thread scans them every
+  // period. Thread not beating longer than its budget is reported once per
+  // stall: its stack is captured (by signal on Linux, by suspending it on
+  // Windows) and minidump is written if set, the process keeps running
+
+  class watchdog {
+  public:
+
+    using clock_type = std::chrono::steady_clock;
+    using duration = clock_type::duration;
+
+    static constexpr size_t capacity = 256;
+    static constexpr size_t name_capacity = 16;
+
+    struct stall {
+      uint64_t thread_id;
+      char const* name;
+      duration budget;
+      duration elapsed; // since the last beat
+      uint64_t beats;
+      void* const* frames;
+      size_t frames_count; // zero if the thread was not captured
+    }; // stall
+
+    using stall_handler = std::function<void(stall const&)>;
+
+  private:
+
+    struct slot;
+
+  public:
+
+    // Owned by worker thread, watchdog should outlive it
+
+    class heartbeat {
+    public:
+
+      heartbeat() noexcept = default;
+      heartbeat(heartbeat const&) = delete;
+      heartbeat& operator = (heartbeat const&) = delete;
+
+      heartbeat(heartbeat&& other) noexcept:
+        slot_{other.slot_}, counter_{other.counter_}, beats_{other.beats_} {
+        other.slot_ = nullptr;
+        other.counter_ = &sink_;
+      }
+
+      heartbeat& operator = (heartbeat&& other) noexcept {
+        if(this == &other)
+          return *this;
+        detach();
+        slot_ = other.slot_; counter_ = other.counter_; beats_ = other.beats_;
+        other.slot_ = nullptr;
+        other.counter_ = &sink_;
+        return *this;
+      }
+
+      ~heartbeat() { detach(); }
+
+      explicit operator bool () const noexcept { return slot_ != nullptr; }
+
+      // The only store to shared memory, counter has its own cache line
+
+      void beat() noexcept {
+        counter_->store(++beats_, std::memory_order_relaxed);
+      }
+
+      // Thread is waiting for work, it is not stalled until the next beat
+
+      void idle() noexcept {
+        counter_->store(++beats_ | idle_bit, std::memory_order_relaxed);
+      }
+
+      void detach() noexcept {
+        if(slot_ == nullptr)
+          return;
+        for(;;) {
+          int expected = slot_->state.load(std::memory_order_acquire);
+          if(expected == capturing) {
+            std::this_thread::yield();
+            continue;
+          }
+          if(slot_->state.compare_exchange_weak(expected, claimed, std::memory_order_acq_rel))
+            break;
+        }
+#if defined(_WIN32)
+        CloseHandle(slot_->thread);
+#endif
+        slot_->state.store(vacant, std::memory_order_release);
+        slot_ = nullptr;
+        counter_ = &sink_;
+      }
+
+    private:
+
+      friend class watchdog;
+
+      slot* slot_{nullptr};
+      std::atomic<uint64_t>* counter_{&sink_};
+      uint64_t beats_{0};
+    }; // heartbeat
+
+
+    watchdog() noexcept = default;
+    watchdog(watchdog const&) = delete;
+    watchdog& operator = (watchdog const&) = delete;
+    ~watchdog() { stop(); }
+
+
+    // Configured before start()
+
+    watchdog& period(duration p) noexcept { period_ = p; return *this; }
+    watchdog& on_stall(stall_handler handler) { handler_ = std::move(handler); return *this; }
+    watchdog& dump_to(minidump* target) noexcept { dump_ = target; return *this; }
+
+    // How long to wait for stalled thread to give its context
+    watchdog& capture_timeout(duration t) noexcept { capture_timeout_ = t; return *this; }
+
+
+    bool start() {
+      if(thread_.joinable())
+        return true;
+#if defined(__linux__)
+      if(!install())
+        return false;
+#endif
+      stopping_ = false;
+      thread_ = std::thread([this] { run(); });
+      return true;
+    }
+
+
+    void stop() {
+      if(!thread_.joinable())
+        return;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        stopping_ = true;
+      }
+      wakeup_.notify_one();
+      thread_.join();
+    }
+
+
+    // Called by worker thread itself, returns detached heartbeat if table is full
+
+    heartbeat attach(duration budget, char const* name = nullptr) noexcept {
+      heartbeat h;
+      for(size_t i = 0; i != capacity; ++i) {
+        slot& s = slots_[i];
+        int expected = vacant;
+        if(!s.state.compare_exchange_strong(expected, claimed, std::memory_order_acq_rel))
+          continue;
+        s.budget = budget;
+        s.name[0] = '\0';
+#if defined(_WIN32)
+        s.thread_id = GetCurrentThreadId();
+        s.thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION,
+                              FALSE, DWORD(s.thread_id));
+#else
+        s.tid = pid_t(syscall(SYS_gettid));
+        s.thread_id = uint64_t(s.tid);
+        stack_trace::register_thread();
+        if(name == nullptr)
+          prctl(PR_GET_NAME, s.name);
+#endif
+        if(name != nullptr) {
+          size_t const n = std::strlen(name);
+          size_t const length = n < name_capacity - 1 ? n : name_capacity - 1;
+          std::memcpy(s.name, name, length);
+          s.name[length] = '\0';
+        }
+        s.beats.store(0, std::memory_order_relaxed);
+        s.state.store(attached, std::memory_order_release);
+        h.slot_ = &s;
+        h.counter_ = &s.beats;
+        return h;
+      }
+      return h;
+    }
+
+
+    uint64_t stalls() const noexcept { return stalls_.load(std::memory_order_relaxed); }
+
+
+#if defined(__linux__)
+
+    // SIGRTMAX-4 by default. Set before start(), which fails if the application
+    // has a handler for the signal
+
+    static int signal_number() noexcept {
+      int const signal = signal_.load();
+      return signal != 0 ? signal : SIGRTMAX - 4;
+    }
+    static bool signal_number(int signal) noexcept {
+      if(installed_.load())
+        return false;
+      signal_.store(signal);
+      return true;
+    }
+
+#endif
+
+
+  private:
+
+    enum state : int {
+      vacant, claimed, attached, watched, capturing
+    };
+
+    static constexpr uint64_t idle_bit = uint64_t(1) << 63;
+
+    struct slot {
+      alignas(64) std::atomic<uint64_t> beats{0}; // written by worker only
+      alignas(64) std::atomic<int> state{vacant};
+      duration budget{};
+      uint64_t thread_id{0};
+      char name[name_capacity]{};
+#if defined(_WIN32)
+      HANDLE thread{nullptr};
+#else
+      pid_t tid{0};
+#endif
+      // Touched by watchdog thread only
+      uint64_t seen{0};
+      clock_type::time_point changed{};
+      bool reported{false};
+    }; // slot
+
+#if defined(__linux__)
+    // Filled by signal handler on stalled thread
+    struct capture {
+      pid_t tid;
+      std::atomic<bool> done{false};
+      minidump_writer::crash failure;
+      void* frames[stack_trace::capacity];
+      size_t frames_count;
+    }; // capture
+
+    static std::atomic<capture*> requested_;
+    static std::mutex capturing_; // one capture in flight per process
+    static std::atomic<int> signal_;
+    static std::atomic<bool> installed_;
+    capture capture_;
+#else
+    // Context of stalled thread as if it raised STATUS_POSSIBLE_DEADLOCK
+    // there, so dump and its fingerprint point at the stall site
+    CONTEXT context_;
+    EXCEPTION_RECORD record_;
+    EXCEPTION_POINTERS pointers_{&record_, &context_};
+    void* frames_[stack_trace::capacity];
+    size_t frames_count_{0};
+#endif
+
+    static std::atomic<uint64_t> sink_; // beats of detached heartbeats
+
+    slot slots_[capacity];
+    duration period_{std::chrono::milliseconds{100}};
+    duration capture_timeout_{std::chrono::milliseconds{100}};
+    stall_handler handler_;
+    minidump* dump_{nullptr};
+    std::atomic<uint64_t> stalls_{0};
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    bool stopping_{false};
+
+
+    void run() {
+      std::unique_lock<std::mutex> lock{mutex_};
+      while(!wakeup_.wait_for(lock, period_, [this] { return stopping_; })) {
+        lock.unlock();
+        module_map::refresh(); // modules loaded or unloaded meanwhile
+        scan();
+        lock.lock();
+      }
+    }
+
+
+    void scan() {
+      auto const now = clock_type::now();
+      for(size_t i = 0; i != capacity; ++i) {
+        slot& s = slots_[i];
+        int const current = s.state.load(std::memory_order_acquire);
+        if(current == attached) {
+          s.seen = s.beats.load(std::memory_order_relaxed);
+          s.changed = now;
+          s.reported = false;
+          int expected = attached;
+          s.state.compare_exchange_strong(expected, watched, std::memory_order_acq_rel);
+          continue;
+        }
+        if(current != watched)
+          continue;
+        uint64_t const beats = s.beats.load(std::memory_order_relaxed);
+        if(beats != s.seen) {
+          s.seen = beats;
+          s.changed = now;
+          s.reported = false;
+          continue;
+        }
+        if(s.reported || (beats & idle_bit) != 0 || now - s.changed <= s.budget)
+          continue;
+        int expected = watched;
+        if(!s.state.compare_exchange_strong(expected, capturing, std::memory_order_acq_rel))
+          continue; // detaching
+        s.reported = true;
+        report(s, now);
+        s.state.store(watched, std::memory_order_release);
+      }
+    }
+
+
+    void report(slot const& s, clock_type::time_point now) {
+      stalls_.fetch_add(1, std::memory_order_relaxed);
+      bool const captured = take(s);
+      stall const st{s.thread_id, s.name, s.budget, now - s.changed, s.seen & ~idle_bit,
+#if defined(__linux__)
+                     capture_.frames, captured ? capture_.frames_count : 0
+#else
+                     frames_, captured ? frames_count_ : 0
+#endif
+      };
+      if(handler_)
+        handler_(st);
+      if(dump_ == nullptr)
+        return;
+#if defined(_WIN32)
+      if(captured)
+        dump_->generate(system_failure{&pointers_, DWORD(s.thread_id)});
+      else
+        dump_->generate(system_failure{}); // all threads, no exception
+#else
+      if(captured)
+        dump_->generate(capture_.failure);
+#endif
+    }
+
+
+#if defined(_WIN32)
+
+    bool take(slot const& s) noexcept {
+      if(s.thread == nullptr || SuspendThread(s.thread) == DWORD(-1))
+        return false;
+      std::memset(&context_, 0, sizeof(context_));
+      context_.ContextFlags = CONTEXT_FULL;
+      bool const taken = !!GetThreadContext(s.thread, &context_);
+      if(taken) {
+        frames_count_ = stack_trace::capture(context_, frames_, stack_trace::capacity);
+        std::memset(&record_, 0, sizeof(record_));
+        record_.ExceptionCode = STATUS_POSSIBLE_DEADLOCK;
+#if defined(_M_AMD64)
+        record_.ExceptionAddress = PVOID(context_.Rip);
+#elif defined(_M_ARM64)
+        record_.ExceptionAddress = PVOID(context_.Pc);
+#else
+        record_.ExceptionAddress = PVOID(context_.Eip);
+#endif
+      }
+      ResumeThread(s.thread);
+      return taken;
+    }
+
+#else
+
+    bool take(slot const& s) noexcept {
+      std::lock_guard<std::mutex> lock{capturing_};
+      capture_.tid = s.tid;
+      capture_.done.store(false, std::memory_order_relaxed);
+      requested_.store(&capture_, std::memory_order_release);
+      if(syscall(SYS_tgkill, getpid(), s.tid, signal_number()) != 0) {
+        requested_.store(nullptr, std::memory_order_relaxed);
+        return false;
+      }
+      auto const deadline = clock_type::now() + capture_timeout_;
+      while(!capture_.done.load(std::memory_order_acquire) && clock_type::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::microseconds{100});
+      capture* expected = &capture_;
+      if(requested_.compare_exchange_strong(expected, nullptr))
+        return false; // signal was not handled in time
+      while(!capture_.done.load(std::memory_order_acquire))
+        std::this_thread::yield(); // handler is running
+      return true;
+    }
+
+
+    static bool install() noexcept {
+      static std::mutex installing;
+      std::lock_guard<std::mutex> lock{installing};
+      if(!installed_.load()) {
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_sigaction = &watchdog::capture_dispatcher;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        installed_.store(signal_safe::claim(signal_number(), action));
+      }
+      return installed_.load();
+    }
+
+
+    static void capture_dispatcher(int, siginfo_t* info, void* context) noexcept {
+      int const saved_errno = errno;
+      capture* c = requested_.load(std::memory_order_acquire);
+      if(c != nullptr && context != nullptr && c->tid == pid_t(syscall(SYS_gettid))
+         && requested_.compare_exchange_strong(c, nullptr, std::memory_order_acq_rel)) {
+        ucontext_t const& uc = *static_cast<ucontext_t*>(context);
+        minidump_writer::crash& f = c->failure;
+        f.pid = getpid();
+        f.tid = c->tid;
+        f.info = *info;
+        f.context = uc;
+        f.has_float_state = false;
+#if defined(__x86_64__)
+        if(uc.uc_mcontext.fpregs != nullptr) {
+          std::memcpy(f.float_state, uc.uc_mcontext.fpregs, sizeof(f.float_state));
+          f.has_float_state = true;
+        }
+        f.context.uc_mcontext.fpregs = nullptr;
+#endif
+        c->frames_count = stack_trace::capture(uc, c->frames, stack_trace::capacity);
+        c->done.store(true, std::memory_order_release);
+      }
+      errno = saved_errno;
+    }
+
+#endif
+
+  }; // watchdog
+
+#if defined(__linux__)
+  inline std::atomic<watchdog::capture*> watchdog::requested_{nullptr};
+  inline std::mutex watchdog::capturing_;
+  inline std::atomic<int> watchdog::signal_{0};
+  inline std::atomic<bool> watchdog::installed_{false};
+#endif
+  inline std::atomic<uint64_t> watchdog::sink_{0};
+
+
+} // airbag
@@ -0,0 +1,850 @@
+// Offline symbolizer of airbag crash reports
+//
+//   airbag-symbolize [--cache DIR] [--no-cache] [--debug-dir DIR]... [--no-lines] report...
+//
+// Frames are resolved against ELF .symtab/.dynsym and .debug_line of the
+// binaries (or their separate debug files) matched by build-id. Sorted index
+// of every binary is cached on disk as <cache>/<build-id>.idx and mmap'ed,
+// so repeated reports of the same binaries cost only the lookups.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+namespace {
+
+
+  struct mapped_file {
+
+    void* data{MAP_FAILED};
+    size_t size{0};
+
+    mapped_file() = default;
+    mapped_file(mapped_file const&) = delete;
+    mapped_file& operator = (mapped_file const&) = delete;
+
+
+    bool open(std::string const& path) {
+      int const fd = ::open(path.data(), O_RDONLY | O_CLOEXEC);
+      if(fd == -1)
+        return false;
+      struct stat status;
+      if(fstat(fd, &status) == 0 && status.st_size > 0) {
+        size = size_t(status.st_size);
+        data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      }
+      close(fd);
+      return data != MAP_FAILED;
+    }
+
+
+    ~mapped_file() {
+      if(data != MAP_FAILED)
+        munmap(data, size);
+    }
+
+
+    unsigned char const* bytes() const { return static_cast<unsigned char const*>(data); }
+  }; // mapped_file
+
+
+  // Sequential reader of little endian DWARF data
+
+  struct cursor {
+
+    unsigned char const* begin;
+    unsigned char const* end;
+
+    bool empty() const { return begin >= end; }
+
+    template<typename T> T read() {
+      T value{};
+      if(size_t(end - begin) < sizeof(T)) {
+        begin = end;
+        return value;
+      }
+      std::memcpy(&value, begin, sizeof(T));
+      begin += sizeof(T);
+      return value;
+    }
+
+    uint64_t read(size_t size) {
+      switch(size) {
+        case 1: return read<uint8_t>();
+        case 2: return read<uint16_t>();
+        case 4: return read<uint32_t>();
+        default: return read<uint64_t>();
+      }
+    }
+
+    uint64_t uleb() {
+      uint64_t value = 0; unsigned shift = 0;
+      while(begin < end) {
+        uint8_t const byte = *begin++;
+        if(shift < 64)
+          value |= uint64_t(byte & 0x7F) << shift;
+        shift += 7;
+        if(!(byte & 0x80))
+          break;
+      }
+      return value;
+    }
+
+    int64_t sleb() {
+      int64_t value = 0; unsigned shift = 0; uint8_t byte = 0;
+      while(begin < end) {
+        byte = *begin++;
+        if(shift < 64)
+          value |= int64_t(byte & 0x7F) << shift;
+        shift += 7;
+        if(!(byte & 0x80))
+          break;
+      }
+      if(shift < 64 && (byte & 0x40))
+        value |= -(int64_t(1) << shift);
+      return value;
+    }
+
+    char const* string() {
+      auto const* s = reinterpret_cast<char const*>(begin);
+      while(begin < end && *begin != 0)
+        ++begin;
+      if(begin < end)
+        ++begin;
+      return s;
+    }
+
+    void skip(uint64_t size) {
+      begin = size < uint64_t(end - begin) ? begin + size : end;
+    }
+  }; // cursor
+
+
+  class elf_image {
+  public:
+
+    bool open(std::string const& path) {
+      if(!file_.open(path) || file_.size < sizeof(Elf64_Ehdr))
+        return false;
+      header_ = reinterpret_cast<Elf64_Ehdr const*>(file_.bytes());
+      if(std::memcmp(header_->e_ident, ELFMAG, SELFMAG) != 0 || header_->e_ident[EI_CLASS] != ELFCLASS64)
+        return false;
+      if(header_->e_shoff + uint64_t(header_->e_shnum) * sizeof(Elf64_Shdr) > file_.size)
+        return false;
+      sections_ = reinterpret_cast<Elf64_Shdr const*>(file_.bytes() + header_->e_shoff);
+      if(header_->e_shstrndx < header_->e_shnum)
+        names_ = section_data(sections_[header_->e_shstrndx]);
+      return true;
+    }
+
+
+    std::string build_id() const {
+      for(unsigned i = 0; i != header_->e_shnum; ++i) {
+        if(sections_[i].sh_type != SHT_NOTE)
+          continue;
+        cursor notes = section_data(sections_[i]);
+        while(!notes.empty()) {
+          auto const name_size = notes.read<uint32_t>();
+          auto const data_size = notes.read<uint32_t>();
+          auto const type = notes.read<uint32_t>();
+          auto const* name = notes.begin;
+          notes.skip((name_size + 3) & ~3u);
+          auto const* data = notes.begin;
+          notes.skip((data_size + 3) & ~3u);
+          if(type != NT_GNU_BUILD_ID || name_size != 4 || std::memcmp(name, "GNU", 4) != 0
+             || data + data_size > notes.end)
+            continue;
+          return hex(data, data_size);
+        }
+      }
+      return {};
+    }
+
+
+    uint64_t min_vaddr() const {
+      uint64_t result = UINT64_MAX;
+      auto const* programs = reinterpret_cast<Elf64_Phdr const*>(file_.bytes() + header_->e_phoff);
+      if(header_->e_phoff + uint64_t(header_->e_phnum) * sizeof(Elf64_Phdr) > file_.size)
+        return 0;
+      for(unsigned i = 0; i != header_->e_phnum; ++i)
+        if(programs[i].p_type == PT_LOAD && programs[i].p_vaddr < result)
+          result = programs[i].p_vaddr & ~uint64_t(programs[i].p_align ? programs[i].p_align - 1 : 0);
+      return result == UINT64_MAX ? 0 : result;
+    }
+
+
+    template<typename F> void symbols(F&& f) const {
+      for(unsigned i = 0; i != header_->e_shnum; ++i) {
+        Elf64_Shdr const& section = sections_[i];
+        if(section.sh_type != SHT_SYMTAB && section.sh_type != SHT_DYNSYM)
+          continue;
+        if(section.sh_link >= header_->e_shnum)
+          continue;
+        cursor const strings = section_data(sections_[section.sh_link]);
+        cursor const table = section_data(section);
+        size_t const count = size_t(table.end - table.begin) / sizeof(Elf64_Sym);
+        for(size_t j = 0; j != count; ++j) {
+          Elf64_Sym symbol;
+          std::memcpy(&symbol, table.begin + j * sizeof(Elf64_Sym), sizeof(symbol));
+          auto const type = ELF64_ST_TYPE(symbol.st_info);
+          if((type != STT_FUNC && type != STT_GNU_IFUNC) || symbol.st_shndx == SHN_UNDEF
+             || symbol.st_value == 0 || symbol.st_name >= size_t(strings.end - strings.begin))
+            continue;
+          f(symbol.st_value, symbol.st_size, reinterpret_cast<char const*>(strings.begin + symbol.st_name));
+        }
+      }
+    }
+
+
+    cursor section(std::string_view name) const {
+      for(unsigned i = 0; i != header_->e_shnum; ++i) {
+        if(sections_[i].sh_name >= size_t(names_.end - names_.begin))
+          continue;
+        if(reinterpret_cast<char const*>(names_.begin + sections_[i].sh_name) != name)
+          continue;
+        if(sections_[i].sh_flags & SHF_COMPRESSED)
+          return {nullptr, nullptr}; // compressed debug sections are not supported
+        return section_data(sections_[i]);
+      }
+      return {nullptr, nullptr};
+    }
+
+
+    static std::string hex(unsigned char const* data, size_t size) {
+      static constexpr char digits[] = "0123456789abcdef";
+      std::string result;
+      for(size_t i = 0; i != size; ++i) {
+        result += digits[data[i] >> 4];
+        result += digits[data[i] & 0xF];
+      }
+      return result;
+    }
+
+  private:
+
+    mapped_file file_;
+    Elf64_Ehdr const* header_{nullptr};
+    Elf64_Shdr const* sections_{nullptr};
+    cursor names_{nullptr, nullptr};
+
+
+    cursor section_data(Elf64_Shdr const& section) const {
+      if(section.sh_type == SHT_NOBITS || section.sh_offset + section.sh_size > file_.size)
+        return {nullptr, nullptr};
+      return {file_.bytes() + section.sh_offset, file_.bytes() + section.sh_offset + section.sh_size};
+    }
+  }; // elf_image
+
+
+  // Cached index layout: header, symbols, lines, file offsets, strings
+
+  constexpr char index_magic[8] = {'A', 'I', 'R', 'B', 'A', 'G', 'S', '1'};
+
+  struct index_header {
+    char magic[8];
+    uint64_t min_vaddr;
+    uint64_t symbols_count;
+    uint64_t lines_count;
+    uint64_t files_count;
+    uint64_t strings_size;
+  };
+
+  struct index_symbol {
+    uint64_t address;
+    uint64_t size;
+    uint64_t name;
+  };
+
+  struct index_line {
+    uint64_t address;
+    uint32_t file;
+    uint32_t line; // 0 marks end of sequence
+  };
+
+
+  class index_builder {
+  public:
+
+    void build(elf_image const& image, bool with_lines) {
+      min_vaddr_ = image.min_vaddr();
+      image.symbols([this](uint64_t address, uint64_t size, char const* name) {
+        symbols_.push_back({address, size, string(name)});
+      });
+      std::sort(symbols_.begin(), symbols_.end(), [](index_symbol const& a, index_symbol const& b) {
+        return a.address < b.address || (a.address == b.address && a.size > b.size);
+      });
+      symbols_.erase(std::unique(symbols_.begin(), symbols_.end(),
+        [](index_symbol const& a, index_symbol const& b) { return a.address == b.address; }),
+        symbols_.end());
+      if(with_lines)
+        read_lines(image);
+      std::stable_sort(lines_.begin(), lines_.end(), [](index_line const& a, index_line const& b) {
+        return a.address < b.address || (a.address == b.address && a.line == 0 && b.line != 0);
+      });
+    }
+
+
+    std::vector<char> serialize() const {
+      index_header header;
+      std::memcpy(header.magic, index_magic, sizeof(index_magic));
+      header.min_vaddr = min_vaddr_;
+      header.symbols_count = symbols_.size();
+      header.lines_count = lines_.size();
+      header.files_count = files_.size();
+      header.strings_size = strings_.size();
+      std::vector<char> blob;
+      auto append = [&blob](void const* data, size_t size) {
+        auto const* bytes = static_cast<char const*>(data);
+        blob.insert(blob.end(), bytes, bytes + size);
+      };
+      append(&header, sizeof(header));
+      append(symbols_.data(), symbols_.size() * sizeof(index_symbol));
+      append(lines_.data(), lines_.size() * sizeof(index_line));
+      append(files_.data(), files_.size() * sizeof(uint64_t));
+      append(strings_.data(), strings_.size());
+      return blob;
+    }
+
+  private:
+
+    uint64_t min_vaddr_{0};
+    std::vector<index_symbol> symbols_;
+    std::vector<index_line> lines_;
+    std::vector<uint64_t> files_;
+    std::vector<char> strings_;
+    std::unordered_map<std::string, uint32_t> file_ids_;
+
+
+    uint64_t string(std::string_view s) {
+      uint64_t const offset = strings_.size();
+      strings_.insert(strings_.end(), s.begin(), s.end());
+      strings_.push_back('\0');
+      return offset;
+    }
+
+
+    uint32_t file(std::string const& path) {
+      auto const found = file_ids_.find(path);
+      if(found != file_ids_.end())
+        return found->second;
+      auto const id = uint32_t(files_.size());
+      files_.push_back(string(path));
+      file_ids_.emplace(path, id);
+      return id;
+    }
+
+
+    static std::string join(std::string const& directory, char const* name) {
+      if(*name == '/' || directory.empty())
+        return name;
+      return directory + '/' + name;
+    }
+
+
+    // .debug_line programs of DWARF 2 to 5
+
+    void read_lines(elf_image const& image) {
+      cursor units = image.section(".debug_line");
+      cursor const line_strings = image.section(".debug_line_str");
+      cursor const strings = image.section(".debug_str");
+
+      while(!units.empty()) {
+        uint64_t unit_length = units.read<uint32_t>();
+        size_t offset_size = 4;
+        if(unit_length == 0xFFFFFFFF) {
+          unit_length = units.read<uint64_t>();
+          offset_size = 8;
+        }
+        if(unit_length == 0 || unit_length > uint64_t(units.end - units.begin))
+          break;
+        cursor unit{units.begin, units.begin + unit_length};
+        units.skip(unit_length);
+
+        auto const version = unit.read<uint16_t>();
+        if(version < 2 || version > 5)
+          continue;
+        uint8_t address_size = 8;
+        if(version >= 5) {
+          address_size = unit.read<uint8_t>();
+          unit.read<uint8_t>(); // segment selector size
+        }
+        uint64_t const header_length = unit.read(offset_size);
+        cursor program{unit.begin + header_length, unit.end};
+        if(program.begin > unit.end)
+          continue;
+        auto const minimum_instruction_length = unit.read<uint8_t>();
+        if(version >= 4)
+          unit.read<uint8_t>(); // maximum operations per instruction
+        unit.read<uint8_t>(); // default is_stmt
+        auto const line_base = unit.read<int8_t>();
+        auto const line_range = unit.read<uint8_t>();
+        auto const opcode_base = unit.read<uint8_t>();
+        if(line_range == 0 || opcode_base == 0)
+          continue;
+        std::vector<uint8_t> opcode_lengths(opcode_base - 1);
+        for(auto& length: opcode_lengths)
+          length = unit.read<uint8_t>();
+
+        std::vector<std::string> directories;
+        std::vector<uint32_t> unit_files;
+
+        auto read_form = [&](uint64_t form, std::string* text) -> uint64_t {
+          switch(form) {
+            case 0x08: // DW_FORM_string
+              if(text) *text = unit.string(); else unit.string();
+              return 0;
+            case 0x1f: case 0x0e: { // DW_FORM_line_strp, DW_FORM_strp
+              uint64_t const offset = unit.read(offset_size);
+              cursor const& table = form == 0x1f ? line_strings : strings;
+              if(text && offset < uint64_t(table.end - table.begin))
+                *text = reinterpret_cast<char const*>(table.begin + offset);
+              return 0;
+            }
+            case 0x0f: return unit.uleb(); // DW_FORM_udata
+            case 0x0b: return unit.read<uint8_t>();
+            case 0x05: return unit.read<uint16_t>();
+            case 0x06: return unit.read<uint32_t>();
+            case 0x07: return unit.read<uint64_t>();
+            case 0x1e: unit.skip(16); return 0; // DW_FORM_data16
+            case 0x09: unit.skip(unit.uleb()); return 0; // DW_FORM_block
+            default: unit.begin = unit.end; return 0;
+          }
+        };
+
+        if(version >= 5) {
+          auto read_entries = [&](auto&& on_entry) {
+            auto const formats_count = unit.read<uint8_t>();
+            std::vector<std::pair<uint64_t, uint64_t>> formats(formats_count);
+            for(auto& format: formats) {
+              format.first = unit.uleb();
+              format.second = unit.uleb();
+            }
+            uint64_t const count = unit.uleb();
+            for(uint64_t i = 0; i != count && !unit.empty(); ++i) {
+              std::string path; uint64_t directory = 0;
+              for(auto const& format: formats) {
+                if(format.first == 1) // DW_LNCT_path
+                  read_form(format.second, &path);
+                else if(format.first == 2) // DW_LNCT_directory_index
+                  directory = read_form(format.second, nullptr);
+                else
+                  read_form(format.second, nullptr);
+              }
+              on_entry(path, directory);
+            }
+          };
+          read_entries([&](std::string const& path, uint64_t) { directories.push_back(path); });
+          read_entries([&](std::string const& path, uint64_t directory) {
+            unit_files.push_back(file(join(directory < directories.size() ? directories[directory] : "",
+                                           path.data())));
+          });
+        } else {
+          directories.emplace_back(); // compilation directory is in .debug_info
+          while(!unit.empty() && *unit.begin != 0)
+            directories.emplace_back(unit.string());
+          unit.read<uint8_t>();
+          unit_files.push_back(0); // files are numbered from 1
+          while(!unit.empty() && *unit.begin != 0) {
+            char const* name = unit.string();
+            uint64_t const directory = unit.uleb();
+            unit.uleb(); unit.uleb(); // time, size
+            unit_files.push_back(file(join(directory < directories.size() ? directories[directory] : "", name)));
+          }
+        }
+
+        run(program, version, address_size, minimum_instruction_length, line_base, line_range,
+            opcode_base, opcode_lengths, unit_files);
+      }
+    }
+
+
+    void run(cursor program, uint16_t version, uint8_t address_size, uint8_t minimum_instruction_length,
+             int8_t line_base, uint8_t line_range, uint8_t opcode_base,
+             std::vector<uint8_t> const& opcode_lengths, std::vector<uint32_t> const& unit_files) {
+      uint64_t address = 0, file_index = 1;
+      int64_t line = 1;
+      auto emit = [&](bool end_sequence) {
+        if(address == 0)
+          return; // discarded by linker
+        uint32_t const id = file_index < unit_files.size() ? unit_files[file_index] : 0;
+        lines_.push_back({address, id, end_sequence ? 0u : uint32_t(line > 0 ? line : 1)});
+      };
+      auto reset = [&] {
+        address = 0; file_index = 1; line = 1;
+      };
+      (void)version;
+
+      while(!program.empty()) {
+        auto const opcode = program.read<uint8_t>();
+        if(opcode >= opcode_base) {
+          unsigned const adjusted = opcode - opcode_base;
+          address += (adjusted / line_range) * minimum_instruction_length;
+          line += line_base + int(adjusted % line_range);
+          emit(false);
+          continue;
+        }
+        switch(opcode) {
+          case 0: {
+            uint64_t const length = program.uleb();
+            if(length == 0)
+              break;
+            auto const* next = program.begin + length;
+            auto const extended = program.read<uint8_t>();
+            if(extended == 1) { // DW_LNE_end_sequence
+              emit(true);
+              reset();
+            } else if(extended == 2) { // DW_LNE_set_address
+              address = program.read(length - 1 < 8 ? length - 1 : address_size);
+            }
+            program.begin = next < program.end ? next : program.end;
+            break;
+          }
+          case 1: emit(false); break; // DW_LNS_copy
+          case 2: address += program.uleb() * minimum_instruction_length; break;
+          case 3: line += program.sleb(); break;
+          case 4: file_index = program.uleb(); break;
+          case 5: program.uleb(); break; // column
+          case 6: case 7: case 10: case 11: break;
+          case 8: address += ((255 - opcode_base) / line_range) * minimum_instruction_length; break;
+          case 9: address += program.read<uint16_t>(); break;
+          default:
+            for(uint8_t i = 0; i != opcode_lengths[opcode - 1]; ++i)
+              program.uleb();
+        }
+      }
+    }
+  }; // index_builder
+
+
+  // Read-only view of cached index, either mmap'ed or freshly built
+
+  class symbol_index {
+  public:
+
+    struct location {
+      char const* function{nullptr};
+      uint64_t function_offset{0};
+      char const* file{nullptr};
+      uint32_t line{0};
+    };
+
+
+    bool load(std::string const& path) {
+      if(!file_.open(path))
+        return false;
+      return view(file_.bytes(), file_.size);
+    }
+
+
+    bool adopt(std::vector<char> blob) {
+      blob_ = std::move(blob);
+      return view(reinterpret_cast<unsigned char const*>(blob_.data()), blob_.size());
+    }
+
+
+    uint64_t min_vaddr() const { return header_->min_vaddr; }
+
+
+    location find(uint64_t address) const {
+      location result;
+      auto const* symbols_end = symbols_ + header_->symbols_count;
+      auto const* symbol = std::upper_bound(symbols_, symbols_end, address,
+        [](uint64_t a, index_symbol const& s) { return a < s.address; });
+      if(symbol != symbols_) {
+        --symbol;
+        auto const* next = symbol + 1;
+        bool const inside = symbol->size != 0 ? address < symbol->address + symbol->size
+                                              : next == symbols_end || address < next->address;
+        if(inside) {
+          result.function = strings_ + symbol->name;
+          result.function_offset = address - symbol->address;
+        }
+      }
+      auto const* lines_end = lines_ + header_->lines_count;
+      auto const* line = std::upper_bound(lines_, lines_end, address,
+        [](uint64_t a, index_line const& l) { return a < l.address; });
+      if(line != lines_ && (line - 1)->line != 0 && (line - 1)->file < header_->files_count) {
+        result.file = strings_ + files_[(line - 1)->file];
+        result.line = (line - 1)->line;
+      }
+      return result;
+    }
+
+  private:
+
+    mapped_file file_;
+    std::vector<char> blob_;
+    index_header const* header_{nullptr};
+    index_symbol const* symbols_{nullptr};
+    index_line const* lines_{nullptr};
+    uint64_t const* files_{nullptr};
+    char const* strings_{nullptr};
+
+
+    bool view(unsigned char const* data, size_t size) {
+      if(size < sizeof(index_header))
+        return false;
+      header_ = reinterpret_cast<index_header const*>(data);
+      if(std::memcmp(header_->magic, index_magic, sizeof(index_magic)) != 0)
+        return false;
+      size_t const expected = sizeof(index_header) + header_->symbols_count * sizeof(index_symbol)
+        + header_->lines_count * sizeof(index_line) + header_->files_count * sizeof(uint64_t)
+        + header_->strings_size;
+      if(expected != size)
+        return false;
+      symbols_ = reinterpret_cast<index_symbol const*>(data + sizeof(index_header));
+      lines_ = reinterpret_cast<index_line const*>(symbols_ + header_->symbols_count);
+      files_ = reinterpret_cast<uint64_t const*>(lines_ + header_->lines_count);
+      strings_ = reinterpret_cast<char const*>(files_ + header_->files_count);
+      return true;
+    }
+  }; // symbol_index
+
+
+  struct options {
+    std::string cache_dir;
+    std::vector<std::string> debug_dirs;
+    bool lines{true};
+  };
+
+
+  class symbolizer {
+  public:
+
+    explicit symbolizer(options o): options_{std::move(o)} { }
+
+
+    // Index of the module, nullptr if binary is not found
+
+    symbol_index const* index(std::string const& build_id, std::string const& path) {
+      std::string const key = build_id.empty() ? path : build_id;
+      auto const found = indexes_.find(key);
+      if(found != indexes_.end())
+        return found->second.get();
+      auto& slot = indexes_[key];
+
+      std::string const cache_path = build_id.empty() || options_.cache_dir.empty()
+        ? std::string{} : options_.cache_dir + '/' + build_id + ".idx";
+      auto index = std::make_unique<symbol_index>();
+      if(!cache_path.empty() && index->load(cache_path)) {
+        slot = std::move(index);
+        return slot.get();
+      }
+
+      elf_image image;
+      if(!open_binary(image, build_id, path))
+        return nullptr;
+      index_builder builder;
+      builder.build(image, options_.lines);
+      std::vector<char> blob = builder.serialize();
+      if(!cache_path.empty())
+        store(cache_path, blob);
+      index = std::make_unique<symbol_index>();
+      if(!index->adopt(std::move(blob)))
+        return nullptr;
+      slot = std::move(index);
+      return slot.get();
+    }
+
+  private:
+
+    options options_;
+    std::unordered_map<std::string, std::unique_ptr<symbol_index>> indexes_;
+
+
+    bool open_binary(elf_image& image, std::string const& build_id, std::string const& path) {
+      if(build_id.size() > 2)
+        for(auto const& dir: options_.debug_dirs) {
+          std::string const debug_path = dir + "/.build-id/" + build_id.substr(0, 2) + '/'
+                                       + build_id.substr(2) + ".debug";
+          if(image.open(debug_path))
+            return true;
+        }
+      if(!image.open(path))
+        return false;
+      if(!build_id.empty() && image.build_id() != build_id) {
+        std::cerr << "airbag-symbolize: build-id mismatch for " << path << '\n';
+        return false;
+      }
+      return true;
+    }
+
+
+    static void store(std::string const& path, std::vector<char> const& blob) {
+      std::string const temporary = path + '.' + std::to_string(getpid());
+      {
+        std::ofstream out{temporary, std::ios::binary};
+        out.write(blob.data(), std::streamsize(blob.size()));
+        if(!out)
+          return;
+      }
+      std::rename(temporary.data(), path.data());
+    }
+  }; // symbolizer
+
+
+  struct module {
+    uint64_t base;
+    uint64_t size;
+    std::string build_id;
+    std::string path;
+  };
+
+
+  std::string demangle(char const* name) {
+    int status = 0;
+    std::unique_ptr<char, decltype(&std::free)> demangled{
+      abi::__cxa_demangle(name, nullptr, nullptr, &status), &std::free};
+    return status == 0 && demangled ? demangled.get() : name;
+  }
+
+
+  void symbolize(std::istream& in, std::ostream& out, symbolizer& s) {
+    enum { other, modules, frames } section = other;
+    std::vector<module> loaded;
+    unsigned frame_number = 0;
+    std::string line;
+
+    while(std::getline(in, line)) {
+      if(line.empty() || line[0] != ' ') {
+        section = line == "modules" ? modules : line == "frames" ? frames : other;
+        out << line << '\n';
+        continue;
+      }
+      if(section == modules) {
+        module m;
+        char build_id[129] = {}; char path[4097] = {};
+        if(std::sscanf(line.data(), " %lx %lx %128s %4096[^\n]", &m.base, &m.size, build_id, path) == 4) {
+          m.build_id = std::strcmp(build_id, "-") == 0 ? "" : build_id;
+          m.path = path;
+          loaded.push_back(std::move(m));
+        }
+        out << line << '\n';
+        continue;
+      }
+      if(section != frames) {
+        out << line << '\n';
+        continue;
+      }
+
+      uint64_t address = 0;
+      if(std::sscanf(line.data(), " %lx", &address) != 1) {
+        out << line << '\n';
+        continue;
+      }
+      unsigned const number = frame_number++;
+      out << "  #" << number << ' ' << line.substr(line.find_first_not_of(' '));
+      // Return addresses point after the call instruction
+      uint64_t const lookup = number == 0 ? address : address - 1;
+      auto const found = std::find_if(loaded.begin(), loaded.end(), [lookup](module const& m) {
+        return lookup >= m.base && lookup - m.base < m.size;
+      });
+      if(found == loaded.end()) {
+        out << '\n';
+        continue;
+      }
+      symbol_index const* index = s.index(found->build_id, found->path);
+      if(index != nullptr) {
+        auto const location = index->find(lookup - found->base + index->min_vaddr());
+        if(location.function != nullptr)
+          out << " in " << demangle(location.function) << "+0x" << std::hex
+              << location.function_offset << std::dec;
+        if(location.file != nullptr)
+          out << " at " << location.file << ':' << location.line;
+      }
+      auto const slash = found->path.rfind('/');
+      out << " (" << found->path.substr(slash == std::string::npos ? 0 : slash + 1)
+          << "+0x" << std::hex << address - found->base << std::dec << ")\n";
+    }
+  }
+
+
+  std::string default_cache_dir() {
+    char const* cache = std::getenv("XDG_CACHE_HOME");
+    if(cache != nullptr && *cache != '\0')
+      return std::string{cache} + "/airbag";
+    char const* home = std::getenv("HOME");
+    if(home != nullptr && *home != '\0')
+      return std::string{home} + "/.cache/airbag";
+    return {};
+  }
+
+
+  void create_directories(std::string const& path) {
+    for(size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+      mkdir(path.substr(0, slash).data(), 0755);
+      if(slash == std::string::npos)
+        break;
+    }
+  }
+
+
+} // namespace
+
+
+int main(int argc, char** argv) {
+
+  options o;
+  o.cache_dir = default_cache_dir();
+  std::vector<std::string> reports;
+
+  for(int i = 1; i < argc; ++i) {
+    std::string_view const argument = argv[i];
+    if(argument == "--cache" && i + 1 < argc)
+      o.cache_dir = argv[++i];
+    else if(argument == "--no-cache")
+      o.cache_dir.clear();
+    else if(argument == "--debug-dir" && i + 1 < argc)
+      o.debug_dirs.emplace_back(argv[++i]);
+    else if(argument == "--no-lines")
+      o.lines = false;
+    else if(argument == "--help" || argument == "-h") {
+      std::cout << "usage: airbag-symbolize [--cache DIR] [--no-cache] [--debug-dir DIR]... "
+                   "[--no-lines] [report...]\n";
+      return 0;
+    } else
+      reports.emplace_back(argument);
+  }
+  if(o.debug_dirs.empty())
+    o.debug_dirs.emplace_back("/usr/lib/debug");
+  if(!o.cache_dir.empty())
+    create_directories(o.cache_dir);
+
+  symbolizer s{std::move(o)};
+
+  if(reports.empty()) {
+    symbolize(std::cin, std::cout, s);
+    return 0;
+  }
+
+  int result = 0;
+  for(auto const& report: reports) {
+    std::ifstream in{report};
+    if(!in) {
+      std::cerr << "airbag-symbolize: unable to open " << report << '\n';
+      result = 1;
+      continue;
+    }
+    if(reports.size() > 1)
+      std::cout << "==> " << report << " <==\n";
+    symbolize(in, std::cout, s);
+  }
+  return result;
+}
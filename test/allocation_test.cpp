@@ -0,0 +1,134 @@
+#include <airbag/thread_error.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <new>
+
+
+// Counts both operator new and malloc, the latter is used by C++ runtime for exceptions
+
+extern "C" void* __libc_malloc(size_t);
+
+static thread_local bool volatile counting = false;
+static thread_local bool volatile exhausted = false;
+static thread_local size_t volatile news = 0, mallocs = 0, malloc_bytes = 0;
+
+extern "C" void* malloc(size_t size) {
+  if(counting) {
+    ++mallocs;
+    malloc_bytes += size;
+    if(exhausted)
+      return nullptr;
+  }
+  return __libc_malloc(size);
+}
+
+void* operator new(size_t size) {
+  if(counting)
+    ++news;
+  void* const p = malloc(size);
+  if(p == nullptr)
+    throw std::bad_alloc{};
+  return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+
+__attribute__((noinline)) int deref(int const volatile* p) {
+  return *p;
+}
+
+
+__attribute__((noinline)) int deref_other(int const volatile* p) {
+  return *p + 1;
+}
+
+
+struct scope {
+  scope(bool exhaust = false) {
+    news = mallocs = malloc_bytes = 0;
+    exhausted = exhaust;
+    counting = true;
+  }
+  ~scope() { counting = false; exhausted = false; }
+};
+
+
+int main(int, char**) {
+
+  thread_local airbag::thread_error thread_error;
+  int failures = 0;
+
+  {
+    scope counted;
+    airbag::thread_error e{"Access violation", airbag::system_failure{}};
+    airbag::thread_error copy{e};
+    counting = false;
+    printf("construct and copy: %zu new, %zu malloc\n", news, mallocs);
+    if(news + mallocs != 0 || copy.what()[0] != 'A')
+      ++failures;
+  }
+
+  for(bool exhaust: {false, true}) {
+    bool caught = false;
+    {
+      scope counted{exhaust};
+      try {
+        deref(nullptr);
+      } catch(airbag::thread_error const& e) {
+        counting = false; // releasing the exception refills the reserve
+        caught = e.failure().code() == SIGSEGV;
+      }
+    }
+    printf("%s fault: %s, %zu new, %zu malloc (%zu bytes)\n",
+           exhaust ? "exhausted heap" : "translated",
+           caught ? "caught" : "missed", news, mallocs, malloc_bytes);
+    if(!caught || news != 0 || malloc_bytes > 256)
+      ++failures;
+  }
+
+  // Faults kept by exception_ptr, more of them than reserved objects, do not
+  // change with the next faults
+  {
+    constexpr int kept_count = 16;
+    std::exception_ptr kept[kept_count];
+    void* kept_addresses[kept_count] = {};
+    for(int i = 0; i != kept_count + 1; ++i) {
+      scope counted;
+      try {
+        (i % 2 == 0 ? deref : deref_other)(nullptr);
+      } catch(airbag::thread_error const& e) {
+        counting = false;
+        if(i != kept_count) {
+          kept[i] = std::current_exception();
+          kept_addresses[i] = e.failure().address();
+        }
+      }
+    }
+    int unchanged = 0;
+    for(int i = 0; i != kept_count; ++i)
+      try {
+        std::rethrow_exception(kept[i]);
+      } catch(airbag::thread_error const& e) {
+        unchanged += e.failure().address() == kept_addresses[i] && kept_addresses[i] != nullptr;
+      } catch(...) {
+      }
+    printf("kept faults: %d of %d unchanged\n", unchanged, kept_count);
+    if(unchanged != kept_count)
+      ++failures;
+  }
+
+  {
+    scope counted;
+    try {
+      throw airbag::thread_error{"Plain", airbag::system_failure{}};
+    } catch(airbag::thread_error const&) { }
+    counting = false;
+    printf("plain throw: %zu new, %zu malloc (%zu bytes)\n", news, mallocs, malloc_bytes);
+  }
+
+  printf(failures == 0 ? "passed\n" : "FAILED\n");
+  return failures;
+}
@@ -0,0 +1,143 @@
+#include <airbag/process_error.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// Each scenario runs in a child process, which is expected to die.
+// Application alarm must be left alone by handler budget
+
+constexpr unsigned threads_count = 128;
+
+static int report_fd = -1;
+static std::atomic<unsigned> hooks{0};
+
+
+enum class scenario { storm, hang, recursive };
+
+
+// Store through null literal is undefined and dropped by optimizer
+static int volatile* volatile bad_pointer = nullptr;
+
+
+__attribute__((noinline)) void fault() {
+  *bad_pointer = 1;
+}
+
+
+static void hook(void* context, airbag::system_failure const&) {
+  unsigned const calls = hooks.fetch_add(1) + 1;
+  switch(*static_cast<scenario*>(context)) {
+    case scenario::storm:
+      std::this_thread::sleep_for(std::chrono::milliseconds(300));
+      break;
+    case scenario::hang:
+      for(;;)
+        pause();
+    case scenario::recursive:
+      fault();
+      break;
+  }
+  char report[64];
+  unsigned const application_alarm = alarm(0);
+  int const n = snprintf(report, sizeof(report), "%u %zu %u\n", calls,
+                         airbag::process_error::visit_secondary_faults([](auto const&) { }),
+                         application_alarm);
+  ssize_t const written = write(report_fd, report, size_t(n));
+  (void)written;
+}
+
+
+[[noreturn]] static void crash(scenario s) {
+  static scenario current;
+  current = s;
+  airbag::process_error::handler_budget(std::chrono::seconds{1});
+  airbag::process_error::add_system_failure_handler(&hook, &current);
+  alarm(1000);
+  std::atomic<unsigned> ready{0};
+  std::vector<std::thread> threads;
+  unsigned const n = s == scenario::storm ? threads_count : 1;
+  for(unsigned i = 0; i != n; ++i)
+    threads.emplace_back([&] {
+      ready.fetch_add(1);
+      while(ready.load() != n)
+        std::this_thread::yield();
+      fault();
+    });
+  for(auto& each: threads)
+    each.join();
+  _exit(0);
+}
+
+
+struct outcome {
+  int signal{0};
+  unsigned hooks{0};
+  size_t secondary{0};
+  unsigned alarm{0};
+  double seconds{0};
+};
+
+
+static outcome run(scenario s) {
+  int channel[2];
+  if(pipe(channel) != 0)
+    return {};
+  auto const started = std::chrono::steady_clock::now();
+  pid_t const child = fork();
+  if(child == 0) {
+    close(channel[0]);
+    report_fd = channel[1];
+    crash(s);
+  }
+  close(channel[1]);
+  outcome result;
+  int status = 0;
+  for(int waited = 0; waitpid(child, &status, WNOHANG) == 0; ++waited) {
+    if(waited == 10'000) { // 10 seconds
+      kill(child, SIGKILL);
+      waitpid(child, &status, 0);
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  if(WIFSIGNALED(status))
+    result.signal = WTERMSIG(status);
+  char report[64] = {};
+  if(read(channel[0], report, sizeof(report) - 1) > 0)
+    sscanf(report, "%u %zu %u", &result.hooks, &result.secondary, &result.alarm);
+  close(channel[0]);
+  return result;
+}
+
+
+int main(int, char**) {
+
+  int failures = 0;
+
+  outcome const storm = run(scenario::storm);
+  printf("%u threads faulting: %u hook call, %zu secondary faults, alarm %u s left, died by signal %d in %.2f s\n",
+         threads_count, storm.hooks, storm.secondary, storm.alarm, storm.signal, storm.seconds);
+  if(storm.signal != SIGSEGV || storm.hooks != 1 || storm.secondary == 0 || storm.alarm < 990
+     || storm.seconds > 2)
+    ++failures;
+
+  outcome const hang = run(scenario::hang);
+  printf("hanging hook: died by signal %d in %.2f s\n", hang.signal, hang.seconds);
+  if(hang.signal != SIGABRT || hang.seconds > 3)
+    ++failures;
+
+  outcome const recursive = run(scenario::recursive);
+  printf("faulting hook: died by signal %d in %.2f s\n", recursive.signal, recursive.seconds);
+  if(recursive.signal != SIGSEGV || recursive.seconds > 2)
+    ++failures;
+
+  printf(failures == 0 ? "passed\n" : "FAILED\n");
+  return failures;
+}
@@ -0,0 +1,97 @@
+#include <airbag/process_error.hpp>
+#include <airbag/minidump.hpp>
+#include <airbag/crash_report.hpp>
+#include <airbag/crash_index.hpp>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// Minidump and crash report prepared in one directory must not share spool.
+// Directory budget removes their files, never foreign ones kept there
+
+static int volatile* volatile bad_pointer = nullptr;
+
+
+[[noreturn]] static void crash(std::filesystem::path const& dir) {
+  static airbag::minidump minidump{dir};
+  static airbag::crash_report crash_report{dir};
+  if(!minidump.prepare(1 << 20) || !crash_report.prepare())
+    _exit(2);
+  airbag::process_error process_error;
+  process_error.pre_system_failure([](airbag::system_failure const& f) {
+    minidump.generate(f);
+    crash_report.generate(f);
+  });
+  *bad_pointer = 1;
+  _exit(0);
+}
+
+
+static bool starts_with(std::filesystem::path const& path, char const* magic) {
+  std::FILE* file = std::fopen(path.string().data(), "rb");
+  if(file == nullptr)
+    return false;
+  char head[32] = {};
+  size_t const n = std::strlen(magic);
+  bool const matched = std::fread(head, 1, n, file) == n && std::memcmp(head, magic, n) == 0;
+  std::fclose(file);
+  return matched;
+}
+
+
+int main(int, char** argv) {
+
+  namespace fs = std::filesystem;
+  fs::path const dir = fs::temp_directory_path() / ("airbag-dump-files-" + std::to_string(getpid()));
+  fs::remove_all(dir);
+
+  pid_t const child = fork();
+  if(child == 0)
+    crash(dir);
+  int status = 0;
+  waitpid(child, &status, 0);
+
+  unsigned dumps = 0, reports = 0, failures = 0;
+  for(auto const& each: fs::directory_iterator{dir}) {
+    auto const extension = each.path().extension();
+    if(extension == ".dmp") {
+      ++dumps;
+      bool const valid = starts_with(each.path(), "MDMP");
+      printf("%s: %s\n", each.path().filename().string().data(), valid ? "minidump" : "not a minidump");
+      failures += !valid;
+    } else if(extension == ".txt") {
+      ++reports;
+      bool const valid = starts_with(each.path(), "airbag crash report");
+      printf("%s: %s\n", each.path().filename().string().data(), valid ? "crash report" : "not a crash report");
+      failures += !valid;
+    }
+  }
+
+  // Budget of one file leaves one of dump and report and all foreign files
+  std::string const prefix = fs::path{argv[0]}.stem().string();
+  std::string const foreign[] = {"notes.txt", "core.dmp", "other-1.dmp.spool", prefix + "-server.dmp"};
+  for(auto const& name: foreign)
+    std::fclose(std::fopen((dir / name).string().data(), "wb"));
+  airbag::crash_index index;
+  index.enforce(dir, prefix, {0, 1});
+  unsigned kept = 0, own = 0;
+  for(auto const& name: foreign)
+    kept += fs::exists(dir / name);
+  for(auto const& each: fs::directory_iterator{dir}) // dead spools are gone too
+    own += each.path().filename() != airbag::crash_index::file_name;
+  own -= kept;
+  printf("budget of one file: %u own files left, %u of %zu foreign files kept\n",
+         own, kept, sizeof(foreign) / sizeof(foreign[0]));
+  if(own != 1 || kept != sizeof(foreign) / sizeof(foreign[0]))
+    ++failures;
+  fs::remove_all(dir);
+
+  if(!WIFSIGNALED(status) || dumps != 1 || reports != 1)
+    ++failures;
+  printf(failures == 0 ? "passed\n" : "FAILED\n");
+  return int(failures);
+}
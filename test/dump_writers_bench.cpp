@@ -0,0 +1,56 @@
+#include <airbag/minidump_writer.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+// dump_writers_bench [heap MB] [directory]
+
+int main(int argc, char** argv) {
+
+  size_t const heap = size_t(argc > 1 ? std::atoi(argv[1]) : 2048) << 20;
+  std::string const directory = argc > 2 ? argv[2] : "/tmp";
+
+  void* arena = mmap(nullptr, heap, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(arena == MAP_FAILED)
+    return 1;
+  for(size_t i = 0; i < heap; i += 4096)
+    static_cast<char*>(arena)[i] = char(i >> 12 | 1);
+
+  airbag::module_map::refresh();
+  airbag::stack_trace::register_thread();
+  ucontext_t context;
+  getcontext(&context);
+  siginfo_t info{};
+  info.si_signo = SIGSEGV;
+  airbag::system_failure const failure{&info, &context};
+
+  std::string const path = directory + "/airbag-writers-bench.dmp";
+  for(size_t writers: {1, 2, 4, 8, 16}) {
+    auto workers = writers == 1 ? nullptr : std::make_unique<airbag::dump_workers>(writers - 1);
+    int const fd = open(path.data(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1)
+      return 1;
+    airbag::minidump_writer::options o;
+    o.workers = workers.get();
+    airbag::minidump_writer writer{fd, o};
+    auto const started = std::chrono::steady_clock::now();
+    uint64_t const size = writer.write(failure);
+    fdatasync(fd);
+    auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    close(fd);
+    unlink(path.data());
+    printf("%2zu writers: %llu MB in %.2f s, %.0f MB/s\n", writers,
+           (unsigned long long)(size >> 20), elapsed, double(size >> 20) / elapsed);
+  }
+
+  munmap(arena, heap);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include <airbag/process_error.hpp>
+#include <chrono>
+#include <cstdio>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+// Runtime (GC, JVM) installed before airbag: faults on its guard page are
+// handled by opening the page, the runtime closes it again afterwards
+
+constexpr unsigned faults = 100'000;
+
+static char* guard_page;
+static size_t page_size;
+static unsigned hooks = 0;
+
+
+static void runtime_handler(int, siginfo_t* info, void*) {
+  char* const address = static_cast<char*>(info->si_addr);
+  if(address >= guard_page && address < guard_page + page_size)
+    mprotect(guard_page, page_size, PROT_READ | PROT_WRITE);
+  else
+    _exit(3);
+}
+
+
+using clock_type = std::chrono::steady_clock;
+
+static double fault_ns() {
+  auto const started = clock_type::now();
+  for(unsigned i = 0; i != faults; ++i) {
+    mprotect(guard_page, page_size, PROT_NONE);
+    *static_cast<char volatile*>(guard_page) = char(i);
+  }
+  return std::chrono::duration<double, std::nano>(clock_type::now() - started).count() / faults;
+}
+
+
+int main(int, char**) {
+
+  page_size = size_t(sysconf(_SC_PAGESIZE));
+  guard_page = static_cast<char*>(mmap(nullptr, page_size, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = &runtime_handler;
+  action.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &action, nullptr);
+
+  printf("runtime only: %.0f ns/fault\n", fault_ns());
+
+  airbag::process_error::add_system_failure_handler([](void*, airbag::system_failure const&) {
+    ++hooks;
+  }, nullptr);
+  double elapsed = fault_ns();
+  printf("airbag chaining, hooks called: %.0f ns/fault (%u hooks)\n", elapsed, hooks);
+
+  hooks = 0;
+  airbag::fault_filter::add(guard_page, page_size);
+  elapsed = fault_ns();
+  printf("airbag chaining, filtered: %.0f ns/fault (%u hooks)\n", elapsed, hooks);
+
+  auto const started = clock_type::now();
+  unsigned found = 0;
+  for(unsigned i = 0; i != faults * 100; ++i)
+    found += airbag::fault_filter::contains(uintptr_t(guard_page) + (i & 63));
+  printf("fault_filter::contains: %.1f ns\n",
+         std::chrono::duration<double, std::nano>(clock_type::now() - started).count() / (faults * 100));
+
+  return found == faults * 100 ? 0 : 1;
+}
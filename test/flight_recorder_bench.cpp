@@ -0,0 +1,46 @@
+#include <airbag/flight_recorder.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+
+int main(int, char**) {
+
+  constexpr unsigned records = 1'000'000; // per thread
+  unsigned const cores = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+
+  for(unsigned threads_count: {1u, 8u, 64u}) {
+
+    std::vector<std::thread> threads;
+    std::atomic<unsigned> ready{0};
+    std::atomic_bool go{false};
+
+    for(unsigned t = 0; t != threads_count; ++t)
+      threads.emplace_back([t, &ready, &go] {
+        airbag::flight_recorder::record(0); // attach
+        ++ready;
+        while(!go)
+          std::this_thread::yield();
+        for(unsigned i = 0; i != records; ++i)
+          airbag::flight_recorder::record(i, t, i);
+      });
+
+    while(ready != threads_count)
+      std::this_thread::yield();
+    auto const started = std::chrono::steady_clock::now();
+    go = true;
+    for(auto& thread: threads)
+      thread.join();
+    auto const elapsed = std::chrono::steady_clock::now() - started;
+
+    // Wall time multiplied by busy cores gives cost of one record on one core
+    unsigned const busy = threads_count < cores ? threads_count : cores;
+    double const cost = std::chrono::duration<double, std::nano>(elapsed).count() * busy
+                      / (double(records) * threads_count);
+    printf("%2u threads on %u cores: %.2f ns/record\n", threads_count, busy, cost);
+  }
+
+  return 0;
+}
@@ -0,0 +1,80 @@
+#include <airbag/guarded.hpp>
+#include <airbag/thread_error.hpp>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+
+constexpr unsigned calls = 10'000'000;
+constexpr unsigned faults = 100'000;
+
+
+using clock_type = std::chrono::steady_clock;
+
+double elapsed_ns(clock_type::time_point started, unsigned n) {
+  return std::chrono::duration<double, std::nano>(clock_type::now() - started).count() / n;
+}
+
+
+// Faults when record is null
+__attribute__((noinline)) int parse(int const* record) {
+  return *record + 1;
+}
+
+
+int main(int, char**) {
+
+  thread_local airbag::thread_error thread_error;
+  thread_error.on_terminate([](char const* message) {
+    fprintf(stderr, "%s\n", message);
+  });
+
+  int value = 41;
+  int const* volatile good = &value;
+  int const* volatile bad = nullptr;
+  long long sum = 0;
+
+  auto started = clock_type::now();
+  for(unsigned i = 0; i != calls; ++i)
+    sum += parse(good);
+  printf("plain call: %.2f ns\n", elapsed_ns(started, calls));
+
+  started = clock_type::now();
+  for(unsigned i = 0; i != calls; ++i)
+    try {
+      sum += parse(good);
+    } catch(airbag::thread_error const&) {
+      --sum;
+    }
+  printf("try/catch call: %.2f ns\n", elapsed_ns(started, calls));
+
+  started = clock_type::now();
+  for(unsigned i = 0; i != calls; ++i) {
+    auto const r = airbag::guarded([&] { return parse(good); });
+    sum += r ? *r : -1;
+  }
+  printf("guarded call: %.2f ns\n", elapsed_ns(started, calls));
+
+  unsigned caught = 0;
+  started = clock_type::now();
+  for(unsigned i = 0; i != faults; ++i)
+    try {
+      sum += parse(bad);
+    } catch(airbag::thread_error const&) {
+      ++caught;
+    }
+  printf("thread_error fault: %.0f ns (%u caught)\n", elapsed_ns(started, faults), caught);
+
+  unsigned failed = 0;
+  started = clock_type::now();
+  for(unsigned i = 0; i != faults; ++i) {
+    auto const r = airbag::guarded([&] { return parse(bad); });
+    if(r)
+      sum += *r;
+    else
+      ++failed;
+  }
+  printf("guarded fault: %.0f ns (%u failed)\n", elapsed_ns(started, faults), failed);
+
+  return sum == 0;
+}
@@ -0,0 +1,88 @@
+#include <airbag/process_error.hpp>
+#include <airbag/guarded.hpp>
+#include <atomic>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// Guarded faults are recovered without crash hooks whichever of process_error
+// and thread_error installs its signal handlers first. Each order runs in
+// its own child process, as handlers are installed once per process.
+// Faults taken by a handler installed before process_error, which leaves
+// by siglongjmp, run hooks each time
+
+constexpr unsigned faults = 1000;
+
+static int volatile* volatile bad_pointer = nullptr;
+static std::atomic<unsigned> hooks{0};
+static thread_local sigjmp_buf recovery;
+
+
+static int fault() {
+  return *bad_pointer;
+}
+
+
+[[noreturn]] static void run(bool guarded_first) {
+  airbag::process_error process_error;
+  if(guarded_first && airbag::guarded(&fault))
+    _exit(2);
+  process_error.pre_system_failure([](airbag::system_failure const&) { ++hooks; });
+  for(unsigned i = 0; i != faults; ++i)
+    if(airbag::guarded(&fault))
+      _exit(2);
+  _exit(hooks == 0 ? 0 : 1);
+}
+
+
+[[noreturn]] static void run_foreign() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = [](int) { siglongjmp(recovery, 1); };
+  action.sa_flags = SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, nullptr);
+  airbag::process_error process_error;
+  process_error.pre_system_failure([](airbag::system_failure const&) { ++hooks; });
+  for(unsigned i = 0; i != faults; ++i)
+    if(sigsetjmp(recovery, 1) == 0)
+      if(fault() != -1)
+        _exit(2);
+  _exit(hooks == faults ? 0 : 1);
+}
+
+
+int main(int, char**) {
+
+  int failures = 0;
+  for(bool guarded_first: {true, false}) {
+    pid_t const child = fork();
+    if(child == 0)
+      run(guarded_first);
+    int status = 0;
+    waitpid(child, &status, 0);
+    bool const passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("%s installed first, %u guarded faults: %s\n",
+           guarded_first ? "thread_error" : "process_error", faults,
+           passed ? "recovered without hooks"
+                  : WIFSIGNALED(status) ? "died" : "hooks called");
+    failures += !passed;
+  }
+
+  pid_t const child = fork();
+  if(child == 0)
+    run_foreign();
+  int status = 0;
+  waitpid(child, &status, 0);
+  bool const passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  printf("siglongjmp handler installed first, %u faults: %s\n", faults,
+         passed ? "hooks called for each" : WIFSIGNALED(status) ? "died" : "hooks missed");
+  failures += !passed;
+
+  printf(failures == 0 ? "passed\n" : "FAILED\n");
+  return failures;
+}
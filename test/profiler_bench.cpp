@@ -0,0 +1,110 @@
+#include <airbag/profiler.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <time.h>
+
+
+constexpr unsigned threads_count = 64;
+
+
+double cpu_seconds(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return double(ts.tv_sec) + double(ts.tv_nsec) / 1e9;
+}
+
+
+__attribute__((noinline)) unsigned leaf(unsigned x, unsigned n) {
+  for(unsigned i = 0; i != n; ++i) {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  }
+  return x;
+}
+
+
+__attribute__((noinline)) unsigned parse(unsigned x, unsigned n) {
+  return leaf(x, n / 4) + leaf(x + 1, n - n / 4);
+}
+
+
+__attribute__((noinline)) unsigned work(unsigned x, unsigned n) {
+  return parse(x, n / 2) ^ leaf(x, n - n / 2);
+}
+
+
+// CPU seconds spent by threads doing the same work, measured by each thread
+// around its work only. Profiled threads register themselves
+
+double run(unsigned iterations, bool profiled) {
+  std::vector<std::thread> threads;
+  std::atomic<unsigned> ready{0};
+  std::atomic_bool go{false};
+  std::atomic<unsigned> sink{0};
+  std::vector<double> spent(threads_count);
+  for(unsigned t = 0; t != threads_count; ++t)
+    threads.emplace_back([&, t] {
+      if(profiled)
+        airbag::profiler::register_thread();
+      ++ready;
+      while(!go)
+        std::this_thread::yield();
+      double const started = cpu_seconds(CLOCK_THREAD_CPUTIME_ID);
+      sink += work(t + 1, iterations);
+      spent[t] = cpu_seconds(CLOCK_THREAD_CPUTIME_ID) - started;
+    });
+  while(ready != threads_count)
+    std::this_thread::yield();
+  go = true;
+  for(auto& thread: threads)
+    thread.join();
+  double total = sink == 0 ? 1e-12 : 0.;
+  for(double each: spent)
+    total += each;
+  return total;
+}
+
+
+double median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+
+int main(int argc, char** argv) {
+
+  constexpr unsigned iterations = 10'000'000; // per thread
+  constexpr unsigned rounds = 5;
+  airbag::profiler profiler;
+  profiler.frequency(100);
+
+  // Rounds alternate to spread noise of the machine evenly
+  std::vector<double> plain, sampled;
+  for(unsigned round = 0; round != rounds; ++round) {
+    plain.push_back(run(iterations, false));
+    profiler.start();
+    sampled.push_back(run(iterations, true));
+    profiler.stop();
+  }
+  double const p = median(plain), s = median(sampled);
+  double total = 0;
+  for(double each: sampled)
+    total += each;
+  printf("%u threads at 100 Hz: %.3f s plain, %.3f s sampled (%+.2f%%)\n",
+         threads_count, p, s, (s - p) / p * 100);
+  printf("%llu samples in %.1f CPU seconds (%.0f Hz), %llu dropped\n",
+         (unsigned long long)profiler.samples(), total, double(profiler.samples()) / total,
+         (unsigned long long)profiler.dropped());
+
+  if(argc > 1) {
+    std::FILE* file = std::fopen(argv[1], "w");
+    if(file == nullptr || !profiler.write_collapsed(file))
+      return 1;
+    std::fclose(file);
+  }
+
+  return 0;
+}
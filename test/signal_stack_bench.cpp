@@ -0,0 +1,117 @@
+#include <airbag/signal_stack.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
+
+
+// Resident set and number of mappings of the process
+size_t resident_kb() {
+  std::FILE* file = std::fopen("/proc/self/statm", "r");
+  unsigned long size = 0, resident = 0;
+  if(file == nullptr)
+    return 0;
+  if(std::fscanf(file, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  std::fclose(file);
+  return size_t(resident) * size_t(sysconf(_SC_PAGESIZE)) / 1024;
+}
+
+
+size_t mappings() {
+  std::FILE* file = std::fopen("/proc/self/maps", "r");
+  if(file == nullptr)
+    return 0;
+  size_t lines = 0;
+  for(int c = std::fgetc(file); c != EOF; c = std::fgetc(file))
+    lines += c == '\n';
+  std::fclose(file);
+  return lines;
+}
+
+
+// Handler running on alternate stack uses some of it, like fault handlers do
+void on_signal(int) {
+  char volatile scratch[8 * 1024];
+  for(size_t i = 0; i != sizeof(scratch); i += 512)
+    scratch[i] = char(i);
+}
+
+
+struct measure {
+  size_t resident_kb;
+  size_t mappings;
+  double elapsed_ms; // to start and join all threads
+};
+
+
+// Starts threads, measures the process while they are alive and lets them go
+measure run(unsigned count, bool alternate) {
+  auto const started = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable changed;
+  unsigned ready = 0;
+  bool go = false;
+  for(unsigned t = 0; t != count; ++t)
+    threads.emplace_back([&] {
+      if(alternate) {
+        airbag::signal_stack::ensure();
+        raise(SIGUSR2);
+      }
+      std::unique_lock<std::mutex> lock{mutex};
+      ++ready;
+      changed.notify_all();
+      changed.wait(lock, [&] { return go; });
+    });
+  std::unique_lock<std::mutex> lock{mutex};
+  changed.wait(lock, [&] { return ready == count; });
+  measure m{resident_kb(), mappings(), 0};
+  go = true;
+  lock.unlock();
+  changed.notify_all();
+  for(auto& thread: threads)
+    thread.join();
+  m.elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+  return m;
+}
+
+
+int main(int argc, char** argv) {
+
+  unsigned const count = argc > 1 ? unsigned(std::atoi(argv[1])) : 2000;
+
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = &on_signal;
+  action.sa_flags = SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR2, &action, nullptr);
+
+  measure const idle{resident_kb(), mappings(), 0};
+  measure const plain = run(count, false);
+  measure const first = run(count, true);
+  measure const after{resident_kb(), mappings(), 0};
+  measure const second = run(count, true);
+
+  auto per_thread = [&](measure const& m) {
+    return double(m.resident_kb - idle.resident_kb) / count;
+  };
+  printf("%u threads without alternate stacks: %.1f KB RSS per thread, %zu mappings, %.0f ms\n",
+         count, per_thread(plain), plain.mappings, plain.elapsed_ms);
+  printf("with alternate stacks: %.1f KB RSS per thread, %zu mappings, %.0f ms\n",
+         per_thread(first), first.mappings, first.elapsed_ms);
+  printf("after exit: %zu KB RSS, %zu mappings, %zu stacks mapped, %zu in use\n",
+         after.resident_kb, after.mappings, airbag::signal_stack::mapped(),
+         airbag::signal_stack::in_use());
+  printf("recycled: %.1f KB RSS per thread, %zu mappings, %zu stacks mapped, %.0f ms\n",
+         per_thread(second), second.mappings, airbag::signal_stack::mapped(), second.elapsed_ms);
+
+  return 0;
+}
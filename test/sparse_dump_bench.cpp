@@ -0,0 +1,63 @@
+#include <airbag/minidump_writer.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+constexpr size_t reserved = size_t(512) << 20;
+constexpr size_t touched = size_t(32) << 20;
+
+
+void measure(char const* title, airbag::system_failure const& failure, bool sparse) {
+  char path[] = "/tmp/airbag-sparse-XXXXXX";
+  int const fd = mkstemp(path);
+  if(fd == -1)
+    return;
+  airbag::minidump_writer::options o;
+  o.sparse = sparse;
+  airbag::minidump_writer writer{fd, o};
+  auto const started = std::chrono::steady_clock::now();
+  uint64_t const size = writer.write(failure);
+  ftruncate(fd, off_t(size));
+  fsync(fd);
+  auto const elapsed = std::chrono::steady_clock::now() - started;
+  struct stat file;
+  fstat(fd, &file);
+  auto const& s = writer.last_statistics();
+  printf("%s: %.1f ms, size %llu MB, on disk %llu MB, scanned %llu MB, written %llu MB\n",
+         title, std::chrono::duration<double, std::milli>(elapsed).count(),
+         (unsigned long long)(size >> 20), (unsigned long long)(uint64_t(file.st_blocks) * 512 >> 20),
+         (unsigned long long)(s.scanned >> 20), (unsigned long long)(s.written >> 20));
+  close(fd);
+  unlink(path);
+}
+
+
+int main(int, char**) {
+
+  // Big arena, a quarter of touched part is zero
+  void* arena = mmap(nullptr, reserved, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(arena == MAP_FAILED)
+    return 1;
+  std::memset(arena, 0x5A, touched * 3 / 4);
+  std::memset(static_cast<char*>(arena) + touched * 3 / 4, 0, touched / 4);
+
+  airbag::module_map::refresh();
+  airbag::stack_trace::register_thread();
+  ucontext_t context;
+  getcontext(&context);
+  siginfo_t info{};
+  info.si_signo = SIGSEGV;
+  airbag::system_failure const failure{&info, &context};
+
+  measure("full", failure, false);
+  measure("sparse", failure, true);
+
+  munmap(arena, reserved);
+  return 0;
+}
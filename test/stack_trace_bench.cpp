@@ -0,0 +1,45 @@
+#include <airbag/stack_trace.hpp>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+
+constexpr unsigned captures = 100'000;
+
+
+__attribute__((noinline)) size_t measure(double& cost) {
+  ucontext_t context;
+  getcontext(&context);
+  void* frames[airbag::stack_trace::capacity];
+  size_t count = 0;
+  auto const started = std::chrono::steady_clock::now();
+  for(unsigned i = 0; i != captures; ++i)
+    count = airbag::stack_trace::capture(context, frames, airbag::stack_trace::capacity);
+  auto const elapsed = std::chrono::steady_clock::now() - started;
+  cost = std::chrono::duration<double, std::nano>(elapsed).count() / captures;
+  return count;
+}
+
+
+__attribute__((noinline)) size_t nested(unsigned depth, double& cost) {
+  if(depth == 0)
+    return measure(cost);
+  size_t const count = nested(depth - 1, cost);
+  asm volatile("" ::: "memory"); // no tail call
+  return count;
+}
+
+
+int main(int, char**) {
+
+  double cost;
+
+  airbag::stack_trace::register_thread();
+  size_t count = nested(80, cost);
+  printf("registered thread: %zu frames, %.1f ns/capture\n", count, cost);
+
+  std::thread([&] { count = nested(80, cost); }).join();
+  printf("unregistered thread: %zu frames, %.1f ns/capture\n", count, cost);
+
+  return 0;
+}
@@ -0,0 +1,107 @@
+#include <airbag/stop_token.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+constexpr unsigned subsystems = 16;
+constexpr unsigned callbacks = 10'000;
+constexpr unsigned pollers = 256;
+
+
+using clock_type = std::chrono::steady_clock;
+
+double elapsed_us(clock_type::time_point started) {
+  return std::chrono::duration<double, std::micro>(clock_type::now() - started).count();
+}
+
+
+int main(int, char**) {
+
+  // process -> subsystems -> tasks
+  airbag::stop_source process;
+  std::vector<airbag::stop_source> children;
+  for(unsigned i = 0; i != subsystems; ++i)
+    children.emplace_back(process.token());
+  std::vector<airbag::stop_source> tasks;
+  for(unsigned i = 0; i != pollers; ++i)
+    tasks.emplace_back(children[i % subsystems].token());
+
+  std::atomic<unsigned> invoked{0};
+  auto const count = [&invoked] { invoked.fetch_add(1, std::memory_order_relaxed); };
+  using callback_type = airbag::stop_callback<decltype(count)>;
+  std::vector<std::unique_ptr<callback_type>> registered(callbacks);
+
+  auto started = clock_type::now();
+  for(unsigned i = 0; i != callbacks; ++i)
+    registered[i] = std::make_unique<callback_type>(tasks[i % pollers].token(), count);
+  printf("register: %.1f ns/callback\n", elapsed_us(started) * 1000 / callbacks);
+
+  started = clock_type::now();
+  for(unsigned i = 0; i < callbacks; i += 2)
+    registered[i].reset();
+  for(unsigned i = 0; i < callbacks; i += 2)
+    registered[i] = std::make_unique<callback_type>(tasks[i % pollers].token(), count);
+  printf("deregister and register again: %.1f ns/callback\n", elapsed_us(started) * 2000 / callbacks);
+
+  std::atomic<unsigned> ready{0}, noticed{0};
+  std::atomic<uint64_t> polls{0};
+  std::vector<std::thread> threads;
+  for(unsigned i = 0; i != pollers; ++i)
+    threads.emplace_back([&, token = tasks[i].token()] {
+      ready.fetch_add(1);
+      uint64_t n = 0;
+      while(!token.stop_requested()) {
+        ++n;
+        if((n & 1023) == 0)
+          std::this_thread::yield();
+      }
+      noticed.fetch_add(1);
+      polls.fetch_add(n);
+    });
+  while(ready.load() != pollers)
+    std::this_thread::yield();
+  auto const polling = clock_type::now();
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  started = clock_type::now();
+  double const polled = std::chrono::duration<double>(started - polling).count();
+  process.request_stop();
+  double const stop_cost = elapsed_us(started);
+  while(noticed.load() != pollers)
+    std::this_thread::yield();
+  double const notice = elapsed_us(started);
+  for(auto& each: threads)
+    each.join();
+
+  printf("request_stop: %u callbacks in %.1f us\n", invoked.load(), stop_cost);
+  printf("%u pollers: all noticed in %.1f us, %.0f M polls/s\n", pollers, notice,
+         double(polls.load()) / polled / 1e6);
+
+  // Callback destroyed by another thread while it runs or is about to run:
+  // destructor waits for it
+  constexpr unsigned rounds = 1000;
+  unsigned unfinished = 0;
+  for(unsigned round = 0; round != rounds; ++round) {
+    airbag::stop_source source;
+    std::atomic_bool running{false};
+    bool finished = false;
+    auto const slow = [&] {
+      running.store(true);
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+      finished = true;
+    };
+    auto callback = std::make_unique<airbag::stop_callback<decltype(slow)>>(source.token(), slow);
+    std::thread stopper{[&] { source.request_stop(); }};
+    while(round % 2 == 0 && !running.load())
+      std::this_thread::yield();
+    callback.reset();
+    unfinished += running.load() && !finished;
+    stopper.join();
+  }
+  printf("destroyed while invoked: %u of %u callbacks unfinished\n", unfinished, rounds);
+  return unfinished == 0 ? 0 : 1;
+}
@@ -1,13 +1,19 @@
 #include <airbag/process_error.hpp>
 #include <airbag/thread_error.hpp>
 #include <airbag/minidump.hpp>
+#include <airbag/guarded.hpp>
 
 
 airbag::process_error process_error;
 airbag::minidump minidump;
+int volatile* volatile bad_pointer = nullptr;
 
 int main(int, char**) {
 
+  // Recovered fault before and after hooks are installed
+  if(airbag::guarded([] { return *bad_pointer; }))
+    return 2;
+
   process_error.on_pure_call([] {
     fprintf(stderr, "Oops: pure virtual function call\n");
   });
@@ -21,6 +27,10 @@ int main(int, char**) {
               minidump.last_error().message().data());
   });
 
+  for(int i = 0; i != 100; ++i)
+    if(airbag::guarded([] { return *bad_pointer; }))
+      return 2;
+
   thread_local airbag::thread_error thread_error;
   thread_error.on_terminate([](char const* message){
     fprintf(stderr, "%s\n", message);
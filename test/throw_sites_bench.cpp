@@ -0,0 +1,100 @@
+#include <airbag/throw_sites.hpp>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <typeinfo>
+
+
+constexpr unsigned throws = 200'000;
+
+
+using clock_type = std::chrono::steady_clock;
+
+
+struct parse_error {
+  int position;
+};
+
+
+__attribute__((noinline)) int parse(int position) {
+  if(position >= 0)
+    throw parse_error{position};
+  return position;
+}
+
+
+__attribute__((noinline)) int lookup(int key) {
+  if(key >= 0)
+    throw std::out_of_range{"no such key"};
+  return key;
+}
+
+
+// Caught exceptions of a hot path, ns per throw
+double hot_path(unsigned n) {
+  unsigned caught = 0;
+  auto const started = clock_type::now();
+  for(unsigned i = 0; i != n; ++i)
+    try {
+      parse(int(i));
+    } catch(parse_error const&) {
+      ++caught;
+    }
+  auto const elapsed = std::chrono::duration<double, std::nano>(clock_type::now() - started);
+  return elapsed.count() / caught;
+}
+
+
+int main(int, char**) {
+
+  hot_path(throws / 10); // warm up
+  double const disabled = hot_path(throws);
+  printf("disabled: %.1f ns/throw\n", disabled);
+
+  airbag::throw_sites::enable();
+  double const enabled = hot_path(throws);
+  printf("enabled: %.1f ns/throw (%+.1f)\n", enabled, enabled - disabled);
+
+  airbag::throw_sites::enable(64);
+  double const sampled = hot_path(throws);
+  printf("enabled, 1 in 64 sampled: %.1f ns/throw (%+.1f)\n", sampled, sampled - disabled);
+
+  // What interposer adds to a throw, measured alone as throw itself is noisy
+  constexpr unsigned records = 10'000'000;
+  void* const site = reinterpret_cast<void*>(&parse);
+  auto started = clock_type::now();
+  for(unsigned i = 0; i != records; ++i)
+    airbag::throw_sites::record(site, &typeid(parse_error));
+  printf("record, 1 in 64 sampled: %.1f ns\n",
+         std::chrono::duration<double, std::nano>(clock_type::now() - started).count() / records);
+  airbag::throw_sites::enable();
+  started = clock_type::now();
+  for(unsigned i = 0; i != records; ++i)
+    airbag::throw_sites::record(site, &typeid(parse_error));
+  printf("record: %.1f ns\n",
+         std::chrono::duration<double, std::nano>(clock_type::now() - started).count() / records);
+  airbag::throw_sites::disable();
+  started = clock_type::now();
+  for(unsigned i = 0; i != records; ++i)
+    airbag::throw_sites::record(site, &typeid(parse_error));
+  printf("record, disabled: %.1f ns\n",
+         std::chrono::duration<double, std::nano>(clock_type::now() - started).count() / records);
+
+  airbag::throw_sites::enable(64);
+  airbag::throw_sites::clear();
+  for(unsigned i = 0; i != 3000; ++i) {
+    try { parse(int(i)); } catch(parse_error const&) {}
+    if(i % 3 == 0)
+      try { lookup(int(i)); } catch(std::exception const&) {}
+  }
+
+  auto const sites = airbag::throw_sites::top(10);
+  for(auto const& s: sites)
+    printf("%p %s: %llu throws, %.0f/s, %zu frames sampled\n", s.address, s.type->name(),
+           (unsigned long long)s.count, s.per_second, s.frames_count);
+
+  bool const passed = sites.size() == 2 && sites[0].count == 3000 && sites[1].count == 1000
+                   && sites[0].frames_count != 0;
+  printf("%s\n", passed ? "passed" : "failed");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,132 @@
+#include <airbag/watchdog.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+
+constexpr unsigned iterations = 100'000'000; // per thread
+
+
+using clock_type = std::chrono::steady_clock;
+
+
+// Small unit of work, not to be folded by compiler
+inline unsigned step(unsigned x) noexcept {
+  x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  return x;
+}
+
+
+__attribute__((noinline)) void stuck_in_lock() {
+  std::this_thread::sleep_for(std::chrono::milliseconds{300});
+}
+
+
+double iteration_ns(unsigned threads_count, bool beating, airbag::watchdog& watchdog) {
+  unsigned const cores = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+  std::vector<std::thread> threads;
+  std::atomic<unsigned> ready{0};
+  std::atomic_bool go{false};
+  std::atomic<unsigned> sink{0};
+
+  for(unsigned t = 0; t != threads_count; ++t)
+    threads.emplace_back([&, t] {
+      auto heartbeat = watchdog.attach(std::chrono::seconds{10});
+      ++ready;
+      while(!go)
+        std::this_thread::yield();
+      unsigned x = t + 1;
+      if(beating)
+        for(unsigned i = 0; i != iterations; ++i) {
+          x = step(x);
+          heartbeat.beat();
+        }
+      else
+        for(unsigned i = 0; i != iterations; ++i)
+          x = step(x);
+      sink += x;
+    });
+
+  while(ready != threads_count)
+    std::this_thread::yield();
+  auto const started = clock_type::now();
+  go = true;
+  for(auto& thread: threads)
+    thread.join();
+  auto const elapsed = clock_type::now() - started;
+  unsigned const busy = threads_count < cores ? threads_count : cores;
+  return std::chrono::duration<double, std::nano>(elapsed).count() * busy
+       / (double(iterations) * threads_count) + (sink == 0 ? 1e-9 : 0.);
+}
+
+
+int main(int argc, char** argv) {
+
+  airbag::minidump minidump;
+  airbag::watchdog watchdog;
+  std::atomic<unsigned> reported{0};
+  std::atomic<size_t> frames{0};
+  watchdog.period(std::chrono::milliseconds{10})
+          .on_stall([&](airbag::watchdog::stall const& s) {
+            printf("stall of %s (%llu): %lld ms after %llu beats, %zu frames\n", s.name,
+                   (unsigned long long)s.thread_id,
+                   (long long)std::chrono::duration_cast<std::chrono::milliseconds>(s.elapsed).count(),
+                   (unsigned long long)s.beats, s.frames_count);
+            for(size_t i = 0; i != s.frames_count && i != 4; ++i)
+              printf("  #%zu %p\n", i, s.frames[i]);
+            ++reported;
+            frames = s.frames_count;
+          });
+  if(argc > 1) {
+    minidump.directory(argv[1]);
+    watchdog.dump_to(&minidump);
+  }
+#if defined(__linux__)
+  // Signal handled by the application is not taken, another one is set instead
+  struct sigaction own;
+  std::memset(&own, 0, sizeof(own));
+  own.sa_handler = [](int) { };
+  sigemptyset(&own.sa_mask);
+  sigaction(airbag::watchdog::signal_number(), &own, nullptr);
+  if(watchdog.start()) {
+    printf("watchdog took signal handled by application\n");
+    return 1;
+  }
+  airbag::watchdog::signal_number(SIGRTMAX - 5);
+#endif
+  if(!watchdog.start()) {
+    printf("unable to start watchdog\n");
+    return 1;
+  }
+
+  for(unsigned threads_count: {1u, 4u}) {
+    double const plain = iteration_ns(threads_count, false, watchdog);
+    double const beating = iteration_ns(threads_count, true, watchdog);
+    printf("%u threads: %.3f ns/iteration, %.3f ns with beat (%+.3f)\n",
+           threads_count, plain, beating, beating - plain);
+  }
+
+  // One thread stalls for 300 ms with budget of 50 ms, the idle one is never reported
+  std::thread stalled([&] {
+    auto heartbeat = watchdog.attach(std::chrono::milliseconds{50}, "stalled");
+    for(unsigned i = 0; i != 1000; ++i)
+      heartbeat.beat();
+    stuck_in_lock();
+    heartbeat.beat();
+  });
+  std::thread idle([&] {
+    auto heartbeat = watchdog.attach(std::chrono::milliseconds{50}, "idle");
+    heartbeat.idle();
+    std::this_thread::sleep_for(std::chrono::milliseconds{300});
+  });
+  stalled.join();
+  idle.join();
+  watchdog.stop();
+
+  bool const passed = reported == 1 && frames != 0;
+  printf("%u stall(s) reported: %s\n", unsigned(reported), passed ? "passed" : "failed");
+  return passed ? 0 : 1;
+}